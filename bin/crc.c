@@ -0,0 +1,21 @@
+#include <c_types.h>
+
+#include "crc.h"
+
+// CRC-16/CCITT, polynomial 0x1021. Start with 0xFFFF; the result of one call
+// can be passed as the starting value of the next to checksum split buffers:
+uint16_t ICACHE_FLASH_ATTR
+crc16 (const void *data, const size_t len, uint16_t crc)
+{
+	const uint8_t *c = data;
+
+	for (size_t i = 0; i < len; i++) {
+		crc ^= (uint16_t)c[i] << 8;
+		for (uint8_t j = 8; j; j--)
+			crc = (crc & 0x8000)
+				? (crc << 1) ^ 0x1021
+				: (crc << 1);
+	}
+
+	return crc;
+}
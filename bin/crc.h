@@ -0,0 +1 @@
+uint16_t crc16 (const void *data, const size_t len, uint16_t crc);
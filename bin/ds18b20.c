@@ -2,12 +2,14 @@
 #include <osapi.h>
 
 #include "ds18b20.h"
+#include "log.h"
 #include "missing.h"
 #include "onewire.h"
 
 #define CMD_MATCH_ROM	0x55
 #define CMD_CONVERSION	0x44
 #define CMD_GET_RESULT	0xBE
+#define CMD_SET_CONFIG	0x4E
 
 const char * ICACHE_FLASH_ATTR
 ds18b20_status_string (const enum ds18b20_status status)
@@ -64,10 +66,33 @@ ds18b20_request (const uint8_t *addr)
 	return DS18B20_SUCCESS;
 }
 
+// Set the resolution of a sensor, in bits. This only writes the scratchpad,
+// so the sensor returns to the resolution in its EEPROM after a power cycle:
+enum ds18b20_status ICACHE_FLASH_ATTR
+ds18b20_resolution (const uint8_t *addr, const uint8_t bits)
+{
+	// Resetting the bus fails if no presence is signaled:
+	if (!onewire_reset())
+		return DS18B20_ERROR_BUS;
+
+	// Select and write the alarm registers and the config register.
+	// We don't use the alarms, so set them to their widest range:
+	select(addr);
+	onewire_write(CMD_SET_CONFIG);
+	onewire_write(0x7F);
+	onewire_write(0x80);
+	onewire_write(((bits - DS18B20_RESOLUTION_MIN) << 5) | 0x1F);
+	return DS18B20_SUCCESS;
+}
+
+// Log the status of a sensor, and return it
 static inline enum ds18b20_status
-print_status (enum ds18b20_status status)
+print_status (const uint8_t *addr, enum ds18b20_status status)
 {
-	os_printf("%s\n", ds18b20_status_string(status));
+	log_debug("%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x: %s\n",
+		addr[0], addr[1], addr[2], addr[3],
+		addr[4], addr[5], addr[6], addr[7],
+		ds18b20_status_string(status));
 	return status;
 }
 
@@ -81,14 +106,9 @@ ds18b20_result (const uint8_t *addr, int32_t *celsius)
 		uint32_t	l[2];	// First 8 bytes
 	} data;
 
-	// Start log line:
-	os_printf("%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x: ",
-		addr[0], addr[1], addr[2], addr[3],
-		addr[4], addr[5], addr[6], addr[7]);
-
 	// Resetting the bus fails if no presence is signaled:
 	if (!onewire_reset())
-		return print_status(DS18B20_ERROR_BUS);
+		return print_status(addr, DS18B20_ERROR_BUS);
 
 	// Select and issue "read scratchpad" command:
 	select(addr);
@@ -100,11 +120,14 @@ ds18b20_result (const uint8_t *addr, int32_t *celsius)
 
 	// If all data bytes are 0xFF, nobody responded:
 	if (data.l[0] == 0xFFFFFFFF && data.l[1] == 0xFFFFFFFF)
-		return print_status(DS18B20_ERROR_SILENCE);
+		return print_status(addr, DS18B20_ERROR_SILENCE);
 
 	// Check CRC:
 	if (!check_crc(data.c))
-		return print_status(DS18B20_ERROR_CHECKSUM);
+		return print_status(addr, DS18B20_ERROR_CHECKSUM);
+
+	// Below 12 bits resolution, the lowest bits are undefined:
+	data.t[0] &= ~((1 << (3 - ((data.c[4] >> 5) & 3))) - 1);
 
 	// Temperature measurement is given in 1/16 degrees C,
 	// convert to degrees * 10000:
@@ -112,10 +135,13 @@ ds18b20_result (const uint8_t *addr, int32_t *celsius)
 
 	// Reading 85 degrees means we've got the reset value:
 	if (*celsius == 850000)
-		return print_status(DS18B20_ERROR_RESET_VAL);
+		return print_status(addr, DS18B20_ERROR_RESET_VAL);
 
 	// Satisfy our curiosity:
-	os_printf("%d\n", *celsius);
+	log_debug("%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x: %d\n",
+		addr[0], addr[1], addr[2], addr[3],
+		addr[4], addr[5], addr[6], addr[7],
+		*celsius);
 
 	return DS18B20_SUCCESS;
 }
@@ -1,3 +1,8 @@
+// Range of sensor resolutions in bits. The conversion time doubles with every
+// bit, up to 750 ms at the highest resolution:
+#define DS18B20_RESOLUTION_MIN	9
+#define DS18B20_RESOLUTION_MAX	12
+
 // Sensor status flags. These are in a specific order, from "least alive" to
 // "most alive". The first one should be zero to indicate "not probed yet".
 enum ds18b20_status {
@@ -11,4 +16,5 @@ enum ds18b20_status {
 
 enum ds18b20_status ds18b20_request (const uint8_t *addr);
 enum ds18b20_status ds18b20_result  (const uint8_t *addr, int32_t *celsius);
+enum ds18b20_status ds18b20_resolution (const uint8_t *addr, const uint8_t bits);
 const char *ds18b20_status_string   (const enum ds18b20_status);
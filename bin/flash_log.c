@@ -0,0 +1,312 @@
+#include <os_type.h>
+#include <osapi.h>
+#include <user_interface.h>
+#include <spi_flash.h>
+
+#include "crc.h"
+#include "flash_log.h"
+#include "log.h"
+#include "missing.h"
+#include "rtc_mem.h"
+#include "sensors.h"
+
+// The flash log is a ring of fixed-size entries spread over a range of flash
+// sectors. Every entry has a sequence number that increases by one for each
+// append, so the location of an entry follows directly from its sequence
+// number. A sector is erased when the first entry is written to it, which
+// drops the oldest entries when the ring is full. Because the ring rotates
+// through all sectors in turn, every sector sees the same amount of erases.
+// The cursor in RTC memory remembers where to write and read next, so that
+// we only need to scan flash when RTC memory was lost.
+// Every record is logged before it is sent, and the sequence number doubles
+// as the record's identity at the server. Records stay in the log until the
+// server acknowledges them, so a record that is sent twice can be recognized.
+// On acknowledgement, the newest record of the upload gets its marker
+// cleared in flash, which needs no erase, so that a scan can tell the sent
+// records from the unsent ones.
+// The sequence numbers start from zero when the log is empty, so a new log
+// draws a random epoch, that every entry carries along. Together with the
+// epoch, the sequence number identifies a record even after the log was
+// erased and counts from zero again.
+// Entry times are clock times, and the clock only carries on across a wakeup
+// from deep sleep. After any other reset it starts over, so the cursor keeps
+// the first entry that was logged since, and the ones before it are read
+// back without a time.
+
+// Entry header as stored in flash, followed by the record:
+struct entry {
+	uint32_t	unsent;		// Cleared once this and older entries are sent
+	uint16_t	crc;		// CRC over the rest of the entry
+	uint16_t	size;		// Record size
+	uint32_t	seq;		// Sequence number
+	uint32_t	epoch;		// Epoch of the sequence numbers
+	uint32_t	time;		// Clock time at which record was logged
+	uint32_t	data[];		// Record
+};
+
+// Cursor structure in RTC memory:
+struct cursor {
+	uint32_t	sig;
+	uint32_t	head;		// Sequence number of next entry to write
+	uint32_t	tail;		// Sequence number of oldest unsent entry
+	uint32_t	dated;		// Sequence number of first entry in this clock
+};
+
+#define CURSOR_SIG	0xF1A5F10C
+#define ENTRY_UNSENT	0xFFFFFFFF
+
+// Largest supported entry, header included:
+#define ENTRY_MAX	(sizeof(struct entry) + FLASH_LOG_RECORD_MAX)
+
+// Round upwards to next 4 bytes:
+#define ROUNDUP(x)	(((x) + 3) & ~0x03)
+
+static struct cursor cursor;
+
+// Fail to compile if the cursor outgrows its area in RTC memory:
+typedef char cursor_size_check[(sizeof(struct cursor) <= (RTC_MEM_END - RTC_MEM_FLASH_LOG) * 4) ? 1 : -1];
+
+// Epoch of the sequence numbers, from the newest entry:
+static uint32_t epoch;
+
+// Entry buffer, aligned as the flash functions require:
+static uint32_t buf[ROUNDUP(ENTRY_MAX) / 4];
+static struct entry *entry = (struct entry *) buf;
+
+// Size of one entry in flash
+static inline size_t
+entry_size (void)
+{
+	return ROUNDUP(sizeof(struct entry) + sensors_record_size());
+}
+
+// Number of entries per sector
+static inline uint32_t
+per_sector (void)
+{
+	return SPI_FLASH_SEC_SIZE / entry_size();
+}
+
+// Flash sector in which a given entry lives
+static inline uint32_t
+entry_sector (const uint32_t seq)
+{
+	return FLASH_LOG_SECTOR + (seq / per_sector()) % FLASH_LOG_SECTORS;
+}
+
+// Flash address of a given entry
+static inline uint32_t
+entry_addr (const uint32_t seq)
+{
+	return entry_sector(seq) * SPI_FLASH_SEC_SIZE
+		+ (seq % per_sector()) * entry_size();
+}
+
+// Checksum an entry
+static inline uint16_t
+entry_crc (void)
+{
+	return crc16(&entry->size, entry_size() - sizeof(entry->unsent) - sizeof(entry->crc), 0xFFFF);
+}
+
+// Read an entry into the entry buffer, check its integrity
+static bool ICACHE_FLASH_ATTR
+entry_load (const uint32_t seq)
+{
+	if (spi_flash_read(entry_addr(seq), buf, entry_size()) != SPI_FLASH_RESULT_OK)
+		return false;
+
+	return entry->seq  == seq
+	    && entry->size == sensors_record_size()
+	    && entry->crc  == entry_crc();
+}
+
+// Write the cursor to RTC memory
+static void ICACHE_FLASH_ATTR
+cursor_save (void)
+{
+	rtc_mem_write(RTC_MEM_FLASH_LOG, &cursor, sizeof(cursor));
+}
+
+// Find the newest entry in flash
+static void ICACHE_FLASH_ATTR
+recover (void)
+{
+	const uint32_t keep = (FLASH_LOG_SECTORS - 1) * per_sector();
+	bool found = false;
+	uint32_t head = 0, tail;
+
+	// Find the sector whose first entry has the highest sequence number.
+	// A valid entry at slot 0 means the sector was erased for that entry:
+	for (uint32_t sector = 0; sector < FLASH_LOG_SECTORS; sector++) {
+		uint32_t addr = (FLASH_LOG_SECTOR + sector) * SPI_FLASH_SEC_SIZE;
+
+		if (spi_flash_read(addr, buf, entry_size()) != SPI_FLASH_RESULT_OK)
+			continue;
+
+		if (entry_sector(entry->seq) != FLASH_LOG_SECTOR + sector)
+			continue;
+
+		if (entry->seq % per_sector() != 0 || !entry_load(entry->seq))
+			continue;
+
+		if (!found || entry->seq >= head) {
+			head  = entry->seq;
+			found = true;
+		}
+	}
+
+	// Walk the slots in that sector up to the first invalid one:
+	if (found)
+		while (++head % per_sector() && entry_load(head))
+			continue;
+
+	// Walk back to the newest entry that was sent, or as far as the log
+	// goes. The entries after it are still pending:
+	tail = head;
+	while (tail > 0 && head - tail < keep && entry_load(tail - 1) && entry->unsent == ENTRY_UNSENT)
+		tail--;
+
+	cursor.sig  = CURSOR_SIG;
+	cursor.head = head;
+	cursor.tail = tail;
+
+	// Without the cursor, we can't tell which entries the clock covers:
+	cursor.dated = head;
+
+	log_debug("%s: next sequence number %u, %u records pending\n", __FUNCTION__, head, head - tail);
+	cursor_save();
+}
+
+// Load the cursor, or recover it from flash if RTC memory was lost
+void ICACHE_FLASH_ATTR
+flash_log_init (const bool warm)
+{
+	if (warm && rtc_mem_read(RTC_MEM_FLASH_LOG, &cursor, sizeof(cursor))
+	 && cursor.sig == CURSOR_SIG && cursor.head - cursor.tail
+			<= FLASH_LOG_SECTORS * per_sector())
+		log_debug("%s: %u records pending\n", __FUNCTION__,
+			flash_log_pending());
+	else
+		recover();
+
+	// The clock started over, the entries so far are from before:
+	if (!rtc_mem_clock_kept() && cursor.dated != cursor.head) {
+		cursor.dated = cursor.head;
+		cursor_save();
+	}
+
+	// Carry on the epoch of the newest entry, or draw a new one if there
+	// is none:
+	epoch = (cursor.head > 0 && entry_load(cursor.head - 1)) ? entry->epoch : os_random();
+}
+
+// Append a record to the log
+bool ICACHE_FLASH_ATTR
+flash_log_append (const void *record, const uint32_t time)
+{
+	const uint32_t seq  = cursor.head;
+	const uint32_t keep = (FLASH_LOG_SECTORS - 1) * per_sector();
+
+	if (cursor.sig != CURSOR_SIG)
+		return false;
+
+	// Erase the sector when we enter it, and forget about the oldest
+	// entries if they were in it:
+	if (seq % per_sector() == 0) {
+		if (spi_flash_erase_sector(entry_sector(seq)) != SPI_FLASH_RESULT_OK) {
+			log_error("%s: erase failed!\n", __FUNCTION__);
+			return false;
+		}
+		if (seq - cursor.tail > keep)
+			cursor.tail = seq - keep;
+	}
+
+	// Fill the entry buffer:
+	os_memset(buf, 0, sizeof(buf));
+	os_memcpy(entry->data, record, sensors_record_size());
+	entry->unsent = ENTRY_UNSENT;
+	entry->size   = sensors_record_size();
+	entry->seq    = seq;
+	entry->epoch  = epoch;
+	entry->time   = time;
+	entry->crc    = entry_crc();
+
+	// Advance the cursor even if the write fails, so that we don't write
+	// twice to the same location without an erase:
+	cursor.head++;
+	cursor_save();
+
+	if (spi_flash_write(entry_addr(seq), buf, entry_size()) != SPI_FLASH_RESULT_OK) {
+		log_error("%s: write failed!\n", __FUNCTION__);
+		return false;
+	}
+
+	log_debug("%s: logged record %u\n", __FUNCTION__, seq);
+	return true;
+}
+
+// Read the n'th pending record, counting from the oldest, and the time at
+// which it was logged, or FLASH_LOG_UNDATED if the clock started over since.
+// With NULL pointers, just check that the record is readable:
+bool ICACHE_FLASH_ATTR
+flash_log_read (const uint32_t n, void *record, uint32_t *time)
+{
+	if (n >= flash_log_pending())
+		return false;
+
+	if (!entry_load(cursor.tail + n)) {
+		log_error("%s: record %u corrupt!\n", __FUNCTION__, cursor.tail + n);
+		return false;
+	}
+
+	if (record != NULL)
+		os_memcpy(record, entry->data, sensors_record_size());
+
+	if (time != NULL)
+		*time = (cursor.tail + n < cursor.dated) ? FLASH_LOG_UNDATED : entry->time;
+
+	return true;
+}
+
+// Mark the oldest n pending records as sent
+void ICACHE_FLASH_ATTR
+flash_log_consume (uint32_t n)
+{
+	static uint32_t sent = 0;
+
+	if (n > flash_log_pending())
+		n = flash_log_pending();
+
+	if (n == 0)
+		return;
+
+	cursor.tail += n;
+	cursor_save();
+
+	// Clear the marker of the newest sent entry, if it's still there, so
+	// that a scan of the log knows where the pending records start:
+	if (entry_load(cursor.tail - 1) && spi_flash_write(entry_addr(cursor.tail - 1), &sent, sizeof(sent)) != SPI_FLASH_RESULT_OK)
+		log_error("%s: write failed!\n", __FUNCTION__);
+}
+
+// Number of records waiting to be sent
+uint32_t ICACHE_FLASH_ATTR
+flash_log_pending (void)
+{
+	return (cursor.sig == CURSOR_SIG) ? cursor.head - cursor.tail : 0;
+}
+
+// Sequence number of the n'th pending record
+uint32_t ICACHE_FLASH_ATTR
+flash_log_seq (const uint32_t n)
+{
+	return cursor.tail + n;
+}
+
+// Epoch of the sequence numbers, which only changes when they start over
+uint32_t ICACHE_FLASH_ATTR
+flash_log_epoch (void)
+{
+	return epoch;
+}
@@ -0,0 +1,25 @@
+// The log occupies a reserved range of 4 KB flash sectors, 1 MB into flash,
+// well clear of the firmware images at 0x00000 and 0x40000:
+#define FLASH_LOG_SECTOR	0x100
+#define FLASH_LOG_SECTORS	64
+
+// Maximum number of logged records to upload along with the current one,
+// and maximum number of uploads per wakeup while draining the log:
+#define FLASH_LOG_BATCH		16
+#define FLASH_LOG_UPLOADS	4
+
+// Time of a pending record that was logged before the clock last started
+// over, after a reset other than a wakeup from deep sleep. Its age is unknown:
+#define FLASH_LOG_UNDATED	UINT32_MAX
+
+// Largest record that fits in an entry. The sensors module fails to compile
+// if its record is larger:
+#define FLASH_LOG_RECORD_MAX	112
+
+void flash_log_init (const bool warm);
+bool flash_log_append (const void *record, const uint32_t time);
+bool flash_log_read (const uint32_t n, void *record, uint32_t *time);
+void flash_log_consume (uint32_t n);
+uint32_t flash_log_pending (void);
+uint32_t flash_log_seq (const uint32_t n);
+uint32_t flash_log_epoch (void);
@@ -0,0 +1,360 @@
+#include <os_type.h>
+#include <osapi.h>
+#include <user_interface.h>
+
+#include "ds18b20.h"
+#include "fourier.h"
+#include "missing.h"
+#include "rtc_mem.h"
+#include "sensors.h"
+
+// In the Fourier soil model, a temperature wave at the surface travels down
+// into the soil, and at depth z it is damped by exp(-z/d) and delayed by z/d
+// radians, where d is the damping depth. To fit the model, we track the
+// mean and the first Fourier coefficients of the wave at each sensor, as
+// exponentially weighted moving averages, updated from each record. That
+// gives the amplitude and phase of the wave at each depth. A least squares
+// fit of the log amplitudes over depth gives the damping depth and the
+// amplitude at the surface, and a fit of the phases gives the time of the
+// peak. Everything is in fixed point. Angles are in units of 1/65536 turn.
+
+// Running averages per sensor, in 1/256 of the sensor's 1/16 degrees C:
+struct coeffs {
+	int32_t		mean;
+	int32_t		cos;		// Average of (T - mean) * cos(wt)
+	int32_t		sin;		// Average of (T - mean) * sin(wt)
+	uint32_t	clock;		// Clock time of last update
+};
+
+// State in RTC memory:
+struct state {
+	uint32_t	sig;
+	uint32_t	start;		// Clock time of first update
+	uint32_t	valid;		// Bitmask of sensors with coefficients
+	struct coeffs	coeffs[FOURIER_SENSORS_MAX];
+};
+
+#define STATE_SIG	0xF0C1E125
+
+// CORDIC gain compensation in Q15, and arctangents of 2^-i:
+#define CORDIC_K	19898
+#define CORDIC_STEPS	14
+
+static const int16_t cordic_atan[CORDIC_STEPS] = {
+	8192, 4836, 2555, 1297, 651, 326, 163, 81, 41, 20, 10, 5, 3, 1,
+};
+
+// Powers 2^(2^-k) for k = 1..8, in Q15:
+static const uint16_t exp2_frac[8] = {
+	46341, 38968, 35734, 34219, 33486, 33125, 32946, 32857,
+};
+
+// log2(e) * 65536 * 10, to turn a slope in Q16 log2 per cm into mm:
+#define LOG2E_MM	945485LL
+
+static struct state state;
+
+// Save state to RTC memory
+static inline void
+state_save (void)
+{
+	rtc_mem_write(RTC_MEM_FOURIER, &state, sizeof(state));
+}
+
+// Get cosine and sine of an angle, in Q15
+static void ICACHE_FLASH_ATTR
+cordic_rotate (const uint16_t angle, int32_t *cos, int32_t *sin)
+{
+	int32_t x = CORDIC_K, y = 0, z = (int16_t) angle;
+	bool flip = false;
+
+	// Rotate into the right half plane, where CORDIC converges:
+	if (z > 16384 || z < -16384) {
+		z = (int16_t) (z + 32768);
+		flip = true;
+	}
+
+	for (int i = 0; i < CORDIC_STEPS; i++) {
+		const int32_t dx = x >> i, dy = y >> i;
+
+		if (z >= 0) {
+			x -= dy;
+			y += dx;
+			z -= cordic_atan[i];
+		}
+		else {
+			x += dy;
+			y -= dx;
+			z += cordic_atan[i];
+		}
+	}
+
+	*cos = flip ? -x : x;
+	*sin = flip ? -y : y;
+}
+
+// Get magnitude and angle of a vector
+static void ICACHE_FLASH_ATTR
+cordic_vector (int32_t x, int32_t y, uint32_t *mag, uint16_t *angle)
+{
+	int32_t z = 0;
+	int shift = 0;
+
+	// Rotate into the right half plane:
+	if (x < 0) {
+		x = -x;
+		y = -y;
+		z = 32768;
+	}
+
+	// Scale up small vectors for precision:
+	while (x < (1 << 20) && y < (1 << 20) && y > -(1 << 20) && shift < 16) {
+		x <<= 1;
+		y <<= 1;
+		shift++;
+	}
+
+	for (int i = 0; i < CORDIC_STEPS; i++) {
+		const int32_t dx = x >> i, dy = y >> i;
+
+		if (y > 0) {
+			x += dy;
+			y -= dx;
+			z += cordic_atan[i];
+		}
+		else {
+			x -= dy;
+			y += dx;
+			z -= cordic_atan[i];
+		}
+	}
+
+	*mag   = ((int64_t) x * CORDIC_K >> 15) >> shift;
+	*angle = z;
+}
+
+// Get base 2 logarithm of a positive value, in Q8
+static int32_t ICACHE_FLASH_ATTR
+log2_q8 (uint32_t val)
+{
+	int32_t exp = 0;
+	uint32_t m;
+
+	while (exp < 31 && val >> (exp + 1))
+		exp++;
+
+	// Normalize to [1, 2) in Q15:
+	m = (exp > 15) ? val >> (exp - 15) : val << (15 - exp);
+
+	// Each squaring yields one bit of the fraction:
+	exp <<= 8;
+	for (int bit = 7; bit >= 0; bit--) {
+		m = (m * m) >> 15;
+		if (m >= 65536) {
+			m >>= 1;
+			exp |= 1 << bit;
+		}
+	}
+
+	return exp;
+}
+
+// Get 2 to the power of a value in Q8
+static uint32_t ICACHE_FLASH_ATTR
+exp2_q8 (const int32_t val)
+{
+	const int32_t exp = val >> 8;
+	uint32_t m = 32768;
+
+	for (int bit = 7; bit >= 0; bit--)
+		if (val & (1 << bit))
+			m = (m * exp2_frac[7 - bit]) >> 15;
+
+	if (exp < 0)
+		return 0;
+
+	return (exp > 15) ? m << (exp - 15) : m >> (15 - exp);
+}
+
+// Get integer square root
+static uint32_t ICACHE_FLASH_ATTR
+isqrt (uint64_t val)
+{
+	uint64_t root = 0, bit = 1ULL << 62;
+
+	while (bit > val)
+		bit >>= 2;
+
+	while (bit != 0) {
+		if (val >= root + bit) {
+			val  -= root + bit;
+			root  = (root >> 1) + bit;
+		}
+		else
+			root >>= 1;
+		bit >>= 2;
+	}
+
+	return root;
+}
+
+// Get angle of the wave at a given time
+static inline uint16_t
+wave_angle (const uint32_t clock)
+{
+	return ((uint64_t) (clock % FOURIER_PERIOD_SEC) << 16) / FOURIER_PERIOD_SEC;
+}
+
+// Restore state after deep sleep, or start over after a cold boot
+void ICACHE_FLASH_ATTR
+fourier_init (const bool warm)
+{
+	if (warm && rtc_mem_read(RTC_MEM_FOURIER, &state, sizeof(state)) && state.sig == STATE_SIG)
+		return;
+
+	os_memset(&state, 0, sizeof(state));
+}
+
+// Update the running averages from a new record
+void ICACHE_FLASH_ATTR
+fourier_update (const void *record, const uint32_t clock)
+{
+	int16_t reading[FOURIER_SENSORS_MAX];
+	uint8_t status[FOURIER_SENSORS_MAX];
+	uint32_t age[FOURIER_SENSORS_MAX];
+	const uint8_t nsensors = sensors_count();
+	uint32_t window;
+	int32_t cos, sin;
+
+	if (nsensors > FOURIER_SENSORS_MAX)
+		return;
+
+	sensors_unpack(record, reading, status, age);
+	cordic_rotate(wave_angle(clock), &cos, &sin);
+
+	if (state.sig != STATE_SIG) {
+		state.sig   = STATE_SIG;
+		state.start = clock;
+	}
+
+	window = clock - state.start;
+	if (window > FOURIER_TAU_SEC)
+		window = FOURIER_TAU_SEC;
+
+	for (uint8_t i = 0; i < nsensors; i++) {
+		struct coeffs *c = &state.coeffs[i];
+		const int32_t temp = (int32_t) reading[i] << 8;
+		int32_t alpha, dev;
+
+		// Only use fresh, successful readings:
+		if (status[i] != DS18B20_SUCCESS || age[i] > 0)
+			continue;
+
+		// First reading:
+		if (!(state.valid & (1 << i))) {
+			c->mean  = temp;
+			c->cos   = 0;
+			c->sin   = 0;
+			c->clock = clock;
+			state.valid |= 1 << i;
+			continue;
+		}
+
+		// Weight of the new reading, in Q16, by the time it covers. Until
+		// we have a time constant's worth of data, this is a plain
+		// average, which avoids a bias towards zero at the start:
+		alpha = (clock - c->clock >= window)
+			? 65536
+			: ((uint64_t) (clock - c->clock) << 16) / window;
+
+		c->mean += ((int64_t) (temp - c->mean) * alpha) >> 16;
+		dev = temp - c->mean;
+		c->cos  += ((((int64_t) dev * cos) >> 15) - c->cos) * alpha >> 16;
+		c->sin  += ((((int64_t) dev * sin) >> 15) - c->sin) * alpha >> 16;
+		c->clock = clock;
+	}
+
+	state_save();
+}
+
+// Fit the model to the current averages, returns false if there isn't
+// enough data yet
+bool ICACHE_FLASH_ATTR
+fourier_fit (struct fourier_fit *fit, const uint32_t clock)
+{
+	int32_t depth[FOURIER_SENSORS_MAX], logamp[FOURIER_SENSORS_MAX], phase[FOURIER_SENSORS_MAX];
+	uint32_t amp[FOURIER_SENSORS_MAX];
+	int64_t sz = 0, szz = 0, sl = 0, szl = 0, sp = 0, szp = 0, num, den;
+	int32_t slope, intercept, phase0;
+	uint64_t err = 0;
+	uint8_t n = 0;
+
+	// Wait until we've seen a full period:
+	if (state.sig != STATE_SIG || clock - state.start < FOURIER_PERIOD_SEC)
+		return false;
+
+	// Amplitude and phase at each depth where the wave is measurable:
+	for (uint8_t i = 0; i < sensors_count() && i < FOURIER_SENSORS_MAX; i++) {
+		const struct coeffs *c = &state.coeffs[i];
+		uint16_t angle;
+
+		if (!(state.valid & (1 << i)))
+			continue;
+
+		cordic_vector(c->cos, c->sin, &amp[n], &angle);
+		amp[n] *= 2;
+
+		if (amp[n] < FOURIER_AMPLITUDE_MIN << 8)
+			continue;
+
+		depth[n]  = FOURIER_DEPTH_TOP + i * FOURIER_DEPTH_STEP;
+		logamp[n] = log2_q8(amp[n]);
+
+		// Unwrap the phase relative to the depth above:
+		phase[n] = (n == 0)
+			? (int16_t) angle
+			: phase[n - 1] + (int16_t) (angle - (uint16_t) phase[n - 1]);
+
+		n++;
+	}
+
+	if (n < 2)
+		return false;
+
+	// Least squares fits of log amplitude and phase over depth:
+	for (uint8_t i = 0; i < n; i++) {
+		sz  += depth[i];
+		szz += depth[i] * depth[i];
+		sl  += logamp[i];
+		szl += depth[i] * logamp[i];
+		sp  += phase[i];
+		szp += depth[i] * phase[i];
+	}
+
+	den = n * szz - sz * sz;
+	num = n * szl - sz * sl;
+
+	// The amplitude must decrease with depth:
+	if (num >= 0)
+		return false;
+
+	// Slope in Q16 log2 per cm, and intercept in Q8:
+	slope     = num * 256 / den;
+	intercept = (sl - ((slope * sz) >> 8)) / n;
+	phase0    = (sp - (n * szp - sz * sp) * sz / den) / n;
+
+	// Amplitude error at each depth:
+	for (uint8_t i = 0; i < n; i++) {
+		const int32_t model = exp2_q8(intercept + ((slope * depth[i]) >> 8));
+		const int64_t diff = (int64_t) amp[i] - model;
+
+		err += diff * diff;
+	}
+
+	fit->depth     = -LOG2E_MM * den / (num * 256);
+	fit->amplitude = ((uint64_t) exp2_q8(intercept) * 625) >> 8;
+	fit->peak_age  = ((uint64_t) (uint16_t) (wave_angle(clock) - phase0) * FOURIER_PERIOD_SEC) >> 16;
+	fit->residual  = ((uint64_t) isqrt(err / n) * 625) >> 8;
+
+	return true;
+}
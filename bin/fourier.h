@@ -0,0 +1,28 @@
+// Period of the temperature wave to fit, and the time constant over which
+// its Fourier coefficients are averaged. For the annual wave, use a period
+// of 365 days and a time constant of a few months:
+#define FOURIER_PERIOD_SEC	86400UL
+#define FOURIER_TAU_SEC		(3 * 86400UL)
+
+// Depth of the top sensor, and the spacing between sensors, in cm:
+#define FOURIER_DEPTH_TOP	0
+#define FOURIER_DEPTH_STEP	20
+
+// Smallest amplitude at a depth that takes part in the fit, in 1/16 degrees
+// C. Below this, the wave drowns in the sensor's resolution:
+#define FOURIER_AMPLITUDE_MIN	2
+
+// Largest number of sensors supported:
+#define FOURIER_SENSORS_MAX	8
+
+// Fitted parameters of the wave, extrapolated to the surface:
+struct fourier_fit {
+	uint32_t	depth;		// Damping depth in mm
+	uint32_t	amplitude;	// Amplitude in degrees C * 10000
+	uint32_t	peak_age;	// Seconds since the last peak
+	uint32_t	residual;	// RMS amplitude error in degrees C * 10000
+};
+
+void fourier_init (const bool warm);
+void fourier_update (const void *record, const uint32_t clock);
+bool fourier_fit (struct fourier_fit *fit, const uint32_t clock);
@@ -1,108 +1,364 @@
 #include <ets_sys.h>
 #include <os_type.h>
+#include <osapi.h>
 #include <mem.h>
 #include <user_interface.h>
 
+#include "flash_log.h"
+#include "fourier.h"
 #include "http.h"
 #include "missing.h"
+#include "net.h"
+#include "packed.h"
+#include "rtc_mem.h"
 #include "sensors.h"
+#include "stream.h"
+#include "trace.h"
 
-#define HEAD_SIZE	100
-#define BODY_SIZE	1000
-#define POST_SIZE	HEAD_SIZE + BODY_SIZE
+// Datagrams carry the bare binary payload, without HTTP header:
+#if NET_UDP
+#undef  HTTP_BINARY
+#define HTTP_BINARY	1
+#endif
 
-// Static malloc'ed buffer:
-static char *post = NULL;
+#if HTTP_BINARY
+#define CONTENT_TYPE	"application/octet-stream"
+#else
+#define CONTENT_TYPE	"application/json"
+#endif
 
-// Allocate memory
-static bool ICACHE_FLASH_ATTR
-allocate (char **head, char **body, char **post)
+// The message is never stored as a whole. Instead, it is rendered in parts:
+// the HTTP header, the head of the body, one part per logged record, and the
+// tail of the body. Each chunk starts with the part that the previous chunk
+// ended in, and only keeps what falls in the chunk, so that a part is only
+// rendered again if it didn't fit in the previous chunk:
+#define PART_HEADER	0
+#define PART_HEAD	1
+#define PART_RECORDS	2
+
+static char chunk[HTTP_CHUNK_SIZE + 1];
+
+// Current upload, its body length, how much of the message is sent, and
+// the first part that isn't sent in full, with its offset in the message:
+static struct upload upload;
+static size_t body_len;
+static size_t offset;
+static uint32_t part;
+static size_t part_offset;
+
+// Whether the parts sent so far hold no logged record:
+static bool first;
+
+// Buffer with the logged record that was read last, and its number:
+static void *record;
+static uint32_t record_num;
+static uint32_t record_time;
+
+// Create header
+static void ICACHE_FLASH_ATTR
+header_create (struct stream *s)
 {
-	if ((*head = os_malloc(HEAD_SIZE)) == NULL)
-		goto err0;
+	if (NET_UDP)
+		return;
 
-	if ((*body = os_malloc(BODY_SIZE)) == NULL)
-		goto err1;
+	stream_str(s,
+		"POST / HTTP/1.0\r\n"
+		"Host: " REMOTE_SERVER "\r\n"
+		"Content-Type: " CONTENT_TYPE "\r\n"
+		"Content-Length: ");
 
-	if ((*post = os_malloc(POST_SIZE)) == NULL)
-		goto err2;
+	stream_uint(s, body_len);
+	stream_str(s, "\r\n\r\n");
+}
 
-	return true;
+// Create object with the soil model fit
+static void ICACHE_FLASH_ATTR
+fourier_create (struct stream *s)
+{
+	if (!upload.has_fit)
+		return;
 
-err2:	os_free(*body);
-err1:	os_free(*head);
-err0:	return false;
+	stream_str(s, "\n, \"fourier\" : { \"depth\" : \"");
+	stream_uint(s, upload.fit.depth);
+	stream_str(s, "\", \"amplitude\" : \"");
+	stream_uint(s, upload.fit.amplitude);
+	stream_str(s, "\", \"peak_age\" : \"");
+	stream_uint(s, upload.fit.peak_age);
+	stream_str(s, "\", \"residual\" : \"");
+	stream_uint(s, upload.fit.residual);
+	stream_str(s, "\" }");
 }
 
-// Create header, return length
-static size_t ICACHE_FLASH_ATTR
-header_create (char *head, size_t body_len)
+// Create object with the trace of a crashed cycle
+static void ICACHE_FLASH_ATTR
+crash_create (struct stream *s)
 {
-	return os_sprintf(head,
-		"POST / HTTP/1.0\r\n"
-		"Host: %s\r\n"
-		"Content-Type: application/json\r\n"
-		"Content-Length: %u\r\n",
-		REMOTE_SERVER,
-		body_len
-	);
+	const struct trace *crash = upload.crash;
+
+	if (crash == NULL)
+		return;
+
+	stream_str(s, "\n, \"crash\" : { \"reason\" : \"");
+	stream_uint(s, crash->reason);
+	stream_str(s, "\", \"exccause\" : \"");
+	stream_uint(s, crash->exccause);
+	stream_str(s, "\", \"epc\" : \"");
+	stream_uint(s, crash->epc);
+	stream_str(s, "\", \"trace\" : [");
+
+	for (uint8_t i = 0; i < crash->count; i++) {
+		const struct trace_entry *e = &crash->entry[i];
+
+		stream_str(s, (i == 0) ? "\n  { \"ms\" : \"" : "\n, { \"ms\" : \"");
+		stream_uint(s, e->time * 10UL);
+		stream_str(s, "\", \"state\" : \"");
+		stream_uint(s, e->state & ~TRACE_ENTER);
+		stream_str(s, (e->state & TRACE_ENTER) ? "\", \"event\" : \"enter" : "\", \"event\" : \"post");
+		stream_str(s, "\", \"pending\" : \"");
+		stream_uint(s, e->arg);
+		stream_str(s, "\" }");
+	}
+
+	stream_str(s, "\n] }");
 }
 
-// Create body, return length
-static size_t ICACHE_FLASH_ATTR
-body_create (char *body)
+// Read a logged record into the buffer, unless it's already there
+static bool ICACHE_FLASH_ATTR
+record_load (const uint32_t n)
 {
-	char *p = body;
+	if (n == record_num)
+		return true;
+
+	if (!flash_log_read(n, record, &record_time))
+		return false;
+
+	record_num = n;
+	return true;
+}
 
+// Create the head of the body, up to the logged records
+static void ICACHE_FLASH_ATTR
+head_create (struct stream *s)
+{
+#if HTTP_BINARY
+	packed_header(s, &upload);
+#else
 	/* Create a JSON body with the following structure:
 
 		{ "sensors" : {
 		  "sensor-id-0" : { "value" : "230000", "status" : "message" }
 		, "sensor-id-1" : { "value" : "230000", "status" : "message" }
 		}
+		, "seq" : "value"
+		, "epoch" : "value"
+		, "chipid" : "value"
 		, "millivolt" : "value"
 		, "rssi" : "value"
 		, "adc" : "value"
+		, "fourier" : { "depth" : "mm", "amplitude" : "230000", "peak_age" : "seconds", "residual" : "230000" }
+		, "crash" : { "reason" : "value", "exccause" : "value", "epc" : "value", "trace" : [
+		  { "ms" : "value", "state" : "value", "event" : "post", "pending" : "value" }
+		, { "ms" : "value", "state" : "value", "event" : "enter", "pending" : "value" }
+		] }
+		, "backlog" : [
+		  { "seq" : "value", "sensors" : { ... } }
+		, { "seq" : "value", "age" : "seconds", "sensors" : { ... } }
+		]
 		}
+
+	   The backlog array holds the oldest records from the flash log, and
+	   is only present if there are any. A logged record has no age if it
+	   was logged before a reset that wasn't a wakeup from deep sleep,
+	   which starts the clock over. Together, the chip ID, the epoch and
+	   the sequence number identify a record; the epoch changes when the
+	   sequence numbers start over. The fourier object holds the
+	   soil model fit, and is only present once there is enough data.
+	   The crash object is only present after a watchdog or exception
+	   reset, and holds the state changes before the reset.
 	*/
 
-	p += os_sprintf(p, "{ ");
-	p += sensors_json(p);
-	p += os_sprintf(p, "\n, \"millivolt\" : \"%u\"", (readvdd33() * 1000) / 1024);
-	p += os_sprintf(p, "\n, \"rssi\" : \"%d\"", wifi_station_get_rssi());
-	p += os_sprintf(p, "\n, \"adc\" : \"%d\"", system_adc_read());
-	p += os_sprintf(p, "\n}\n");
+	stream_str(s, "{ ");
+	sensors_json(s, sensors_record_data());
+	stream_str(s, "\n, \"seq\" : \"");
+	stream_uint(s, upload.seq);
+	stream_str(s, "\"\n, \"epoch\" : \"");
+	stream_uint(s, upload.epoch);
+	stream_str(s, "\"\n, \"chipid\" : \"");
+	stream_uint(s, system_get_chip_id());
+	stream_str(s, "\"\n, \"millivolt\" : \"");
+	stream_uint(s, upload.millivolt);
+	stream_str(s, "\"\n, \"rssi\" : \"");
+	stream_int(s, upload.rssi);
+	stream_str(s, "\"\n, \"adc\" : \"");
+	stream_uint(s, upload.adc);
+	stream_str(s, "\"");
+	fourier_create(s);
+	crash_create(s);
+
+	if (upload.backlog > 0)
+		stream_str(s, "\n, \"backlog\" : [");
+
+	first = true;
+#endif
+}
+
+// Create the part of a logged record, return whether it holds the record.
+// Records that fail to read are skipped, but still count as sent
+static bool ICACHE_FLASH_ATTR
+record_create (struct stream *s, const uint32_t n)
+{
+	if (!record_load(n))
+		return false;
+
+#if HTTP_BINARY
+	packed_record(s, record, flash_log_seq(n), (record_time == FLASH_LOG_UNDATED)
+		? PACKED_UNDATED : upload.clock - record_time);
+#else
+	stream_str(s, (first) ? "\n  { \"seq\" : \"" : "\n, { \"seq\" : \"");
+	stream_uint(s, flash_log_seq(n));
 
-	return p - body;
+	// Leave out the age of a record from before the clock started over:
+	if (record_time != FLASH_LOG_UNDATED) {
+		stream_str(s, "\", \"age\" : \"");
+		stream_uint(s, upload.clock - record_time);
+	}
+
+	stream_str(s, "\", ");
+	sensors_json(s, record);
+	stream_str(s, " }");
+#endif
+	return true;
+}
+
+// Create the tail of the body, after the logged records
+static void ICACHE_FLASH_ATTR
+tail_create (struct stream *s)
+{
+#if HTTP_BINARY
+	packed_trailer(s, &upload);
+#else
+	if (upload.backlog > 0)
+		stream_str(s, "\n]");
+
+	stream_str(s, "\n}\n");
+#endif
+}
+
+// Number of parts in the message
+static inline uint32_t
+parts (void)
+{
+	return PART_RECORDS + upload.backlog + 1;
+}
+
+// Create a part of the message, return whether it holds a logged record
+static bool ICACHE_FLASH_ATTR
+part_create (struct stream *s, const uint32_t n)
+{
+	if (n == PART_HEADER)
+		header_create(s);
+
+	else if (n == PART_HEAD)
+		head_create(s);
+
+	else if (n - PART_RECORDS < upload.backlog)
+		return record_create(s, n - PART_RECORDS);
+
+	else
+		tail_create(s);
+
+	return false;
+}
+
+// Commit a part once it's sent in full, so that the next part follows it
+static void ICACHE_FLASH_ATTR
+part_commit (const bool has_record)
+{
+#if HTTP_BINARY
+	(void) has_record;
+	packed_commit();
+#else
+	if (has_record)
+		first = false;
+#endif
+}
+
+// Create body
+static void ICACHE_FLASH_ATTR
+body_create (struct stream *s)
+{
+	for (uint32_t n = PART_HEAD; n < parts(); n++)
+		part_commit(part_create(s, n));
 }
 
-// Create a HTTP POST message
-char * ICACHE_FLASH_ATTR
-http_post_create (size_t *len)
+// Start a HTTP POST message for the current record with the given sequence
+// number, including at most the given number of logged records. Returns the
+// number of logged records included
+uint32_t ICACHE_FLASH_ATTR
+http_post_start (uint32_t backlog, const uint32_t seq)
 {
-	char *head = NULL;
-	char *body = NULL;
+	struct stream s;
 
-	// Allocate memory:
-	if (!allocate(&head, &body, &post))
-		return NULL;
+	upload.seq       = seq;
+	upload.epoch     = flash_log_epoch();
+	upload.clock     = rtc_mem_clock();
+	upload.has_fit   = fourier_fit(&upload.fit, upload.clock);
+	upload.millivolt = (readvdd33() * 1000) / 1024;
+	upload.rssi      = wifi_station_get_rssi();
+	upload.adc       = system_adc_read();
+	upload.crash     = trace_crash();
 
-	// Create header and body:
-	header_create(head, body_create(body));
+	// The record buffer lasts until the next deep sleep. Without it, send
+	// the current record alone:
+	if (record == NULL && (record = os_malloc(sensors_record_size())) == NULL)
+		backlog = 0;
 
-	// Create HTTP message:
-	*len = os_sprintf(post, "%s\r\n%s", head, body);
+	record_num = UINT32_MAX;
 
-	// Don't need these any more:
-	os_free(head);
-	os_free(body);
+	// Render the body without storing it to find its length. A datagram
+	// carries the whole message, so leave out the newest logged records
+	// until it fits:
+	do {
+		upload.backlog = backlog;
+		stream_init(&s, NULL, 0, 0);
+		body_create(&s);
+	} while (NET_UDP && s.total > HTTP_CHUNK_SIZE && backlog-- > 0);
 
-	return post;
+	body_len    = s.total;
+	offset      = 0;
+	part        = PART_HEADER;
+	part_offset = 0;
+	return upload.backlog;
 }
 
-// Destroy the HTTP POST message
-void ICACHE_FLASH_ATTR
-http_post_destroy (void)
+// Get the next chunk of the HTTP POST message, return zero when done
+size_t ICACHE_FLASH_ATTR
+http_post_next (uint8_t **buf)
 {
-	os_free(post);
+	struct stream s;
+
+	// Render the parts from the one the last chunk ended in, skipping what
+	// was sent of it, until the chunk is full:
+	stream_init(&s, chunk, HTTP_CHUNK_SIZE, offset - part_offset);
+
+	while (part < parts() && s.len < s.size) {
+		const size_t start = s.total;
+		const bool has_record = part_create(&s, part);
+
+		// Stop at a part that runs past the end of the chunk:
+		if (s.total > s.skip + s.len)
+			break;
+
+		part_commit(has_record);
+		part_offset += s.total - start;
+		part++;
+	}
+
+	offset += s.len;
+
+	// Terminate for the benefit of logging:
+	chunk[s.len] = '\0';
+	*buf = (uint8_t *) chunk;
+
+	return s.len;
 }
@@ -1,4 +1,25 @@
 #define REMOTE_SERVER	"192.168.178.13"
 
-char *http_post_create (size_t *len);
-void http_post_destroy (void);
+// Send the compact binary payload instead of JSON:
+#define HTTP_BINARY	0
+
+// The message is sent in chunks of at most this size:
+#define HTTP_CHUNK_SIZE	512
+
+// Values that are sampled once per upload, so that rendering the body again
+// for every chunk produces the same bytes each time:
+struct upload {
+	uint32_t	backlog;	// Number of logged records to include
+	uint32_t	seq;		// Sequence number of current record
+	uint32_t	epoch;		// Epoch of the sequence numbers
+	uint32_t	clock;		// Time of upload
+	bool		has_fit;	// Whether the soil model fit is valid
+	struct fourier_fit fit;	// Soil model fit
+	uint16_t	millivolt;	// Supply voltage
+	int8_t		rssi;		// Wifi signal strength
+	uint16_t	adc;		// ADC reading
+	const struct trace *crash;	// Trace of a crashed cycle, or NULL
+};
+
+uint32_t http_post_start (uint32_t backlog, const uint32_t seq);
+size_t http_post_next (uint8_t **buf);
@@ -0,0 +1,112 @@
+#include <stdarg.h>
+#include <osapi.h>
+#include <user_interface.h>
+
+#include "log.h"
+#include "missing.h"
+#include "uart.h"
+
+#if LOG_DEFERRED
+
+// Ring buffer of entries. Each entry is the address of the format string,
+// the time in milliseconds since boot shifted left by eight bits with the
+// number of arguments in the low byte, then the arguments:
+static uint32_t ring[LOG_RING_WORDS];
+static uint16_t head = 0;
+static uint16_t tail = 0;
+
+// Number of entries overwritten before they were dumped:
+static uint16_t lost = 0;
+
+// Get number of words in use
+static inline uint16_t
+used (void)
+{
+	return (head + LOG_RING_WORDS - tail) % LOG_RING_WORDS;
+}
+
+// Append a word
+static inline void
+put (const uint32_t word)
+{
+	ring[head] = word;
+	head = (head + 1) % LOG_RING_WORDS;
+}
+
+// Remove and return the oldest word
+static inline uint32_t
+get (void)
+{
+	const uint32_t word = ring[tail];
+
+	tail = (tail + 1) % LOG_RING_WORDS;
+	return word;
+}
+
+// Store a log entry, overwriting the oldest entries if needed
+void ICACHE_FLASH_ATTR
+log_write (const uint8_t nargs, const char *fmt, ...)
+{
+	va_list ap;
+
+	// Make room. One word stays free to tell a full ring from an empty
+	// one:
+	while (LOG_RING_WORDS - 1 - used() < 2 + nargs) {
+		tail = (tail + 2 + (ring[(tail + 1) % LOG_RING_WORDS] & 0xFF)) % LOG_RING_WORDS;
+		lost++;
+	}
+
+	put((uint32_t) fmt);
+	put((system_get_time() / 1000) << 8 | nargs);
+
+	va_start(ap, fmt);
+	for (uint8_t i = 0; i < nargs; i++)
+		put(va_arg(ap, uint32_t));
+	va_end(ap);
+}
+
+// Dump the ring buffer to the UART, one entry per line, as "LOG" followed by
+// the entry's words in hex
+void ICACHE_FLASH_ATTR
+log_flush (void)
+{
+	static const char hex[] = "0123456789abcdef";
+	char line[4 + (2 + LOG_ARGS_MAX) * 9 + 1];
+
+	if (lost > 0) {
+		os_printf("Log: %u entries lost\n", lost);
+		lost = 0;
+	}
+
+	while (tail != head) {
+		const uint8_t nwords = 2 + (ring[(tail + 1) % LOG_RING_WORDS] & 0xFF);
+		char *p = line;
+
+		*p++ = 'L';
+		*p++ = 'O';
+		*p++ = 'G';
+
+		for (uint8_t i = 0; i < nwords; i++) {
+			const uint32_t word = get();
+
+			*p++ = ' ';
+			for (int8_t shift = 28; shift >= 0; shift -= 4)
+				*p++ = hex[(word >> shift) & 0x0F];
+		}
+		*p = '\0';
+
+		// Wait for each line to go out, so the UART doesn't drop any:
+		os_printf("%s\n", line);
+		uart_flush();
+	}
+}
+
+#else
+
+// Nothing to do, messages go out as they are logged
+void ICACHE_FLASH_ATTR
+log_flush (void)
+{
+}
+
+#endif
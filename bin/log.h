@@ -0,0 +1,51 @@
+// Log levels, from quiet to chatty:
+#define LOG_LEVEL_NONE		0
+#define LOG_LEVEL_ERROR		1
+#define LOG_LEVEL_INFO		2
+#define LOG_LEVEL_DEBUG		3
+
+// Calls above this level are compiled out, format strings and all:
+#define LOG_LEVEL		LOG_LEVEL_INFO
+
+// Deferred logging. Instead of formatting messages on the chip, store the
+// address of the format string, a timestamp and the arguments in a ring
+// buffer in RAM, and dump that in hex before deep sleep. The format strings
+// are kept in flash, where they take no RAM. The tools/logexpand host tool
+// turns the dump back into text, looking up the strings in the firmware's
+// ELF file. Arguments are stored as 32-bit words, so deferred messages can
+// only use integer conversions, and "%s" with constant strings:
+#define LOG_DEFERRED		0
+#define LOG_RING_WORDS		256
+#define LOG_ARGS_MAX		10
+
+// Count the arguments after the format string, up to LOG_ARGS_MAX:
+#define LOG_NARGS(...)		LOG_NARGS_(__VA_ARGS__, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, 0)
+#define LOG_NARGS_(fmt, a, b, c, d, e, f, g, h, i, j, n, ...) n
+
+#if LOG_DEFERRED
+#define LOG_STRING(str)		({ static const char s[] __attribute__((section(".irom.text"), aligned(4))) = str; s; })
+#define LOG(fmt, ...)		log_write(LOG_NARGS(fmt, ##__VA_ARGS__), LOG_STRING(fmt), ##__VA_ARGS__)
+#else
+#define LOG(...)		os_printf(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define log_error(...)		LOG(__VA_ARGS__)
+#else
+#define log_error(...)		do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define log_info(...)		LOG(__VA_ARGS__)
+#else
+#define log_info(...)		do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define log_debug(...)		LOG(__VA_ARGS__)
+#else
+#define log_debug(...)		do { } while (0)
+#endif
+
+void log_write (const uint8_t nargs, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+void log_flush (void);
@@ -5,230 +5,340 @@
 #include <gpio.h>
 
 #include "ds18b20.h"
+#include "flash_log.h"
+#include "fourier.h"
 #include "http.h"
 #include "led.h"
+#include "log.h"
 #include "missing.h"
 #include "net.h"
 #include "onewire.h"
+#include "power.h"
 #include "rtc_mem.h"
+#include "schedule.h"
 #include "sensors.h"
 #include "state.h"
+#include "trace.h"
 #include "uart.h"
 #include "wifi.h"
 
-#define NUM_EVENTS	4
-#define DEEP_SLEEP_SEC	900UL
-#define DEEP_SLEEP_USEC	(DEEP_SLEEP_SEC * 1000000UL)
+// Report by exception: skip the upload, and leave the radio off, unless a
+// sensor moved by more than the threshold (in degrees C * 10000) since the
+// last acknowledged upload, or the last upload is a heartbeat period ago.
+// Skipped records are still logged, and go out with the next upload:
+#define REPORT_EXCEPTION	0
+#define REPORT_THRESHOLD	2500
+#define REPORT_HEARTBEAT_SEC	(6 * 3600UL)
 
 // We wake up every 15 minutes, take temperature samples, and go to deep sleep.
+// (The interval adapts to the weather, see schedule.c.)
 // Every hour, we collect and consolidate the 15-minute samples into one final
 // measurement that we send over wifi. We store our state inside the RTC clock
 // memory, so we know at which step we are. Wakeup number:
 static uint8_t wakeup;
 
+// Every record is appended to the flash log before it is sent, and stays
+// there until the server acknowledges it. Sequence number of the current
+// record, number of logged records in the current upload, number of uploads
+// done, and whether the last upload was acknowledged:
+static uint32_t current;
+static uint32_t backlog;
+static uint8_t uploads = 0;
+static bool acked = false;
+
 static void ICACHE_FLASH_ATTR
 deep_sleep (void)
 {
+	const uint32_t sleep_sec = schedule_interval();
+
 	// Don't remember RF config across deep sleep:
 	if (!system_deep_sleep_set_option(2))
-		os_printf("Deep sleep: couldn't set option!\n");
+		log_error("Deep sleep: couldn't set option!\n");
+
+	// Remember the time at which we'll wake up:
+	rtc_mem_clock_save(sleep_sec);
 
 	// Enter deep sleep:
-	os_printf("Deep sleep: starting for %u sec\n", DEEP_SLEEP_SEC);
-	system_deep_sleep(DEEP_SLEEP_USEC);
+	log_info("Deep sleep: starting for %u sec\n", sleep_sec);
+	log_flush();
+	uart_flush();
+	system_deep_sleep(sleep_sec * 1000000UL);
 }
 
-// Sensor event handler
+// Check if the current record is worth an upload
 static bool ICACHE_FLASH_ATTR
-sensor_event (os_event_t *event)
+report_due (void)
 {
-	static uint8_t round = 0;
-
-	switch (event->sig)
-	{
-	// Request sensor measurements:
-	case STATE_SENSORS_START:
-		led_blink(50);
-		os_printf("Requesting sensor measurements\n");
-		sensors_request(round);
-		return true;
+	uint32_t age;
 
-	// Obtain sensor measurements:
-	case STATE_SENSORS_READOUT:
-		sensors_readout(round);
-		state_change(STATE_SENSORS_DONE);
+	if (!REPORT_EXCEPTION)
 		return true;
 
-	// Sensor measurements obtained:
-	case STATE_SENSORS_DONE:
-		os_printf("Sensor measurements obtained\n");
-
-		// If we don't have valid measurements for each sensor, retry:
-		if (!sensors_all_valid() && ++round < SENSORS_ROUNDS_MAX) {
-			os_printf("Retrying measurements (%d)\n", round);
-			state_change(STATE_SENSORS_START);
-			return true;
-		}
-
-		// Otherwise consolidate the measurements and move on:
-		onewire_depower();
-		sensors_consolidate_samples(wakeup);
-
-		// If this is wakeup round 0, 1 or 2, then store the data to
-		// RTC memory and go to sleep:
-		if (wakeup < SENSORS_RECORDS_MAX - 1) {
-			state_change(STATE_SENSORS_SAVE);
-			return true;
-		}
-
-		// Otherwise, send the data:
-		state_change(STATE_SENSORS_SEND);
+	// Nothing sent yet since cold boot, or since a crash:
+	if (!rtc_mem_sent_age(&age))
 		return true;
 
-	// Save measurements to RTC memory and go to sleep:
-	case STATE_SENSORS_SAVE:
-		os_printf("Saving measurements to RTC memory: %s\n",
-			rtc_mem_save(wakeup + 1) ? "success" : "fail");
-		deep_sleep();
+	// Heartbeat, allowing for the time we spend awake between wakeups:
+	if (age + SCHEDULE_MIN_SEC / 2 >= REPORT_HEARTBEAT_SEC)
 		return true;
 
-	// Consolidate measurements and send over wifi:
-	case STATE_SENSORS_SEND:
-		os_printf("Sending measurements to wifi\n");
+	return sensors_changed(REPORT_THRESHOLD);
+}
 
-		// Reset RTC memory to zero records:
-		rtc_mem_save(0);
+// Round of sensor measurements, and of wifi setup attempts:
+static uint8_t sensor_round = 0;
+static uint8_t wifi_round = 0;
 
-		// Consolidate records and send to wifi:
-		sensors_consolidate_records();
-		state_change(STATE_WIFI_SETUP_START);
-		return true;
+// Request sensor measurements:
+static void ICACHE_FLASH_ATTR
+on_sensors_start (void)
+{
+	led_blink(50);
+	log_info("Requesting sensor measurements\n");
+	sensors_request(sensor_round);
+}
 
-	default:
-		return false;
+// Obtain sensor measurements:
+static void ICACHE_FLASH_ATTR
+on_sensors_readout (void)
+{
+	sensors_readout(sensor_round);
+	state_change(STATE_SENSORS_DONE);
+}
+
+// Sensor measurements obtained:
+static void ICACHE_FLASH_ATTR
+on_sensors_done (void)
+{
+	log_info("Sensor measurements obtained\n");
+
+	// If we don't have valid measurements for each sensor, retry,
+	// unless power is low:
+	if (!sensors_all_valid() && sensor_round < power_retries(SENSORS_ROUNDS_MAX - 1)) {
+		sensor_round++;
+		log_info("Retrying measurements (%d)\n", sensor_round);
+		state_change(STATE_SENSORS_START);
+		return;
+	}
+
+	// Otherwise consolidate the measurements and move on:
+	onewire_depower();
+	sensors_consolidate_samples();
+
+	// Adapt the sleep interval to how fast temperatures change,
+	// and update the soil model:
+	schedule_update(sensors_record_data(), rtc_mem_clock());
+	fourier_update(sensors_record_data(), rtc_mem_clock());
+
+	// If this is wakeup round 0, 1 or 2, then store the running
+	// statistics to RTC memory and go to sleep:
+	if (wakeup < SENSORS_RECORDS_MAX - 1) {
+		state_change(STATE_SENSORS_SAVE);
+		return;
 	}
+
+	// Otherwise, send the data:
+	state_change(STATE_SENSORS_SEND);
 }
 
-// Wifi event handler
-static bool ICACHE_FLASH_ATTR
-wifi_event (os_event_t *event)
+// Save measurements to RTC memory and go to sleep:
+static void ICACHE_FLASH_ATTR
+on_sensors_save (void)
 {
-	static uint8_t round = 0;
-
-	switch (event->sig)
-	{
-	// Start setting up wifi:
-	case STATE_WIFI_SETUP_START:
-		led_blink(100);
-		if (!wifi_connect())
-			state_change(STATE_WIFI_SETUP_FAIL);
-		return true;
+	log_info("Saving measurements to RTC memory: %s\n",
+		rtc_mem_save(wakeup + 1) ? "success" : "fail");
+	deep_sleep();
+}
 
-	// Wifi setup or connect failed:
-	case STATE_WIFI_SETUP_FAIL:
-		led_blink(500);
-		os_printf("Wifi setup failed!\n");
-		if (round++ < 3) {
-			os_printf("Wifi: retrying (%u)\n", round);
-			state_change(STATE_WIFI_SETUP_START);
-		}
-		else if (!wifi_shutdown())
-			state_change(STATE_WIFI_SHUTDOWN_DONE);
-		return true;
+// Consolidate measurements and send over wifi:
+static void ICACHE_FLASH_ATTR
+on_sensors_send (void)
+{
+	log_info("Sending measurements to wifi\n");
 
-	// Wifi is successfully setup:
-	case STATE_WIFI_SETUP_DONE:
-		os_printf("Wifi setup done\n");
-		state_change(STATE_NET_CONNECT_START);
-		return true;
+	// Consolidate records and keep the result in the flash log:
+	sensors_consolidate_records();
+	current = flash_log_seq(flash_log_pending());
+	if (!flash_log_append(sensors_record_data(), rtc_mem_clock()))
+		log_error("Flash log: append failed!\n");
 
-	// Start shutting down wifi:
-	case STATE_WIFI_SHUTDOWN_START:
-		os_printf("Wifi shutdown starting\n");
-		if (!wifi_shutdown())
-			state_change(STATE_WIFI_SHUTDOWN_DONE);
-		return true;
+	// Reset the running statistics in RTC memory:
+	rtc_mem_save(0);
 
-	// Wifi has been successfully shut down:
-	case STATE_WIFI_SHUTDOWN_DONE:
-		os_printf("Wifi shutdown done\n");
+	// When power is low, wait for a batch of records before switching on
+	// the radio, and stop transmitting altogether when it's nearly out:
+	if (!power_upload_due(flash_log_pending())) {
+		log_info("Power low, deferring upload\n");
 		deep_sleep();
-		return true;
+		return;
+	}
 
-	default:
-		return false;
+	// Go back to sleep if there's nothing new to report:
+	if (!report_due()) {
+		log_info("No significant change, skipping upload\n");
+		deep_sleep();
+		return;
 	}
+
+	// Send to wifi:
+	state_change(STATE_WIFI_SETUP_START);
 }
 
-// Network event handler
-static bool ICACHE_FLASH_ATTR
-net_event (os_event_t *event)
+// Start setting up wifi:
+static void ICACHE_FLASH_ATTR
+on_wifi_setup_start (void)
 {
-	switch (event->sig)
-	{
-	// Start setting up network connection:
-	case STATE_NET_CONNECT_START:
-		led_blink(200);
-		if (!net_connect())
-			state_change(STATE_NET_CONNECT_FAIL);
-		return true;
+	led_blink(100);
+	if (!wifi_connect())
+		state_change(STATE_WIFI_SETUP_FAIL);
+}
 
-	// Network connection setup failed:
-	case STATE_NET_CONNECT_FAIL:
-		os_printf("Network connect failed!\n");
-		if (!net_disconnect())
-			state_change(STATE_NET_DISCONNECT_DONE);
-		return true;
+// Wifi setup or connect failed:
+static void ICACHE_FLASH_ATTR
+on_wifi_setup_fail (void)
+{
+	led_blink(500);
+	log_error("Wifi setup failed!\n");
+	if (wifi_round++ < power_retries(3)) {
+		log_info("Wifi: retrying (%u)\n", wifi_round);
+		state_change(STATE_WIFI_SETUP_START);
+	}
+	else if (!wifi_shutdown())
+		state_change(STATE_WIFI_SHUTDOWN_DONE);
+}
 
-	// Network connection successfully setup:
-	case STATE_NET_CONNECT_DONE: {
-		size_t len;
-		char *buf = http_post_create(&len);
+// Wifi is successfully setup:
+static void ICACHE_FLASH_ATTR
+on_wifi_setup_done (void)
+{
+	log_info("Wifi setup done\n");
+	state_change(STATE_NET_CONNECT_START);
+}
 
-		os_printf("Network connect done\n");
-		if (!net_send(buf, len))
-			state_change(STATE_NET_DATA_SENT);
-		return true;
-	}
+// Start shutting down wifi:
+static void ICACHE_FLASH_ATTR
+on_wifi_shutdown_start (void)
+{
+	log_info("Wifi shutdown starting\n");
+	if (!wifi_shutdown())
+		state_change(STATE_WIFI_SHUTDOWN_DONE);
+}
 
-	// Network data sent:
-	case STATE_NET_DATA_SENT:
-		os_printf("Network data sent\n");
-		http_post_destroy();
-		net_disconnect();
-		return true;
+// Wifi has been successfully shut down:
+static void ICACHE_FLASH_ATTR
+on_wifi_shutdown_done (void)
+{
+	log_info("Wifi shutdown done\n");
+	deep_sleep();
+}
 
-	// Network successfully disconnected:
-	case STATE_NET_DISCONNECT_DONE:
-		os_printf("Network disconnect done\n");
-		state_change(STATE_WIFI_SHUTDOWN_START);
-		return true;
+// Start setting up network connection:
+static void ICACHE_FLASH_ATTR
+on_net_connect_start (void)
+{
+	led_blink(200);
+	if (!net_connect())
+		state_change(STATE_NET_CONNECT_FAIL);
+}
 
-	default:
-		return false;
-	}
+// Network connection setup failed:
+static void ICACHE_FLASH_ATTR
+on_net_connect_fail (void)
+{
+	log_error("Network connect failed!\n");
+	if (!net_disconnect())
+		state_change(STATE_NET_DISCONNECT_DONE);
 }
 
-// System event handler
+// Network connection successfully setup:
 static void ICACHE_FLASH_ATTR
-on_event (os_event_t *event)
+on_net_connect_done (void)
 {
-	if (sensor_event(event))
-		return;
+	log_info("Network connect done\n");
+
+	// Include the oldest logged records, except for the current record,
+	// which is sent anyway:
+	backlog = flash_log_pending();
+	if (backlog > 0 && flash_log_seq(backlog - 1) == current)
+		backlog--;
+	if (backlog > FLASH_LOG_BATCH)
+		backlog = FLASH_LOG_BATCH;
+
+	acked = false;
+	backlog = http_post_start(backlog, current);
+	if (!net_send(http_post_next))
+		state_change(STATE_NET_CONNECT_FAIL);
+}
 
-	if (wifi_event(event))
-		return;
+// Network data sent and acknowledged:
+static void ICACHE_FLASH_ATTR
+on_net_data_sent (void)
+{
+	uint32_t seq;
+
+	log_info("Network data sent\n");
+
+	// The server acknowledges the current record once it has stored all
+	// records in the upload. Drop them from the log:
+	if (net_ack(&seq) && seq == current) {
+		flash_log_consume(backlog);
+		if (flash_log_pending() > 0 && flash_log_seq(0) == current)
+			flash_log_consume(1);
+		sensors_sent_update();
+		rtc_mem_sent_save();
+		trace_crash_clear();
+		acked = true;
+	}
+	else
+		log_error("Network: unexpected acknowledgement\n");
+
+	net_disconnect();
+}
+
+// Network successfully disconnected:
+static void ICACHE_FLASH_ATTR
+on_net_disconnect_done (void)
+{
+	log_info("Network disconnect done\n");
 
-	if (net_event(event))
+	// Keep draining the log while the server is responsive:
+	if (acked && flash_log_pending() > 0 && ++uploads < FLASH_LOG_UPLOADS) {
+		log_debug("Flash log: %u records pending\n", flash_log_pending());
+		state_change(STATE_NET_CONNECT_START);
 		return;
+	}
 
-	os_printf("Unhandled event: 0x%08x, payload 0x%08x\n", event->sig, event->par);
+	state_change(STATE_WIFI_SHUTDOWN_START);
 }
 
-// Entry point after system init
+// State table. Setting up wifi or a connection, and shutting down wifi,
+// wait for events from the SDK that might never come, so they time out.
+// Consolidating and fitting the measurements, and formatting the upload,
+// get a faster clock:
+static const struct state_handler handlers[STATE_NUM] = {
+	[STATE_SENSORS_START]		= { on_sensors_start },
+	[STATE_SENSORS_READOUT]		= { on_sensors_readout },
+	[STATE_SENSORS_DONE]		= { on_sensors_done, .cpu_mhz = STATE_CPU_BOOST_MHZ },
+	[STATE_SENSORS_SAVE]		= { on_sensors_save },
+	[STATE_SENSORS_SEND]		= { on_sensors_send, .cpu_mhz = STATE_CPU_BOOST_MHZ },
+	[STATE_WIFI_SETUP_START]	= { on_wifi_setup_start, NULL, WIFI_SETUP_TIMEOUT_MS, STATE_WIFI_SETUP_FAIL },
+	[STATE_WIFI_SETUP_FAIL]		= { on_wifi_setup_fail },
+	[STATE_WIFI_SETUP_DONE]		= { on_wifi_setup_done },
+	[STATE_WIFI_SHUTDOWN_START]	= { on_wifi_shutdown_start, NULL, WIFI_SHUTDOWN_TIMEOUT_MS, STATE_WIFI_SHUTDOWN_DONE },
+	[STATE_WIFI_SHUTDOWN_DONE]	= { on_wifi_shutdown_done },
+	[STATE_NET_CONNECT_START]	= { on_net_connect_start, NULL, NET_CONNECT_TIMEOUT_MS, STATE_NET_CONNECT_FAIL },
+	[STATE_NET_CONNECT_FAIL]	= { on_net_connect_fail },
+	[STATE_NET_CONNECT_DONE]	= { on_net_connect_done, .cpu_mhz = STATE_CPU_BOOST_MHZ },
+	[STATE_NET_DATA_SENT]		= { on_net_data_sent },
+	[STATE_NET_DISCONNECT_DONE]	= { on_net_disconnect_done },
+};
+
+// Print system information at boot. This is only compiled in at the debug
+// log level, because it costs a fair bit of time on every wakeup:
 static void ICACHE_FLASH_ATTR
-on_init_done (void)
+print_banner (const struct rst_info *reset_info)
 {
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
 	char *flash_map[] = {
 		[FLASH_SIZE_2M]			= "2 MB",
 		[FLASH_SIZE_4M_MAP_256_256]	= "4 MB, 256x256",
@@ -249,27 +359,48 @@ on_init_done (void)
 		[REASON_EXT_SYS_RST]		= "external system reset",
 	};
 
-	struct rst_info *reset_info = system_get_rst_info();
-
-	os_printf("SDK version    : %s\n", system_get_sdk_version());
-	os_printf("Chip ID        : 0x%08x\n", system_get_chip_id());
-	os_printf("VDD 3.3        : %u mV\n", (readvdd33() * 1000) / 1024);
-	os_printf("Boot version   : %u\n", system_get_boot_version());
-	os_printf("CPU frequency  : %u MHz\n", system_get_cpu_freq());
-	os_printf("Flash size map : %s\n", flash_map[system_get_flash_size_map()]);
-	os_printf("Reset info     : %s\n", reset_map[reset_info->reason]);
+	log_debug("SDK version    : %s\n", system_get_sdk_version());
+	log_debug("Chip ID        : 0x%08x\n", system_get_chip_id());
+	log_debug("VDD 3.3        : %u mV\n", (readvdd33() * 1000) / 1024);
+	log_debug("Boot version   : %u\n", system_get_boot_version());
+	log_debug("CPU frequency  : %u MHz\n", system_get_cpu_freq());
+	log_debug("Flash size map : %s\n", flash_map[system_get_flash_size_map()]);
+	log_debug("Reset info     : %s\n", reset_map[reset_info->reason]);
 
 	system_print_meminfo();
+#endif
+}
+
+// Entry point after system init
+static void ICACHE_FLASH_ATTR
+on_init_done (void)
+{
+	struct rst_info *reset_info = system_get_rst_info();
+
+	// Keep the trace of the last cycle if it crashed:
+	trace_init(reset_info);
+	print_banner(reset_info);
 
 	// If we were reset by awaking from deep sleep, we read out RTC memory
 	// to import information from earlier rounds. Find out which wakeup
 	// round this is:
 	if (reset_info->reason == REASON_DEEP_SLEEP_AWAKE) {
 		wakeup = rtc_mem_load();
-		os_printf("Wakeup %u\n", wakeup);
+		log_info("Wakeup %u\n", wakeup);
 	}
 
-	// Start by getting sensor measurements:
+	// Find the power level, our place in the flash log, and restore the
+	// sleep schedule and the soil model:
+	power_init(reset_info->reason == REASON_DEEP_SLEEP_AWAKE);
+
+	// The flash log's cursor is checked, and survives any reset but
+	// power-on, after a crash too:
+	flash_log_init(reset_info->reason != REASON_DEFAULT_RST);
+	schedule_init(reset_info->reason == REASON_DEEP_SLEEP_AWAKE);
+	fourier_init(reset_info->reason == REASON_DEEP_SLEEP_AWAKE);
+
+	// Start by getting sensor measurements from the sensors that are due:
+	sensors_plan(rtc_mem_clock());
 	state_change(STATE_SENSORS_START);
 }
 
@@ -277,8 +408,6 @@ on_init_done (void)
 void ICACHE_FLASH_ATTR
 user_init (void)
 {
-	static os_event_t events[NUM_EVENTS];
-
 	gpio_init();
 	uart_init();
 	onewire_init();
@@ -287,5 +416,5 @@ user_init (void)
 	system_init_done_cb(on_init_done);
 
 	// Event handler:
-	system_os_task(on_event, 0, events, NUM_EVENTS);
+	state_init(handlers);
 }
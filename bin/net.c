@@ -3,12 +3,38 @@
 #include <ip_addr.h>
 #include <espconn.h>
 
+#include "log.h"
 #include "missing.h"
 #include "net.h"
 #include "state.h"
 
 // Remember connection events:
 static bool is_connected = false;
+static bool is_closed = false;
+
+// Where the data to send comes from:
+static net_source source = NULL;
+
+// Acknowledged sequence number, and the timer that waits for it:
+static bool is_acked = false;
+static uint32_t acked_seq;
+static os_timer_t timer;
+
+#if NET_UDP
+// The datagram in flight, and the number of times it was sent:
+static uint8_t *datagram;
+static size_t datagram_len;
+static uint8_t attempts;
+#else
+// The response header that carries the acknowledgement, in lowercase, and
+// how much of it has been matched so far. The response may arrive in any
+// number of pieces, so the match is kept across calls:
+static const char ack_header[] = "\nx-ack:";
+static uint8_t ack_match;
+static bool ack_digits;
+#endif
+
+static bool send_chunk (void);
 
 // Interpret error codes
 static bool ICACHE_FLASH_ATTR
@@ -36,7 +62,7 @@ check_error (const char *func, int8_t error)
 	default:			msg = "unknown error";		break;
 	}
 
-	os_printf("%s: %s\n", func, msg);
+	log_error("%s: %s\n", func, msg);
 	return false;
 }
 
@@ -44,7 +70,7 @@ check_error (const char *func, int8_t error)
 static void ICACHE_FLASH_ATTR
 on_connect (void *data)
 {
-	os_printf("Net: connected\n");
+	log_info("Net: connected\n");
 	is_connected = true;
 	state_change(STATE_NET_CONNECT_DONE);
 }
@@ -60,29 +86,74 @@ on_reconnect (void *data, int8_t error)
 	state_change(STATE_NET_CONNECT_FAIL);
 }
 
-// Write finished callback
+// Acknowledgement timeout callback
 static void ICACHE_FLASH_ATTR
-on_write_finish (void *data)
+on_ack_timeout (void *data)
 {
-	os_printf("Net: write finished\n");
+	log_error("Net: no acknowledgement\n");
+	state_change(STATE_NET_CONNECT_FAIL);
+}
+
+// Acknowledgement received
+static void ICACHE_FLASH_ATTR
+ack_received (const uint32_t seq)
+{
+	log_info("Net: acknowledged %u\n", seq);
+	os_timer_disarm(&timer);
+	acked_seq = seq;
+	is_acked  = true;
 	state_change(STATE_NET_DATA_SENT);
 }
 
-// Disconnect callback
+// Write finished callback, send the next chunk from here
+static void ICACHE_FLASH_ATTR
+on_write_finish (void *data)
+{
+	if (send_chunk())
+		return;
+
+	// Nothing left to send, or the send failed:
+	if (source != NULL) {
+		state_change(STATE_NET_CONNECT_FAIL);
+		return;
+	}
+
+	// Wait for the acknowledgement:
+	log_debug("Net: write finished\n");
+	os_timer_disarm(&timer);
+	os_timer_setfn(&timer, (os_timer_func_t *) on_ack_timeout, NULL);
+	os_timer_arm(&timer, NET_ACK_TIMEOUT_MS, 0);
+}
+
+// Disconnect callback. Both sides may close the connection, but report it
+// only once:
 static void ICACHE_FLASH_ATTR
 on_disconnect (void *data)
 {
-	os_printf("Net: disconnected\n");
+	if (is_closed)
+		return;
+
+	log_info("Net: disconnected\n");
+	os_timer_disarm(&timer);
 	is_connected = false;
+	is_closed = true;
 	check_error("espconn_delete()", espconn_delete(data));
 	state_change(STATE_NET_DISCONNECT_DONE);
 }
 
+// Get the acknowledged sequence number, returns false if there is none
+bool ICACHE_FLASH_ATTR
+net_ack (uint32_t *seq)
+{
+	*seq = acked_seq;
+	return is_acked;
+}
+
 // Connect
 static bool ICACHE_FLASH_ATTR
 connect (struct espconn *conn)
 {
-	os_printf("Net: connecting to %u.%u.%u.%u:%u\n",
+	log_info("Net: connecting to %u.%u.%u.%u:%u\n",
 		conn->proto.tcp->remote_ip[0],
 		conn->proto.tcp->remote_ip[1],
 		conn->proto.tcp->remote_ip[2],
@@ -99,7 +170,7 @@ get_local_ip (uint8_t *dest)
 	struct ip_info info;
 
 	if (!wifi_get_ip_info(0, &info)) {
-		os_printf("Net init: could not get local IP!\n");
+		log_error("Net init: could not get local IP!\n");
 		return false;
 	}
 
@@ -107,6 +178,110 @@ get_local_ip (uint8_t *dest)
 	return true;
 }
 
+#if NET_UDP
+
+// Receive callback, check for an acknowledgement
+static void ICACHE_FLASH_ATTR
+on_recv (void *data, char *buf, unsigned short len)
+{
+	const uint8_t *p = (const uint8_t *) buf;
+
+	if (datagram == NULL || len != NET_UDP_ACK_SIZE)
+		return;
+
+	// The acknowledgement echoes the magic and the CRC:
+	if (os_memcmp(p, datagram, 2) != 0
+	 || os_memcmp(p + 2, datagram + datagram_len - 2, 2) != 0)
+		return;
+
+	datagram = NULL;
+	ack_received(p[4] | p[5] << 8 | p[6] << 16 | (uint32_t) p[7] << 24);
+}
+
+static esp_udp udp = {
+	.remote_port		= NET_UDP_PORT,
+	.remote_ip		= REMOTE_IP,
+};
+
+static struct espconn conn = {
+	.type			= ESPCONN_UDP,
+	.state			= ESPCONN_NONE,
+	.proto.udp		= &udp,
+	.recv_callback		= on_recv,
+	.sent_callback		= NULL,
+};
+
+// Initialize UDP connection to server. There is no handshake, so we're done
+// as soon as the connection exists
+bool ICACHE_FLASH_ATTR
+net_connect (void)
+{
+	is_closed = false;
+	is_acked  = false;
+
+	if (!get_local_ip(udp.local_ip))
+		return false;
+
+	udp.local_port = espconn_port();
+
+	if (!check_error("espconn_create()", espconn_create(&conn)))
+		return false;
+
+	log_info("Net: sending to %u.%u.%u.%u:%u\n",
+		udp.remote_ip[0], udp.remote_ip[1],
+		udp.remote_ip[2], udp.remote_ip[3],
+		udp.remote_port);
+
+	state_change(STATE_NET_CONNECT_DONE);
+	return true;
+}
+
+#else
+
+// Receive callback, look for the acknowledgement in the response header
+static void ICACHE_FLASH_ATTR
+on_recv (void *data, char *buf, unsigned short len)
+{
+	if (is_acked)
+		return;
+
+	for (unsigned short i = 0; i < len; i++) {
+		char c = buf[i];
+
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+
+		// Match the header name:
+		if (ack_match < sizeof(ack_header) - 1) {
+			if (c == ack_header[ack_match])
+				ack_match++;
+			else
+				ack_match = (c == '\n') ? 1 : 0;
+			continue;
+		}
+
+		// Skip whitespace, then parse the number:
+		if (c == ' ' && !ack_digits)
+			continue;
+
+		if (c >= '0' && c <= '9') {
+			acked_seq  = acked_seq * 10 + (c - '0');
+			ack_digits = true;
+			continue;
+		}
+
+		// End of the header line:
+		if (ack_digits) {
+			ack_received(acked_seq);
+			return;
+		}
+
+		acked_seq  = 0;
+		ack_digits = false;
+		ack_match  = (c == '\n') ? 1 : 0;
+	}
+}
+
 static esp_tcp tcp = {
 	.remote_port		= REMOTE_PORT,
 	.remote_ip		= REMOTE_IP,
@@ -120,7 +295,7 @@ static struct espconn conn = {
 	.type			= ESPCONN_TCP,
 	.state			= ESPCONN_NONE,
 	.proto.tcp		= &tcp,
-	.recv_callback		= NULL,
+	.recv_callback		= on_recv,
 	.sent_callback		= NULL,
 };
 
@@ -128,6 +303,13 @@ static struct espconn conn = {
 bool ICACHE_FLASH_ATTR
 net_connect (void)
 {
+	// Reset the connection and the acknowledgement state:
+	is_closed  = false;
+	is_acked   = false;
+	acked_seq  = 0;
+	ack_match  = 0;
+	ack_digits = false;
+
 	// Fetch local IP address:
 	if (!get_local_ip(tcp.local_ip))
 		return false;
@@ -139,6 +321,8 @@ net_connect (void)
 	return connect(&conn);
 }
 
+#endif
+
 // Close TCP connection to server
 bool ICACHE_FLASH_ATTR
 net_disconnect (void)
@@ -153,13 +337,82 @@ net_disconnect (void)
 	return check_error("espconn_disconnect()", espconn_disconnect(&conn));
 }
 
-// Send data after connecting
-bool ICACHE_FLASH_ATTR
-net_send (uint8_t *buf, size_t len)
+// Send next chunk from the source. Returns false when the send fails, or
+// when the source is exhausted, in which case the source is cleared
+static bool ICACHE_FLASH_ATTR
+send_chunk (void)
 {
-	if (!buf || !len)
+	uint8_t *buf;
+	size_t len;
+
+	if (source == NULL)
 		return false;
 
-	os_printf(buf);
+	if ((len = source(&buf)) == 0) {
+		source = NULL;
+		return false;
+	}
+
+	log_debug("Net: sending %u bytes\n", len);
 	return check_error("espconn_send()", espconn_send(&conn, buf, len));
 }
+
+#if NET_UDP
+
+// Send the datagram, or give up if we've tried often enough
+static void ICACHE_FLASH_ATTR
+on_timeout (void *data)
+{
+	if (datagram == NULL)
+		return;
+
+	if (attempts++ > NET_UDP_RETRIES) {
+		datagram = NULL;
+		on_ack_timeout(NULL);
+		return;
+	}
+
+	if (attempts > 1)
+		log_info("Net: resending datagram (%u)\n", attempts - 1);
+
+	if (!check_error("espconn_send()", espconn_send(&conn, datagram, datagram_len))) {
+		datagram = NULL;
+		state_change(STATE_NET_CONNECT_FAIL);
+		return;
+	}
+
+	os_timer_arm(&timer, NET_UDP_TIMEOUT_MS, 0);
+}
+
+// Send data as a single datagram, which must fit in one chunk
+bool ICACHE_FLASH_ATTR
+net_send (net_source src)
+{
+	uint8_t *next;
+
+	if ((datagram_len = src(&datagram)) == 0)
+		return false;
+
+	if (src(&next) != 0) {
+		log_error("Net: payload too large for datagram!\n");
+		return false;
+	}
+
+	attempts = 0;
+	os_timer_disarm(&timer);
+	os_timer_setfn(&timer, (os_timer_func_t *) on_timeout, NULL);
+	on_timeout(NULL);
+	return true;
+}
+
+#else
+
+// Send data after connecting, chunk by chunk
+bool ICACHE_FLASH_ATTR
+net_send (net_source src)
+{
+	source = src;
+	return send_chunk();
+}
+
+#endif
@@ -1,6 +1,29 @@
 #define REMOTE_PORT	80
 #define REMOTE_IP	{ 192, 168, 178, 13 }
 
+// Time to wait for the connection to be set up:
+#define NET_CONNECT_TIMEOUT_MS	5000
+
+// The server acknowledges an upload once it has stored all of its records,
+// by returning the sequence number of the current record in an "X-Ack"
+// response header. Without an acknowledgement in time, the upload failed:
+#define NET_ACK_TIMEOUT_MS	5000
+
+// Send the binary payload as a UDP datagram instead of a HTTP POST. The
+// receiver acknowledges a datagram by echoing its first two and last two
+// bytes, which are the magic and the CRC, followed by the sequence number
+// as a 32-bit little-endian value. Without an acknowledgement, the datagram
+// is sent again after a timeout, up to NET_UDP_RETRIES times:
+#define NET_UDP			0
+#define NET_UDP_PORT		8266
+#define NET_UDP_TIMEOUT_MS	500
+#define NET_UDP_RETRIES		3
+#define NET_UDP_ACK_SIZE	8
+
 bool net_connect (void);
 bool net_disconnect (void);
-bool net_send (uint8_t *buf, size_t len);
+// Supplies the next chunk of data to send, returns zero when done:
+typedef size_t (*net_source) (uint8_t **buf);
+
+bool net_send (net_source source);
+bool net_ack (uint32_t *seq);
@@ -3,6 +3,7 @@
 #include <osapi.h>
 #include <gpio.h>
 
+#include "log.h"
 #include "missing.h"
 
 // Pin 5 is the power pin (D1 on the NodeMCU)
@@ -99,14 +100,14 @@ onewire_reset (void)
 	// Check that line is pulled down by slave:
 	os_delay_us(100);
 	if (line_read()) {
-		os_printf("%s: slave not pulling down line\n", __FUNCTION__);
+		log_error("%s: slave not pulling down line\n", __FUNCTION__);
 		ret = false;
 	}
 
 	// Wait for slave to release line:
 	os_delay_us(500);
 	if (!line_read()) {
-		os_printf("%s: line not pulled up\n", __FUNCTION__);
+		log_error("%s: line not pulled up\n", __FUNCTION__);
 		ret = false;
 	}
 
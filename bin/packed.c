@@ -0,0 +1,314 @@
+#include <os_type.h>
+#include <osapi.h>
+#include <mem.h>
+#include <user_interface.h>
+
+#include "crc.h"
+#include "ds18b20.h"
+#include "flash_log.h"
+#include "fourier.h"
+#include "http.h"
+#include "missing.h"
+#include "packed.h"
+#include "sensor_table.h"
+#include "sensors.h"
+#include "stream.h"
+#include "trace.h"
+
+// One record, unpacked. Sized for the sensor table, as in sensors.c:
+struct frame {
+	uint32_t	seq;
+	uint32_t	age;
+	int16_t		reading[NSENSORS];
+	uint8_t		status[NSENSORS];
+	uint32_t	carried[NSENSORS];
+	int16_t		min[NSENSORS];
+	int16_t		max[NSENSORS];
+	uint16_t	spread[NSENSORS];
+	uint8_t		count[NSENSORS];
+};
+
+// Largest encoded frame: sequence number, age, status flag and nibbles, age
+// flag and ages, statistics flag and statistics, residuals:
+#define FRAME_SIZE_MAX	(5 + 5 + 1 + (NSENSORS + 1) / 2 + 1 + (NSENSORS) * 5 \
+			+ 1 + (NSENSORS) * 5 * 4 + (NSENSORS) * 5)
+
+// Largest encoded crash trace: flag, reason, cause, program counter, number
+// of entries, and per entry the time, state and pending events:
+#define CRASH_SIZE_MAX	(1 + 4 * 5 + TRACE_ENTRIES * (3 + 1 + 1))
+
+// Fail to compile if the decoders can't take this many sensors, or if a
+// frame can't fit in a chunk of the message:
+typedef char sensors_max_check[(NSENSORS <= PACKED_SENSORS_MAX) ? 1 : -1];
+typedef char frame_size_check[(FRAME_SIZE_MAX <= HTTP_CHUNK_SIZE) ? 1 : -1];
+
+// The frame being encoded, and the one before it:
+static struct frame frames[2];
+static struct frame *cur  = &frames[0];
+static struct frame *prev = &frames[1];
+
+// Encoding buffer. A part of the payload is encoded against the state after
+// the last committed part: the previous frame, whether there was one, and
+// the checksum. It only becomes that state once committed, so that a part
+// that didn't fit in a chunk can be encoded again for the next:
+static uint8_t buf[(FRAME_SIZE_MAX > CRASH_SIZE_MAX) ? FRAME_SIZE_MAX : CRASH_SIZE_MAX];
+static uint16_t crc, crc_next;
+static bool first, encoded;
+
+// Store 16-bit value, little-endian
+static inline uint8_t *
+put16 (uint8_t *p, const uint16_t val)
+{
+	*p++ = val;
+	*p++ = val >> 8;
+	return p;
+}
+
+// Store 32-bit value, little-endian
+static inline uint8_t *
+put32 (uint8_t *p, const uint32_t val)
+{
+	p = put16(p, val);
+	p = put16(p, val >> 16);
+	return p;
+}
+
+// Store unsigned varint
+static inline uint8_t *
+put_varint (uint8_t *p, uint32_t val)
+{
+	for (; val > 0x7F; val >>= 7)
+		*p++ = (val & 0x7F) | 0x80;
+
+	*p++ = val;
+	return p;
+}
+
+// Add encoded bytes to the stream and the checksum
+static void ICACHE_FLASH_ATTR
+emit (struct stream *s, const uint8_t *end)
+{
+	stream_put(s, buf, end - buf);
+	crc_next = crc16(buf, end - buf, crc_next);
+}
+
+// Encode a frame relative to the previous one
+static void ICACHE_FLASH_ATTR
+frame_encode (struct stream *s, const struct frame *cur, const struct frame *prev, const bool first, const uint8_t nsensors)
+{
+	uint8_t *p = buf;
+	int32_t above = 0;
+	bool carried = false;
+	bool stats = false;
+
+	// Sequence number and age, absolute unless the previous record has
+	// one to go by:
+	p = put_varint(p, first ? 0 : cur->seq - prev->seq);
+
+	if (cur->age == PACKED_UNDATED)
+		*p++ = 0;
+	else if (first || prev->age == PACKED_UNDATED)
+		p = put_varint(p, cur->age + 1);
+	else
+		p = put_varint(p, prev->age - cur->age);
+
+	// Statuses, only if any of them changed:
+	if (os_memcmp(cur->status, prev->status, nsensors) == 0)
+		*p++ = 0;
+	else {
+		*p++ = 1;
+		for (uint8_t i = 0; i < nsensors; i += 2)
+			*p++ = cur->status[i] | ((i + 1 < nsensors) ? cur->status[i + 1] << 4 : 0);
+	}
+
+	// Ages of carried readings, only if there are any:
+	for (uint8_t i = 0; i < nsensors; i++)
+		if (cur->carried[i] > 0)
+			carried = true;
+
+	*p++ = carried;
+	if (carried)
+		for (uint8_t i = 0; i < nsensors; i++)
+			p = put_varint(p, cur->carried[i]);
+
+	// Statistics, only if any sensor was read more than once:
+	for (uint8_t i = 0; i < nsensors; i++)
+		if (cur->count[i] > 1)
+			stats = true;
+
+	*p++ = stats;
+	if (stats)
+		for (uint8_t i = 0; i < nsensors; i++) {
+			p = put_varint(p, cur->count[i]);
+			if (cur->count[i] < 2)
+				continue;
+
+			p = put_varint(p, ZIGZAG_ENCODE(cur->min[i] - cur->reading[i]));
+			p = put_varint(p, ZIGZAG_ENCODE(cur->max[i] - cur->reading[i]));
+			p = put_varint(p, cur->spread[i]);
+		}
+
+	// Residuals over time and depth:
+	for (uint8_t sensor = 0; sensor < nsensors; sensor++) {
+		int32_t delta = first
+			? cur->reading[sensor]
+			: cur->reading[sensor] - prev->reading[sensor];
+
+		p = put_varint(p, ZIGZAG_ENCODE(delta - above));
+		above = delta;
+	}
+
+	emit(s, p);
+}
+
+// Create the header of the payload, and start encoding records
+void ICACHE_FLASH_ATTR
+packed_header (struct stream *s, const struct upload *upload)
+{
+	const uint8_t nsensors = sensors_count();
+	uint8_t nrecords = 1;
+	uint32_t seq = upload->seq;
+	uint8_t *p = buf;
+
+	// Count the logged records that we can read, and find the first:
+	for (uint32_t i = upload->backlog; i-- > 0; )
+		if (flash_log_read(i, NULL, NULL)) {
+			seq = flash_log_seq(i);
+			nrecords++;
+		}
+
+	*p++ = PACKED_MAGIC[0];
+	*p++ = PACKED_MAGIC[1];
+	*p++ = PACKED_VERSION;
+	*p++ = nsensors;
+	*p++ = nrecords;
+	*p++ = upload->rssi;
+	p = put16(p, upload->millivolt);
+	p = put16(p, upload->adc);
+	p = put32(p, system_get_chip_id());
+	p = put32(p, seq);
+	p = put32(p, upload->epoch);
+
+	crc_next = 0xFFFF;
+	emit(s, p);
+
+	// The first frame is compared to all sensors being successful:
+	os_memset(prev->status, DS18B20_SUCCESS, sizeof(prev->status));
+	first   = true;
+	encoded = false;
+}
+
+// Add a logged record with the given sequence number and age, which is
+// PACKED_UNDATED if unknown. The records are added oldest first; records that
+// fail to read are skipped, but still count as sent
+void ICACHE_FLASH_ATTR
+packed_record (struct stream *s, const void *record, const uint32_t seq, const uint32_t age)
+{
+	const uint8_t nsensors = sensors_count();
+
+	crc_next = crc;
+	sensors_unpack(record, cur->reading, cur->status, cur->carried);
+	sensors_unpack_stats(record, cur->min, cur->max, cur->spread, cur->count);
+	cur->seq = seq;
+	cur->age = age;
+	frame_encode(s, cur, prev, first, nsensors);
+	encoded = true;
+}
+
+// Create the end of the payload: the current record, the soil model fit,
+// the crash trace and the checksum
+void ICACHE_FLASH_ATTR
+packed_trailer (struct stream *s, const struct upload *upload)
+{
+	const uint8_t nsensors = sensors_count();
+	uint8_t *p;
+
+	crc_next = crc;
+
+	// Current record:
+	sensors_unpack(sensors_record_data(), cur->reading, cur->status, cur->carried);
+	sensors_unpack_stats(sensors_record_data(), cur->min, cur->max, cur->spread, cur->count);
+	cur->seq = upload->seq;
+	cur->age = 0;
+	frame_encode(s, cur, prev, first, nsensors);
+
+	// Soil model fit:
+	p = buf;
+	*p++ = upload->has_fit;
+	if (upload->has_fit) {
+		p = put_varint(p, upload->fit.depth);
+		p = put_varint(p, upload->fit.amplitude);
+		p = put_varint(p, upload->fit.peak_age);
+		p = put_varint(p, upload->fit.residual);
+	}
+	emit(s, p);
+
+	// Trace of a crashed cycle:
+	p = buf;
+	*p++ = (upload->crash != NULL);
+	if (upload->crash != NULL) {
+		const struct trace *crash = upload->crash;
+		uint16_t time = 0;
+
+		p = put_varint(p, crash->reason);
+		p = put_varint(p, crash->exccause);
+		p = put_varint(p, crash->epc);
+		p = put_varint(p, crash->count);
+
+		for (uint8_t i = 0; i < crash->count; i++) {
+			p = put_varint(p, (uint16_t) (crash->entry[i].time - time));
+			*p++ = crash->entry[i].state;
+			*p++ = crash->entry[i].arg;
+			time = crash->entry[i].time;
+		}
+	}
+	emit(s, p);
+
+	// Checksum:
+	p = put16(buf, crc_next);
+	stream_put(s, buf, p - buf);
+}
+
+// Commit the part that was encoded last, once it is sent in full, so that
+// the next part is encoded after it
+void ICACHE_FLASH_ATTR
+packed_commit (void)
+{
+	struct frame *swap;
+
+	crc = crc_next;
+
+	if (!encoded)
+		return;
+
+	swap    = prev;
+	prev    = cur;
+	cur     = swap;
+	first   = false;
+	encoded = false;
+}
+
+// Create the whole compact binary payload in one go
+void ICACHE_FLASH_ATTR
+packed_create (struct stream *s, const struct upload *upload)
+{
+	uint32_t time;
+	void *record;
+
+	packed_header(s, upload);
+	packed_commit();
+
+	if (upload->backlog > 0 && (record = os_malloc(sensors_record_size())) != NULL) {
+		for (uint32_t i = 0; i < upload->backlog; i++) {
+			if (!flash_log_read(i, record, &time))
+				continue;
+
+			packed_record(s, record, flash_log_seq(i), (time == FLASH_LOG_UNDATED)
+				? PACKED_UNDATED : upload->clock - time);
+			packed_commit();
+		}
+		os_free(record);
+	}
+
+	packed_trailer(s, upload);
+}
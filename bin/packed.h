@@ -0,0 +1,95 @@
+/* Compact binary payload, all fixed-size fields little-endian:
+
+	offset	size	field
+	0	2	magic, "ST"
+	2	1	version
+	3	1	number of sensors
+	4	1	number of records
+	5	1	RSSI, signed
+	6	2	supply voltage in millivolt
+	8	2	ADC reading
+	10	4	chip ID
+	14	4	sequence number of the first record
+	18	4	epoch of the sequence numbers
+	22	...	records
+	...	...	soil model fit
+	...	...	crash trace
+	...	2	CRC-16 over all of the above
+
+   Records are in time order: the logged records oldest first, and the
+   current record last. Readings are in 1/16 degrees C, the sensor's own
+   resolution. Each record is encoded as a frame of varints:
+
+	- The increase in sequence number since the previous record, zero for
+	  the first record. Together with the chip ID and the epoch, the
+	  sequence number identifies a record, so that the server can ignore
+	  duplicates. The epoch changes when the sequence numbers start over.
+
+	- The age in seconds. For the first record, and for the first record
+	  after one without an age, this is the absolute age plus one, or zero
+	  if the age is unknown. For later records it is the decrease in age
+	  since the previous record. The age is unknown for records logged
+	  before the probe's clock last started over, which are always the
+	  oldest ones.
+
+	- A status flag. If zero, the sensor statuses are the same as in the
+	  previous record (or all "success" for the first record). Otherwise,
+	  the flag is followed by one status nibble per sensor, two per byte,
+	  low nibble first.
+
+	- An age flag. If zero, all readings are fresh. Otherwise, the flag is
+	  followed by one age per sensor: the number of seconds since the
+	  reading was taken, for sensors that weren't read for this record
+	  and carry an earlier reading, or zero.
+
+	- A statistics flag. If zero, no sensor was read more than once for
+	  this record. Otherwise, the flag is followed by, per sensor, the
+	  number of readings that went into the record. If that is two or more,
+	  it is followed by the zig-zag encoded lowest and highest reading
+	  relative to the record's reading, and the standard deviation in
+	  degrees C * 10000.
+
+	- One zig-zag encoded residual per sensor, in sensor table order. In
+	  the first record, the residual is the difference with the reading of
+	  the sensor above it. In later records, the residual is the change in
+	  reading since the previous record, minus the same change for the
+	  sensor above it. Neighbouring depths tend to drift together, so the
+	  residuals are mostly zero or one, and fit in a single byte.
+
+   The soil model fit is a flag, zero if there is no fit yet. Otherwise, the
+   flag is followed by four varints: the damping depth in mm, the amplitude
+   in degrees C * 10000, the seconds since the last peak, and the residual in
+   degrees C * 10000.
+
+   The crash trace is a flag, zero if the last reset wasn't a crash. Otherwise,
+   the flag is followed by varints for the reset reason, the exception cause,
+   the exception program counter and the number of trace entries. Each entry
+   is a varint with the time since the previous entry in 1/100 seconds
+   (since boot for the first entry, modulo 65536), the state byte, with the
+   top bit set if the state was entered rather than posted, and the number
+   of pending events.
+
+   Varints are LEB128: seven bits per byte, least significant first, with
+   the top bit set on all but the last byte.
+*/
+
+#define PACKED_MAGIC		"ST"
+#define PACKED_VERSION		9
+#define PACKED_HEADER_SIZE	22
+#define PACKED_SENSORS_MAX	32
+
+// Age of a record that was logged before the clock last started over:
+#define PACKED_UNDATED		UINT32_MAX
+
+// Zig-zag encoding maps signed to unsigned, with small magnitudes small:
+#define ZIGZAG_ENCODE(n)	(((uint32_t)(n) << 1) ^ (uint32_t)((int32_t)(n) >> 31))
+#define ZIGZAG_DECODE(n)	((int32_t)((n) >> 1) ^ -(int32_t)((n) & 1))
+
+struct stream;
+struct upload;
+
+void packed_header (struct stream *s, const struct upload *upload);
+void packed_record (struct stream *s, const void *record, const uint32_t seq, const uint32_t age);
+void packed_trailer (struct stream *s, const struct upload *upload);
+void packed_commit (void);
+void packed_create (struct stream *s, const struct upload *upload);
@@ -0,0 +1,103 @@
+#include <os_type.h>
+#include <osapi.h>
+#include <user_interface.h>
+
+#include "ds18b20.h"
+#include "log.h"
+#include "missing.h"
+#include "power.h"
+#include "rtc_mem.h"
+
+// The supply voltage is read once at every wakeup, before the radio is on,
+// and sets the power level for this wakeup. The level is kept in RTC memory,
+// because recovering from a level depends on the level we're in.
+
+// State in RTC memory:
+struct state {
+	uint16_t	sig;
+	uint8_t		level;		// Current power level
+	uint8_t		pad;
+};
+
+#define STATE_SIG	0xB477
+
+static struct state state;
+
+// Voltage below which each level drops to the next one:
+static const uint16_t threshold[] = {
+	[POWER_FULL]		= POWER_LOW_MV,
+	[POWER_LOW]		= POWER_CRITICAL_MV,
+	[POWER_CRITICAL]	= POWER_EMPTY_MV,
+};
+
+// Set the power level from the supply voltage, restoring the level of the
+// previous wakeup after deep sleep
+void ICACHE_FLASH_ATTR
+power_init (const bool warm)
+{
+	const uint32_t millivolt = (readvdd33() * 1000) / 1024;
+	uint8_t level = POWER_FULL;
+
+	if (warm && rtc_mem_read(RTC_MEM_POWER, &state, sizeof(state)) && state.sig == STATE_SIG && state.level <= POWER_EMPTY)
+		level = state.level;
+
+	// Drop as soon as the voltage falls below a threshold:
+	while (level < POWER_EMPTY && millivolt < threshold[level])
+		level++;
+
+	// Recover only when the voltage is well above the threshold:
+	while (level > POWER_FULL && millivolt >= threshold[level - 1] + POWER_HYSTERESIS_MV)
+		level--;
+
+	if (!warm || level != state.level)
+		log_info("Power: %u mV, level %u\n", millivolt, level);
+
+	state.sig   = STATE_SIG;
+	state.level = level;
+	state.pad   = 0;
+	rtc_mem_write(RTC_MEM_POWER, &state, sizeof(state));
+}
+
+// Get the current power level
+enum power_level ICACHE_FLASH_ATTR
+power_level (void)
+{
+	return state.level;
+}
+
+// Get the allowed number of retries, out of the number at full power
+uint8_t ICACHE_FLASH_ATTR
+power_retries (const uint8_t retries)
+{
+	return (state.level == POWER_FULL) ? retries : 0;
+}
+
+// Get the sensor resolution in bits
+uint8_t ICACHE_FLASH_ATTR
+power_resolution (void)
+{
+	return (state.level == POWER_FULL)
+		? DS18B20_RESOLUTION_MAX
+		: POWER_LOW_RESOLUTION;
+}
+
+// Check if enough records are pending to be worth switching on the radio.
+// Records that aren't uploaded stay in the flash log:
+bool ICACHE_FLASH_ATTR
+power_upload_due (const uint32_t pending)
+{
+	switch (state.level)
+	{
+	case POWER_FULL:
+		return true;
+
+	case POWER_LOW:
+		return pending >= POWER_LOW_BATCH;
+
+	case POWER_CRITICAL:
+		return pending >= POWER_CRITICAL_BATCH;
+
+	default:
+		return false;
+	}
+}
@@ -0,0 +1,32 @@
+// Supply voltage thresholds in millivolts. As the battery drains, the supply
+// voltage falls through these levels, and each level trades some service for
+// battery life. A level is only left upwards when the voltage recovers to the
+// threshold plus the hysteresis, so that a voltage hovering around a threshold
+// doesn't flip the level at every wakeup:
+#define POWER_LOW_MV		3000
+#define POWER_CRITICAL_MV	2850
+#define POWER_EMPTY_MV		2700
+#define POWER_HYSTERESIS_MV	100
+
+// Number of pending records to wait for before uploading, at low and at
+// critical power:
+#define POWER_LOW_BATCH		4
+#define POWER_CRITICAL_BATCH	16
+
+// Sensor resolution in bits below full power. Lower resolution shortens the
+// temperature conversion, and with it the time spent awake:
+#define POWER_LOW_RESOLUTION	10
+
+// Power levels, from full service to none:
+enum power_level {
+	POWER_FULL = 0,		// Full service
+	POWER_LOW,		// Batch uploads, lower resolution, no retries
+	POWER_CRITICAL,		// Batch more uploads
+	POWER_EMPTY,		// Log locally, never transmit
+};
+
+void power_init (const bool warm);
+enum power_level power_level (void);
+uint8_t power_retries (const uint8_t retries);
+uint8_t power_resolution (void);
+bool power_upload_due (const uint32_t pending);
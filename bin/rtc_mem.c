@@ -2,64 +2,92 @@
 #include <osapi.h>
 #include <user_interface.h>
 
+#include "log.h"
 #include "missing.h"
+#include "rtc_mem.h"
 #include "sensors.h"
 
 // Header structure for RTC memory block:
 struct header {
 	uint32_t	sig;
-	uint8_t		num_records;
+	uint8_t		num_records;	// Wakeups merged into the statistics
 	uint8_t		record_size;
+	uint8_t		has_sent;	// Whether the sent record is valid
+	uint32_t	clock;		// Seconds since cold boot at wakeup
+	uint32_t	sent_clock;	// Clock at last acknowledged upload
 };
 
+// Copy of the header, kept between load and save:
+static struct header header;
+
+// Fail to compile if the header outgrows its blocks:
+typedef char header_size_check[(sizeof(struct header) <= RTC_MEM_HEADER * 4) ? 1 : -1];
+
 #define RECORD_SIG	0xDEADBEEF
 
 // Round upwards to next 4 bytes:
 #define ROUNDUP(x)	(((x) + 3) & ~0x03)
 
-// Memory block address of n'th sensor record block:
-#define RECORDADDR(n)	(64 + ROUNDUP(sizeof(struct header)) / 4 \
-			+ (n) * (ROUNDUP(sensors_record_size()) / 4))
+// Memory block address of the last sent record, which follows the header:
+#define SENTADDR	RTC_MEM_SENSORS
+
+// Memory block address of the last readings table, which follows that:
+#define LASTADDR	(SENTADDR + ROUNDUP(sensors_sent_size()) / 4)
+
+// Memory block address of the running statistics, which follow that:
+#define STATSADDR	(LASTADDR + ROUNDUP(sensors_last_size()) / 4)
 
-// Import RTC memory, return number of valid records:
+// Import RTC memory, return number of wakeups in the statistics:
 uint8_t ICACHE_FLASH_ATTR
 rtc_mem_load (void)
 {
-	struct header header;
-
 	// Read header structure:
-	if (!system_rtc_mem_read(64, &header, sizeof(header))) {
-		os_printf("%s: read failed!\n", __FUNCTION__);
+	if (!system_rtc_mem_read(RTC_MEM_START, &header, sizeof(header))) {
+		log_error("%s: read failed!\n", __FUNCTION__);
 		goto err;
 	}
 
 	// Check signature:
 	if (header.sig != RECORD_SIG) {
-		os_printf("%s: signature fail!\n", __FUNCTION__);
+		log_error("%s: signature fail!\n", __FUNCTION__);
 		goto err;
 	}
 
 	// Check that record size is what we expect:
 	if (header.record_size != sensors_record_size()) {
-		os_printf("%s: record size: expected %u, got %u\n",
+		log_error("%s: record size: expected %u, got %u\n",
 			__FUNCTION__, sensors_record_size(), header.record_size);
 		goto err;
 	}
 
-	// Everything looks OK, let's import the existing records into the
-	// sensors module:
-	for (uint8_t i = 0; i < header.num_records; i++)
-		if (!system_rtc_mem_read(RECORDADDR(i),
-				sensors_record_data(i),
-				sensors_record_size())) {
-			os_printf("%s: read failed!\n", __FUNCTION__);
-			goto err;
-		}
-
-	os_printf("%s: read %u records\n", __FUNCTION__, header.num_records);
+	// Everything looks OK, let's import the last readings and the
+	// running statistics into the sensors module:
+	if (!system_rtc_mem_read(LASTADDR, sensors_last_data(), sensors_last_size())) {
+		log_error("%s: read failed!\n", __FUNCTION__);
+		goto err;
+	}
+
+	if (header.num_records > 0 && !system_rtc_mem_read(STATSADDR,
+			sensors_stats_data(),
+			sensors_stats_size())) {
+		log_error("%s: read failed!\n", __FUNCTION__);
+		goto err;
+	}
+
+	// Import the last sent record, if any:
+	if (header.has_sent && !system_rtc_mem_read(SENTADDR,
+			sensors_sent_data(),
+			sensors_sent_size())) {
+		log_error("%s: read failed!\n", __FUNCTION__);
+		header.has_sent = false;
+	}
+
+	log_debug("%s: read %u records\n", __FUNCTION__, header.num_records);
 	return header.num_records;
 
 err:	memset(&header, 0, sizeof(header));
+	memset(sensors_last_data(), 0, sensors_last_size());
+	memset(sensors_stats_data(), 0, sensors_stats_size());
 	return 0;
 }
 
@@ -67,26 +95,107 @@ err:	memset(&header, 0, sizeof(header));
 bool ICACHE_FLASH_ATTR
 rtc_mem_save (uint8_t num_records)
 {
-	struct header header = {
-		.sig		= RECORD_SIG,
-		.num_records	= num_records,
-		.record_size	= sensors_record_size()
-	};
-
-	// Write header:
-	if (!system_rtc_mem_write(64, &header, sizeof(header)))
+	header.sig         = RECORD_SIG;
+	header.num_records = num_records;
+	header.record_size = sensors_record_size();
+
+	// Write header and last readings:
+	if (!system_rtc_mem_write(RTC_MEM_START, &header, sizeof(header)))
 		goto err;
 
-	// Write records:
-	for (uint8_t i = 0; i < num_records; i++)
-		if (!system_rtc_mem_write(RECORDADDR(i),
-				sensors_record_data(i),
-				header.record_size))
-			goto err;
+	if (!system_rtc_mem_write(LASTADDR, sensors_last_data(), sensors_last_size()))
+		goto err;
+
+	// Write the running statistics:
+	if (num_records > 0 && !system_rtc_mem_write(STATSADDR,
+			sensors_stats_data(),
+			sensors_stats_size()))
+		goto err;
 
-	os_printf("%s: wrote %u records\n", __FUNCTION__, num_records);
+	log_debug("%s: wrote %u records\n", __FUNCTION__, num_records);
 	return true;
 
-err:	os_printf("%s: write failed!\n", __FUNCTION__);
+err:	log_error("%s: write failed!\n", __FUNCTION__);
+	return false;
+}
+
+// Get the time in seconds since cold boot
+uint32_t ICACHE_FLASH_ATTR
+rtc_mem_clock (void)
+{
+	// The clock in the header was valid at wakeup, add the time we've
+	// been awake since:
+	return header.clock + system_get_time() / 1000000;
+}
+
+// Whether the clock carries on from before the reset. It only does after a
+// wakeup from deep sleep whose header was read back, otherwise it starts over
+// at zero
+bool ICACHE_FLASH_ATTR
+rtc_mem_clock_kept (void)
+{
+	return header.sig == RECORD_SIG;
+}
+
+// Save the time at which we will wake up from deep sleep
+bool ICACHE_FLASH_ATTR
+rtc_mem_clock_save (const uint32_t sleep_sec)
+{
+	header.sig         = RECORD_SIG;
+	header.record_size = sensors_record_size();
+	header.clock       = rtc_mem_clock() + sleep_sec;
+
+	if (system_rtc_mem_write(RTC_MEM_START, &header, sizeof(header)))
+		return true;
+
+	log_error("%s: write failed!\n", __FUNCTION__);
+	return false;
+}
+
+// Save the record that the server just acknowledged
+bool ICACHE_FLASH_ATTR
+rtc_mem_sent_save (void)
+{
+	header.sig         = RECORD_SIG;
+	header.record_size = sensors_record_size();
+	header.has_sent    = true;
+	header.sent_clock  = rtc_mem_clock();
+
+	if (system_rtc_mem_write(SENTADDR, sensors_sent_data(), sensors_sent_size())
+	 && system_rtc_mem_write(RTC_MEM_START, &header, sizeof(header)))
+		return true;
+
+	log_error("%s: write failed!\n", __FUNCTION__);
+	return false;
+}
+
+// Get the time in seconds since the last acknowledged upload, returns false
+// if there was none since cold boot
+bool ICACHE_FLASH_ATTR
+rtc_mem_sent_age (uint32_t *age)
+{
+	*age = rtc_mem_clock() - header.sent_clock;
+	return header.has_sent;
+}
+
+// Read a fixed-size area owned by another module
+bool ICACHE_FLASH_ATTR
+rtc_mem_read (const uint8_t block, void *data, const size_t size)
+{
+	if (system_rtc_mem_read(block, data, size))
+		return true;
+
+	log_error("%s: read failed at block %u!\n", __FUNCTION__, block);
+	return false;
+}
+
+// Write a fixed-size area owned by another module
+bool ICACHE_FLASH_ATTR
+rtc_mem_write (const uint8_t block, const void *data, const size_t size)
+{
+	if (system_rtc_mem_write(block, data, size))
+		return true;
+
+	log_error("%s: write failed at block %u!\n", __FUNCTION__, block);
 	return false;
 }
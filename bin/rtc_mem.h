@@ -1,2 +1,26 @@
+// User RTC memory consists of 128 blocks of 4 bytes, starting at block 64.
+// The header, the last sent record, the last readings and the running
+// statistics grow upwards from the start, fixed-size areas for other modules
+// are allocated downwards from the end:
+#define RTC_MEM_START		64
+#define RTC_MEM_END		192
+
+// Blocks taken by the header, and the start of the sensors module's areas
+// after it. These must end by RTC_MEM_POWER, the lowest fixed-size area:
+#define RTC_MEM_HEADER		4
+#define RTC_MEM_SENSORS		(RTC_MEM_START + RTC_MEM_HEADER)
+#define RTC_MEM_FLASH_LOG	(RTC_MEM_END - 4)
+#define RTC_MEM_SCHEDULE	(RTC_MEM_FLASH_LOG - 15)
+#define RTC_MEM_FOURIER		(RTC_MEM_SCHEDULE - 35)
+#define RTC_MEM_TRACE		(RTC_MEM_FOURIER - 13)
+#define RTC_MEM_POWER		(RTC_MEM_TRACE - 1)
+
 uint8_t rtc_mem_load (void);
 bool rtc_mem_save (uint8_t num_records);
+uint32_t rtc_mem_clock (void);
+bool rtc_mem_clock_kept (void);
+bool rtc_mem_clock_save (const uint32_t sleep_sec);
+bool rtc_mem_sent_save (void);
+bool rtc_mem_sent_age (uint32_t *age);
+bool rtc_mem_read (const uint8_t block, void *data, const size_t size);
+bool rtc_mem_write (const uint8_t block, const void *data, const size_t size);
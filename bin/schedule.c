@@ -0,0 +1,114 @@
+#include <os_type.h>
+#include <osapi.h>
+#include <user_interface.h>
+
+#include "ds18b20.h"
+#include "log.h"
+#include "missing.h"
+#include "rtc_mem.h"
+#include "schedule.h"
+#include "sensors.h"
+
+// The deep sleep interval adapts to how fast the temperatures change. At each
+// wakeup, we compare the readings to those of the previous wakeup, and find
+// the interval in which the fastest-moving sensor would move by one step.
+// The interval shrinks at once when temperatures start to move, for instance
+// on a sunny spring morning or during a frost, but grows by at most a factor
+// two per wakeup, so that a single quiet reading doesn't stretch it too far.
+
+// State in RTC memory:
+struct state {
+	uint32_t	sig;
+	uint32_t	clock;		// Clock time of previous readings
+	uint32_t	interval;	// Current interval in seconds
+	int16_t		reading[SCHEDULE_SENSORS_MAX];
+	uint8_t		status[SCHEDULE_SENSORS_MAX];
+};
+
+#define STATE_SIG	0x5C4ED01E
+
+static struct state state;
+
+// Save state to RTC memory
+static inline void
+state_save (void)
+{
+	rtc_mem_write(RTC_MEM_SCHEDULE, &state, sizeof(state));
+}
+
+// Restore state after deep sleep, or start over after a cold boot
+void ICACHE_FLASH_ATTR
+schedule_init (const bool warm)
+{
+	if (warm && rtc_mem_read(RTC_MEM_SCHEDULE, &state, sizeof(state)) && state.sig == STATE_SIG)
+		return;
+
+	os_memset(&state, 0, sizeof(state));
+	state.interval = SCHEDULE_START_SEC;
+}
+
+// Update the interval from a new record
+void ICACHE_FLASH_ATTR
+schedule_update (const void *record, const uint32_t clock)
+{
+	int16_t reading[SCHEDULE_SENSORS_MAX];
+	uint8_t status[SCHEDULE_SENSORS_MAX];
+	uint32_t age[SCHEDULE_SENSORS_MAX];
+	const uint8_t nsensors = sensors_count();
+	const uint32_t elapsed = clock - state.clock;
+	uint32_t interval = SCHEDULE_MAX_SEC;
+	int16_t delta_max = 0;
+
+	if (nsensors > SCHEDULE_SENSORS_MAX)
+		return;
+
+	sensors_unpack(record, reading, status, age);
+
+	// Find the largest change among the sensors that read successfully
+	// both times. Carried readings are too old to tell:
+	for (uint8_t i = 0; i < nsensors; i++) {
+		int16_t delta = reading[i] - state.reading[i];
+
+		if (status[i] != DS18B20_SUCCESS || state.status[i] != DS18B20_SUCCESS)
+			continue;
+
+		if (age[i] > 0)
+			continue;
+
+		if (delta < 0)
+			delta = -delta;
+
+		if (delta > delta_max)
+			delta_max = delta;
+	}
+
+	// Interval in which the fastest sensor moves by one step:
+	if (state.sig == STATE_SIG && elapsed > 0) {
+		if (delta_max > 0)
+			interval = elapsed * SCHEDULE_STEP / delta_max;
+
+		if (interval > state.interval * 2)
+			interval = state.interval * 2;
+		if (interval < SCHEDULE_MIN_SEC)
+			interval = SCHEDULE_MIN_SEC;
+		if (interval > SCHEDULE_MAX_SEC)
+			interval = SCHEDULE_MAX_SEC;
+
+		log_debug("Schedule: max change %d in %u sec, interval %u sec\n", delta_max, elapsed, interval);
+		state.interval = interval;
+	}
+
+	// Remember the readings:
+	state.sig   = STATE_SIG;
+	state.clock = clock;
+	os_memcpy(state.reading, reading, nsensors * sizeof(reading[0]));
+	os_memcpy(state.status, status, nsensors);
+	state_save();
+}
+
+// Get the deep sleep interval in seconds
+uint32_t ICACHE_FLASH_ATTR
+schedule_interval (void)
+{
+	return state.interval;
+}
@@ -0,0 +1,17 @@
+// Deep sleep interval bounds, and the interval after a cold boot. The SDK
+// takes the sleep time in microseconds as a 32-bit value, which caps the
+// interval at a little over an hour:
+#define SCHEDULE_MIN_SEC	300UL
+#define SCHEDULE_MAX_SEC	3600UL
+#define SCHEDULE_START_SEC	900UL
+
+// The interval is chosen so that no sensor is expected to move by more than
+// this step between wakeups, in 1/16 degrees C:
+#define SCHEDULE_STEP		4
+
+// Largest number of sensors supported:
+#define SCHEDULE_SENSORS_MAX	16
+
+void schedule_init (const bool warm);
+void schedule_update (const void *record, const uint32_t clock);
+uint32_t schedule_interval (void);
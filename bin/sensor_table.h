@@ -0,0 +1,48 @@
+// Sensor address table, ordered from the top of the rod to the bottom. The
+// order is also the sensor index in the compact binary payload. Bytes are
+// written in lowercase hex without prefix, so that the same tokens can be
+// turned into both numbers and strings at compile time.
+// The first column is the sampling period in minutes. Deep soil changes
+// slowly, so the deeper sensors need not be read at every wakeup. In between,
+// the record carries their last reading and its age. Zero means every wakeup:
+#define SENSOR_TABLE \
+	SENSOR(  0, 28, 1c, f0, 1e, 00, 00, 80, 3f) \
+	SENSOR(  0, 28, 3a, 00, 03, 00, 00, 80, 38) \
+	SENSOR(  0, 28, e9, ff, 02, 00, 00, 80, e3) \
+	SENSOR( 60, 28, 97, cf, 1e, 00, 00, 80, c6) \
+	SENSOR( 60, 28, 2a, 9b, 1e, 00, 00, 80, 01) \
+	SENSOR(180, 28, 65, d0, 1e, 00, 00, 80, c9) \
+	SENSOR(180, 28, 43, 87, 1e, 00, 00, 80, 09)
+
+// Addresses as bytes, for the bus:
+#define SENSOR(period, a, b, c, d, e, f, g, h) \
+	{ 0x##a, 0x##b, 0x##c, 0x##d, 0x##e, 0x##f, 0x##g, 0x##h },
+
+static const uint8_t sensors[][8] = {
+	SENSOR_TABLE
+};
+
+#undef SENSOR
+
+// Addresses as colon-separated strings, for the upload:
+#define SENSOR(period, a, b, c, d, e, f, g, h) \
+	#a ":" #b ":" #c ":" #d ":" #e ":" #f ":" #g ":" #h,
+
+static const char sensor_names[][24] = {
+	SENSOR_TABLE
+};
+
+#undef SENSOR
+
+// Sampling periods in seconds:
+#define SENSOR(period, a, b, c, d, e, f, g, h) \
+	period * 60,
+
+static const uint16_t sensor_periods[] = {
+	SENSOR_TABLE
+};
+
+#undef SENSOR
+
+// Size of sensor table:
+#define NSENSORS	sizeof(sensors) / sizeof(sensors[0])
@@ -3,29 +3,51 @@
 #include <osapi.h>
 
 #include "ds18b20.h"
+#include "flash_log.h"
 #include "missing.h"
+#include "power.h"
+#include "rtc_mem.h"
+#include "sensor_table.h"
 #include "sensors.h"
 #include "state.h"
+#include "stream.h"
 
-// One sample:
+// One sensor in a consolidated record:
 struct sample {
+	int32_t		celsius;	// Mean temp in degrees C * 10000
+	uint32_t	age;		// Seconds since reading, if carried
+	int16_t		min;		// Lowest reading in 1/16 degrees C
+	int16_t		max;		// Highest reading in 1/16 degrees C
+	uint16_t	spread;		// Standard deviation in degrees C * 10000
+	uint8_t		count;		// Number of readings
+	uint8_t		status;		// Sensor status
+};
+
+// Running statistics of a sensor's readings, in 1/16 degrees C. The sum is
+// exact, and the sum of squared deviations from the mean is kept the way
+// Welford does, in 1/256 units, so that it doesn't lose precision:
+struct stats {
+	int32_t		sum;
+	uint32_t	m2;
+	uint16_t	count;		// Number of successful readings
+	int16_t		min;
+	int16_t		max;
+	uint8_t		status;		// Highest status seen
+};
+
+// Last successful reading of a sensor:
+struct last {
 	int32_t			celsius;	// Temp in degrees C * 10000
-	enum ds18b20_status	status;		// Sensor status
+	uint32_t		clock : 31;	// Clock time of reading
+	uint32_t		valid : 1;
 };
 
-// Sensor address table:
-static const uint8_t sensors[][8] = {
-	{ 0x28, 0x1C, 0xF0, 0x1E, 0x00, 0x00, 0x80, 0x3F },
-	{ 0x28, 0x3A, 0x00, 0x03, 0x00, 0x00, 0x80, 0x38 },
-	{ 0x28, 0xE9, 0xFF, 0x02, 0x00, 0x00, 0x80, 0xE3 },
-	{ 0x28, 0x97, 0xCF, 0x1E, 0x00, 0x00, 0x80, 0xC6 },
-	{ 0x28, 0x2A, 0x9B, 0x1E, 0x00, 0x00, 0x80, 0x01 },
-	{ 0x28, 0x65, 0xD0, 0x1E, 0x00, 0x00, 0x80, 0xC9 },
-	{ 0x28, 0x43, 0x87, 0x1E, 0x00, 0x00, 0x80, 0x09 },
+// The record last acknowledged by the server:
+struct sent {
+	int32_t			celsius;	// Temp in degrees C * 10000
+	uint8_t			status;
 };
 
-// Size of sensor table:
-#define NSENSORS	sizeof(sensors) / sizeof(sensors[0])
 
 // What we want to do in this project is to wake up every 15 minutes, take a
 // sample, retry the sample-taking a certain amount of times if we didn't get
@@ -33,32 +55,124 @@ static const uint8_t sensors[][8] = {
 // this record to RTC memory, then go into deep sleep.
 // Once every four wakeups (i.e. once an hour), take all records, consolidate
 // them into a per-sensor hourly average, and push those over wifi.
+// Readings go straight into running statistics per sensor: one set for the
+// current wakeup, and one that the wakeups are merged into until the upload.
+
+// Statistics of this wakeup, and of all wakeups since the last upload:
+static struct stats wake[NSENSORS];
+static struct stats total[NSENSORS];
+
+// The consolidated record:
+static struct sample record[NSENSORS];
+
+// The record last acknowledged by the server:
+static struct sent sent[NSENSORS];
+
+// Last readings, and which sensors are due for a reading this wakeup:
+static struct last last[NSENSORS];
+static bool due[NSENSORS];
+static uint32_t now;
 
-// Sample table:
-static struct sample samples[SENSORS_ROUNDS_MAX][NSENSORS];
+// The sizes follow from the sensor table. Fail to compile if the record
+// doesn't fit in a flash log entry, or if the last sent record, the last
+// readings and the running statistics, in whole blocks of RTC memory, run
+// into the other modules' areas:
+#define BLOCKS(x)	((sizeof(x) + 3) / 4)
 
-// Consolidated sensor records:
-static struct sample records[SENSORS_RECORDS_MAX][NSENSORS];
+typedef char record_size_check[(sizeof(record) <= FLASH_LOG_RECORD_MAX) ? 1 : -1];
+typedef char rtc_mem_size_check[(RTC_MEM_SENSORS + BLOCKS(sent) + BLOCKS(last) + BLOCKS(total) <= RTC_MEM_POWER) ? 1 : -1];
 
-// Get size of one record (containing one sample round for all sensors)
+// Get size of a record
 uint8_t ICACHE_FLASH_ATTR
 sensors_record_size (void)
 {
-	return sizeof(records[0]);
+	return sizeof(record);
+}
+
+// Get the consolidated record
+void * ICACHE_FLASH_ATTR
+sensors_record_data (void)
+{
+	return record;
+}
+
+// Get size of the statistics since the last upload
+uint8_t ICACHE_FLASH_ATTR
+sensors_stats_size (void)
+{
+	return sizeof(total);
 }
 
-// Get a record
+// Get the statistics since the last upload
 void * ICACHE_FLASH_ATTR
-sensors_record_data (const uint8_t n)
+sensors_stats_data (void)
 {
-	return records[n];
+	return total;
 }
 
-// Print sensor data in JSON format
-size_t ICACHE_FLASH_ATTR
-sensors_json (char *buf)
+// Get size of the last readings table
+uint8_t ICACHE_FLASH_ATTR
+sensors_last_size (void)
+{
+	return sizeof(last);
+}
+
+// Get the last readings table
+void * ICACHE_FLASH_ATTR
+sensors_last_data (void)
+{
+	return last;
+}
+
+// Get size of the last sent record
+uint8_t ICACHE_FLASH_ATTR
+sensors_sent_size (void)
+{
+	return sizeof(sent);
+}
+
+// Get the last sent record
+void * ICACHE_FLASH_ATTR
+sensors_sent_data (void)
+{
+	return sent;
+}
+
+// Remember the consolidated record as the last sent one
+void ICACHE_FLASH_ATTR
+sensors_sent_update (void)
 {
-	char *p = buf;
+	for (size_t sensor = 0; sensor < NSENSORS; sensor++) {
+		sent[sensor].celsius = record[sensor].celsius;
+		sent[sensor].status  = record[sensor].status;
+	}
+}
+
+// Check if any sensor changed status, or moved by more than the threshold,
+// since the last sent record
+bool ICACHE_FLASH_ATTR
+sensors_changed (const int32_t threshold)
+{
+	for (size_t sensor = 0; sensor < NSENSORS; sensor++) {
+		const struct sample *cur  = &record[sensor];
+		const struct sent *prev   = &sent[sensor];
+		const int32_t delta = cur->celsius - prev->celsius;
+
+		if (cur->status != prev->status)
+			return true;
+
+		if (delta > threshold || delta < -threshold)
+			return true;
+	}
+
+	return false;
+}
+
+// Print a record in JSON format
+void ICACHE_FLASH_ATTR
+sensors_json (struct stream *s, const void *data)
+{
+	const struct sample *record = data;
 	bool first = true;
 
 	/* Create the following JSON structure:
@@ -67,29 +181,83 @@ sensors_json (char *buf)
 		  "sensor-id-0" : { "value" : "230000", "status" : "message" }
 		, "sensor-id-1" : { "value" : "230000", "status" : "message" }
 		}
+
+	   Sensors with more than one reading also get "min", "max" and
+	   "spread" (the standard deviation) in the same units as the value,
+	   and "count". A carried reading gets its "age" in seconds.
 	*/
 
-	p += os_sprintf(p, "\"sensors\" : {\n");
+	stream_str(s, "\"sensors\" : {\n");
 
 	for (size_t sensor = 0; sensor < NSENSORS; sensor++) {
-		const uint8_t *a = sensors[sensor];
+		stream_str(s, (first) ? "  \"" : ", \"");
+		stream_str(s, sensor_names[sensor]);
+		stream_str(s, "\" : { \"value\": \"");
+		stream_int(s, record[sensor].celsius);
+		stream_str(s, "\", \"status\" : \"");
+		stream_str(s, ds18b20_status_string(record[sensor].status));
+
+		// Statistics, if there's more than one reading:
+		if (record[sensor].count > 1) {
+			stream_str(s, "\", \"min\" : \"");
+			stream_int(s, record[sensor].min * 625);
+			stream_str(s, "\", \"max\" : \"");
+			stream_int(s, record[sensor].max * 625);
+			stream_str(s, "\", \"spread\" : \"");
+			stream_uint(s, record[sensor].spread);
+			stream_str(s, "\", \"count\" : \"");
+			stream_uint(s, record[sensor].count);
+		}
 
-		p += os_sprintf(p,
-			"%s \"%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\" : ",
-			(first) ? " " : ",",
-			a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+		// Age of a carried reading:
+		if (record[sensor].age > 0) {
+			stream_str(s, "\", \"age\" : \"");
+			stream_uint(s, record[sensor].age);
+		}
 
-		p += os_sprintf(p,
-			"{ \"value\": \"%d\", \"status\" : \"%s\" }\n",
-			records[0][sensor].celsius,
-			ds18b20_status_string(records[0][sensor].status));
+		stream_str(s, "\" }\n");
 
 		first = false;
 	}
 
-	p += os_sprintf(p, "}");
+	stream_str(s, "}");
+}
+
+// Unpack a record's statistics, in 1/16 degrees
+void ICACHE_FLASH_ATTR
+sensors_unpack_stats (const void *data, int16_t *min, int16_t *max, uint16_t *spread, uint8_t *count)
+{
+	const struct sample *record = data;
+
+	for (size_t sensor = 0; sensor < NSENSORS; sensor++) {
+		min[sensor]    = record[sensor].min;
+		max[sensor]    = record[sensor].max;
+		spread[sensor] = record[sensor].spread;
+		count[sensor]  = record[sensor].count;
+	}
+}
+
+// Unpack a record into readings in 1/16 degrees, statuses and ages
+void ICACHE_FLASH_ATTR
+sensors_unpack (const void *data, int16_t *reading, uint8_t *status, uint32_t *age)
+{
+	const struct sample *record = data;
+
+	for (size_t sensor = 0; sensor < NSENSORS; sensor++) {
+		int32_t celsius = record[sensor].celsius;
 
-	return p - buf;
+		// Round to 1/16 degrees, the sensor's own resolution:
+		reading[sensor] = (celsius + ((celsius < 0) ? -312 : 312)) / 625;
+		status[sensor]  = record[sensor].status;
+		age[sensor]     = record[sensor].age;
+	}
+}
+
+// Get number of sensors
+uint8_t ICACHE_FLASH_ATTR
+sensors_count (void)
+{
+	return NSENSORS;
 }
 
 // Called when the temperature conversion is done
@@ -99,72 +267,220 @@ on_timer (void *data)
 	state_change(STATE_SENSORS_READOUT);
 }
 
-// Kickoff a timer to wait for the conversion to finish
+// Kickoff a timer to wait for the conversion to finish. The conversion time
+// halves with every bit of resolution less:
 static void ICACHE_FLASH_ATTR
-timer_kickoff (void)
+timer_kickoff (const uint8_t bits)
 {
 	static os_timer_t timer;
 
 	os_timer_disarm(&timer);
 	os_timer_setfn(&timer, (os_timer_func_t *) on_timer, NULL);
-	os_timer_arm(&timer, 800, 0);
+	os_timer_arm(&timer, 800 >> (DS18B20_RESOLUTION_MAX - bits), 0);
+}
+
+// Get mean of statistics in 1/256 units
+static inline int32_t
+stats_mean (const struct stats *st)
+{
+	return ((int64_t) st->sum << 8) / st->count;
+}
+
+// Add a sum of squares to the statistics, saturating
+static inline void
+stats_add_m2 (struct stats *st, const int64_t m2)
+{
+	st->m2 = (st->m2 + m2 > UINT32_MAX) ? UINT32_MAX : st->m2 + m2;
+}
+
+// Add a status to the statistics. Higher statuses are "more alive":
+static inline void
+stats_status (struct stats *st, const enum ds18b20_status status)
+{
+	if (status > st->status)
+		st->status = status;
+}
+
+// Add a reading to the statistics
+static void ICACHE_FLASH_ATTR
+stats_add (struct stats *st, const int16_t reading)
+{
+	const int32_t x = (int32_t) reading << 8;
+	int32_t before = x;
+
+	if (st->count == UINT16_MAX)
+		return;
+
+	if (st->count == 0)
+		st->min = st->max = reading;
+	else
+		before = stats_mean(st);
+
+	if (reading < st->min)
+		st->min = reading;
+	if (reading > st->max)
+		st->max = reading;
+
+	st->sum += reading;
+	st->count++;
+
+	// Welford's update, with the means before and after this reading:
+	stats_add_m2(st, ((int64_t) (x - before) * (x - stats_mean(st))) >> 8);
 }
 
-// Consolidate multiple samples into one sample + one status
+// Merge statistics into others, with the parallel variant of Welford's
+// method
 static void ICACHE_FLASH_ATTR
-consolidate (struct sample samples[][NSENSORS], size_t nrounds, size_t sensor, struct sample *dest)
+stats_merge (struct stats *dst, const struct stats *src)
 {
-	int32_t sum   = 0;
-	uint8_t count = 0;
-	enum ds18b20_status max_status = DS18B20_UNPROBED;
+	stats_status(dst, src->status);
 
-	// Loop over all valid samples:
-	for (size_t round = 0; round < nrounds; round++) {
-		const struct sample *s = &samples[round][sensor];
+	if (src->count == 0)
+		return;
+
+	if (dst->count == 0 || dst->count + src->count > UINT16_MAX) {
+		if (dst->count == 0)
+			*dst = *src;
+		return;
+	}
 
-		// Higher statuses are "more alive":
-		if (s->status > max_status)
-			max_status = s->status;
+	const int64_t delta = stats_mean(src) - stats_mean(dst);
+	const uint32_t count = dst->count + src->count;
 
-		// Sum all valid measurements:
-		if (s->status == DS18B20_SUCCESS) {
-			sum += s->celsius;
-			count++;
+	stats_add_m2(dst, src->m2 + ((delta * delta >> 8) * dst->count * src->count) / count);
+
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+
+	dst->sum  += src->sum;
+	dst->count = count;
+}
+
+// Get integer square root
+static uint32_t ICACHE_FLASH_ATTR
+isqrt (uint64_t val)
+{
+	uint64_t root = 0, bit = 1ULL << 62;
+
+	while (bit > val)
+		bit >>= 2;
+
+	while (bit != 0) {
+		if (val >= root + bit) {
+			val  -= root + bit;
+			root  = (root >> 1) + bit;
 		}
+		else
+			root >>= 1;
+		bit >>= 2;
 	}
 
-	// Save average temperature and status:
-	dest->celsius = (count > 0) ? sum / count : 0;
-	dest->status  = max_status;
+	return root;
 }
 
-// Consolidate multiple records into one record per sensor
+// Turn statistics into a sample
+static void ICACHE_FLASH_ATTR
+stats_sample (const struct stats *st, struct sample *dest)
+{
+	uint32_t spread;
+
+	dest->status = st->status;
+	dest->count  = (st->count > UINT8_MAX) ? UINT8_MAX : st->count;
+	dest->age    = 0;
+
+	if (st->count == 0) {
+		dest->celsius = 0;
+		dest->min     = 0;
+		dest->max     = 0;
+		dest->spread  = 0;
+		return;
+	}
+
+	// Mean, rounded, and sample standard deviation. The variance is in
+	// 1/256 units, scale it up so that the root is in 1/256 units too:
+	dest->celsius = ((int64_t) st->sum * 625 * 2 / st->count + ((st->sum < 0) ? -1 : 1)) / 2;
+	dest->min     = st->min;
+	dest->max     = st->max;
+
+	spread = (st->count > 1) ? isqrt((uint64_t) (st->m2 / (st->count - 1)) << 8) * 625 / 256 : 0;
+	dest->spread = (spread > UINT16_MAX) ? UINT16_MAX : spread;
+}
+
+// Consolidate the wakeups since the last upload into the record
 void ICACHE_FLASH_ATTR
 sensors_consolidate_records (void)
 {
-	// Save average temperature and status into record #0:
-	for (size_t sensor = 0; sensor < NSENSORS; sensor++)
-		consolidate(records, SENSORS_RECORDS_MAX, sensor, &records[0][sensor]);
+	for (size_t sensor = 0; sensor < NSENSORS; sensor++) {
+		const uint32_t age = record[sensor].age;
+
+		// A sensor that wasn't read at all keeps the carried reading
+		// from the last wakeup:
+		if (total[sensor].count > 0 || age == 0)
+			stats_sample(&total[sensor], &record[sensor]);
+		else
+			record[sensor].age = age;
+	}
+
+	// Start over:
+	os_memset(total, 0, sizeof(total));
 }
 
-// Consolidate all sensors into destination record
+// Consolidate the readings of this wakeup into the record, and merge them
+// into the statistics since the last upload
 void ICACHE_FLASH_ATTR
-sensors_consolidate_samples (const size_t record)
+sensors_consolidate_samples (void)
 {
-	// Save average temperature and status into current record:
+	for (size_t sensor = 0; sensor < NSENSORS; sensor++) {
+		struct sample *dest = &record[sensor];
+
+		// Carry the last reading of a sensor that wasn't read:
+		if (!due[sensor]) {
+			dest->celsius = last[sensor].celsius;
+			dest->status  = DS18B20_SUCCESS;
+			dest->age     = now - last[sensor].clock;
+			dest->min     = dest->max = last[sensor].celsius / 625;
+			dest->spread  = 0;
+			dest->count   = 0;
+			continue;
+		}
+
+		stats_sample(&wake[sensor], dest);
+		stats_merge(&total[sensor], &wake[sensor]);
+
+		// Remember a successful reading:
+		if (wake[sensor].count > 0) {
+			last[sensor].celsius = dest->celsius;
+			last[sensor].clock   = now;
+			last[sensor].valid   = true;
+		}
+	}
+}
+
+// Decide which sensors to read at this wakeup. A sensor is read when its
+// last reading is at least its sampling period old, or when it has none:
+void ICACHE_FLASH_ATTR
+sensors_plan (const uint32_t clock)
+{
+	now = clock;
+
 	for (size_t sensor = 0; sensor < NSENSORS; sensor++)
-		consolidate(samples, SENSORS_ROUNDS_MAX, sensor, &records[record][sensor]);
+		due[sensor] = !last[sensor].valid
+			|| clock - last[sensor].clock >= sensor_periods[sensor];
+
+	os_memset(wake, 0, sizeof(wake));
 }
 
 // Check if sensor has at least one valid sample
 static inline bool
 sensor_has_sample (const size_t sensor)
 {
-	for (size_t round = 0; round < SENSORS_ROUNDS_MAX; round++)
-		if (samples[round][sensor].status == DS18B20_SUCCESS)
-			return true;
+	// Sensors that aren't read this time don't count:
+	if (!due[sensor])
+		return true;
 
-	return false;
+	return wake[sensor].count > 0;
 }
 
 // Check if all sensors have at least one valid sample
@@ -182,12 +498,27 @@ sensors_all_valid (void)
 void ICACHE_FLASH_ATTR
 sensors_request (const size_t round)
 {
-	// Kick off measurements:
-	for (size_t sensor = 0; sensor < NSENSORS; sensor++)
-		samples[round][sensor].status = ds18b20_request(sensors[sensor]);
+	const uint8_t bits = power_resolution();
+	enum ds18b20_status status;
+
+	// Kick off measurements, at lower resolution if power is low. Sensors
+	// lose their resolution setting when they are depowered:
+	for (size_t sensor = 0; sensor < NSENSORS; sensor++) {
+		if (!due[sensor])
+			continue;
+
+		if (bits < DS18B20_RESOLUTION_MAX)
+			ds18b20_resolution(sensors[sensor], bits);
+
+		// A request that went through says nothing about the reading,
+		// only a failed one counts:
+		status = ds18b20_request(sensors[sensor]);
+		if (status != DS18B20_SUCCESS)
+			stats_status(&wake[sensor], status);
+	}
 
 	// Set wait timer:
-	timer_kickoff();
+	timer_kickoff(bits);
 }
 
 // Get actual sensor reading, store into sensor table
@@ -195,7 +526,17 @@ void ICACHE_FLASH_ATTR
 sensors_readout (const size_t round)
 {
 	for (size_t sensor = 0; sensor < NSENSORS; sensor++) {
-		struct sample *sample = &samples[round][sensor];
-		sample->status = ds18b20_result(sensors[sensor], &sample->celsius);
+		enum ds18b20_status status;
+		int32_t celsius;
+
+		if (!due[sensor])
+			continue;
+
+		// Readings come in 1/16 degree steps, so keep them that way:
+		status = ds18b20_result(sensors[sensor], &celsius);
+		stats_status(&wake[sensor], status);
+
+		if (status == DS18B20_SUCCESS)
+			stats_add(&wake[sensor], celsius / 625);
 	}
 }
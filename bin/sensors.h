@@ -1,11 +1,25 @@
 #define SENSORS_RECORDS_MAX	1
 #define SENSORS_ROUNDS_MAX	3
 
+struct stream;
+
+void sensors_plan (const uint32_t clock);
 void sensors_request (const size_t round);
 void sensors_readout (const size_t round);
-void sensors_consolidate_samples (const size_t record);
+void sensors_consolidate_samples (void);
 void sensors_consolidate_records (void);
 bool sensors_all_valid (void);
-size_t sensors_json (char *buf);
+void sensors_json (struct stream *s, const void *record);
+void sensors_unpack (const void *record, int16_t *reading, uint8_t *status, uint32_t *age);
+void sensors_unpack_stats (const void *record, int16_t *min, int16_t *max, uint16_t *spread, uint8_t *count);
+uint8_t sensors_count (void);
 uint8_t sensors_record_size (void);
-void *sensors_record_data (const uint8_t n);
+void *sensors_record_data (void);
+uint8_t sensors_stats_size (void);
+void *sensors_stats_data (void);
+uint8_t sensors_last_size (void);
+void *sensors_last_data (void);
+uint8_t sensors_sent_size (void);
+void *sensors_sent_data (void);
+void sensors_sent_update (void);
+bool sensors_changed (const int32_t threshold);
@@ -1,13 +1,145 @@
 #include <osapi.h>
 #include <user_interface.h>
 
+#include "log.h"
 #include "missing.h"
 #include "state.h"
+#include "trace.h"
 
-// Post a state message to the user task
+// The pending states are tracked in a bitmask, fail to compile if they
+// don't fit:
+typedef char state_num_check[(STATE_NUM <= 32) ? 1 : -1];
+
+// Handler table, indexed by state:
+static const struct state_handler *handlers;
+
+// Pending events, oldest first, and a bitmask of the states among them:
+static enum state queue[STATE_QUEUE_SIZE];
+static uint8_t head, count;
+static uint32_t pending;
+
+// Whether a message to the user task is outstanding. Only one is needed,
+// because the task dispatches one event and posts itself again while there
+// are more:
+static bool is_posted = false;
+
+// The state last dispatched, and its timeout timer:
+static enum state current = STATE_NUM;
+static os_timer_t timer;
+
+// Post a message to the user task, if none is outstanding
+static void ICACHE_FLASH_ATTR
+post (void)
+{
+	if (is_posted)
+		return;
+
+	if (system_os_post(USER_TASK_PRIO_0, 0, 0))
+		is_posted = true;
+	else
+		log_error("state: couldn't post to task!\n");
+}
+
+// Called when a state took too long
+static void ICACHE_FLASH_ATTR
+on_timeout (void *data)
+{
+	log_error("state: timeout in state %u\n", current);
+	state_change(handlers[current].timeout);
+}
+
+// Switch the CPU clock for a state
+static void ICACHE_FLASH_ATTR
+set_clock (enum state state)
+{
+	const uint8_t mhz = (handlers[state].cpu_mhz > 0)
+		? handlers[state].cpu_mhz
+		: STATE_CPU_MHZ;
+
+	if (system_get_cpu_freq() == mhz)
+		return;
+
+	if (system_update_cpu_freq(mhz))
+		log_debug("state: CPU at %u MHz\n", mhz);
+	else
+		log_error("state: couldn't set CPU to %u MHz!\n", mhz);
+}
+
+// Dispatch the oldest pending event
+static void ICACHE_FLASH_ATTR
+on_event (os_event_t *event)
+{
+	enum state state;
+
+	is_posted = false;
+
+	if (count == 0)
+		return;
+
+	state = queue[head];
+	head = (head + 1) % STATE_QUEUE_SIZE;
+	count--;
+	pending &= ~(1UL << state);
+
+	trace_add(state | TRACE_ENTER, count);
+
+	// Leave the current state:
+	os_timer_disarm(&timer);
+	if (current != STATE_NUM && handlers[current].exit != NULL)
+		handlers[current].exit();
+
+	// Enter the new state:
+	current = state;
+	set_clock(state);
+	if (handlers[state].timeout_ms > 0)
+		os_timer_arm(&timer, handlers[state].timeout_ms, 0);
+
+	if (handlers[state].enter != NULL)
+		handlers[state].enter();
+	else
+		log_error("state: unhandled state %u\n", state);
+
+	// Keep going while there are events left:
+	if (count > 0)
+		post();
+}
+
+// Post a state event. Events that are already pending are coalesced
 void ICACHE_FLASH_ATTR
 state_change (enum state state)
 {
-	if (!system_os_post(USER_TASK_PRIO_0, state, 0))
-		os_printf("state_change() failed!\n");
+	if (state >= STATE_NUM) {
+		log_error("state: invalid state %u\n", state);
+		return;
+	}
+
+	trace_add(state, count);
+
+	if (pending & (1UL << state))
+		return;
+
+	if (count == STATE_QUEUE_SIZE) {
+		log_error("state: queue overflow, dropped state %u!\n", state);
+		return;
+	}
+
+	queue[(head + count) % STATE_QUEUE_SIZE] = state;
+	count++;
+	pending |= 1UL << state;
+
+	post();
+}
+
+// Register the handler table and the user task
+void ICACHE_FLASH_ATTR
+state_init (const struct state_handler *table)
+{
+	static os_event_t events[1];
+
+	handlers = table;
+
+	os_timer_disarm(&timer);
+	os_timer_setfn(&timer, (os_timer_func_t *) on_timeout, NULL);
+
+	system_os_task(on_event, USER_TASK_PRIO_0, events, 1);
 }
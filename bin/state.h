@@ -14,6 +14,32 @@ enum state {
 	STATE_NET_CONNECT_DONE,
 	STATE_NET_DATA_SENT,
 	STATE_NET_DISCONNECT_DONE,
+	STATE_NUM,
 };
 
+// Number of events that can be pending at once. Posting an event that is
+// already pending doesn't take up another slot:
+#define STATE_QUEUE_SIZE	8
+
+// CPU clock in MHz. States run at the base clock unless they ask for more.
+// The 1-Wire bit timings were tuned at the base clock, so states that talk
+// to the bus must stay at it. Waiting for timers or the radio gains nothing
+// from a faster clock:
+#define STATE_CPU_MHZ		80
+#define STATE_CPU_BOOST_MHZ	160
+
+// What to do in a state. The entry hook runs when the state's event is
+// dispatched, the exit hook when the next event is. If the timeout is
+// nonzero, and no other event is dispatched in time, the timeout state
+// is posted. The state runs at the given CPU clock, or at the base clock
+// if zero:
+struct state_handler {
+	void		(*enter) (void);
+	void		(*exit) (void);
+	uint32_t	timeout_ms;
+	enum state	timeout;
+	uint8_t		cpu_mhz;
+};
+
+void state_init (const struct state_handler *table);
 void state_change (enum state);
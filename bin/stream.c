@@ -0,0 +1,80 @@
+#include <os_type.h>
+#include <osapi.h>
+
+#include "missing.h"
+#include "stream.h"
+
+// Start a stream with a window at the given offset
+void ICACHE_FLASH_ATTR
+stream_init (struct stream *s, char *buf, const size_t size, const size_t skip)
+{
+	s->buf   = buf;
+	s->size  = size;
+	s->skip  = skip;
+	s->len   = 0;
+	s->total = 0;
+}
+
+// Add data to the stream, store the part that falls in the window
+void ICACHE_FLASH_ATTR
+stream_put (struct stream *s, const void *data, size_t len)
+{
+	const char *c = data;
+	const size_t start = s->total;
+
+	s->total += len;
+
+	// Nothing to store if before the window or if the window is full:
+	if (s->total <= s->skip || s->len == s->size)
+		return;
+
+	// Cut off the part before the window:
+	if (start < s->skip) {
+		c   += s->skip - start;
+		len -= s->skip - start;
+	}
+
+	// Cut off the part after the window:
+	if (len > s->size - s->len)
+		len = s->size - s->len;
+
+	os_memcpy(s->buf + s->len, c, len);
+	s->len += len;
+}
+
+// Add a string to the stream
+void ICACHE_FLASH_ATTR
+stream_str (struct stream *s, const char *str)
+{
+	stream_put(s, str, os_strlen(str));
+}
+
+// Add an unsigned decimal number to the stream
+void ICACHE_FLASH_ATTR
+stream_uint (struct stream *s, uint32_t val)
+{
+	char buf[10];
+	char *p = buf + sizeof(buf);
+
+	// Generate digits from least to most significant:
+	do {
+		*--p = '0' + val % 10;
+		val /= 10;
+	} while (val > 0);
+
+	stream_put(s, p, buf + sizeof(buf) - p);
+}
+
+// Add a signed decimal number to the stream
+void ICACHE_FLASH_ATTR
+stream_int (struct stream *s, const int32_t val)
+{
+	if (val >= 0) {
+		stream_uint(s, val);
+		return;
+	}
+
+	// Negate as unsigned, which also works for the most negative value:
+	stream_put(s, "-", 1);
+	stream_uint(s, -(uint32_t) val);
+}
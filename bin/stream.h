@@ -0,0 +1,17 @@
+// A stream renders a message into a window of a buffer. Everything before
+// the window is skipped and everything after it is only counted, so that a
+// message of any size can be produced in fixed-size chunks by rendering it
+// once per chunk, and its total length found without storing it at all.
+struct stream {
+	char	*buf;		// Window buffer
+	size_t	 size;		// Window size
+	size_t	 skip;		// Offset of window in message
+	size_t	 len;		// Bytes stored in window
+	size_t	 total;		// Bytes in message so far
+};
+
+void stream_init (struct stream *s, char *buf, const size_t size, const size_t skip);
+void stream_put (struct stream *s, const void *data, size_t len);
+void stream_str (struct stream *s, const char *str);
+void stream_uint (struct stream *s, uint32_t val);
+void stream_int (struct stream *s, const int32_t val);
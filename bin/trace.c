@@ -0,0 +1,188 @@
+#include <os_type.h>
+#include <osapi.h>
+#include <user_interface.h>
+#include <spi_flash.h>
+
+#include "crc.h"
+#include "flash_log.h"
+#include "log.h"
+#include "missing.h"
+#include "rtc_mem.h"
+#include "trace.h"
+
+// Every state change is traced in a small ring in RTC memory. After a
+// watchdog or exception reset, the ring shows which states the crashed cycle
+// went through, and when. The ring is reused right away, so the trace of the
+// crashed cycle is copied to a flash sector of its own, where it stays until
+// the server has it, over wakeups that don't upload and loss of power. Its
+// pending marker is then cleared, which needs no erase.
+
+#if TRACE_SECTOR < FLASH_LOG_SECTOR + FLASH_LOG_SECTORS
+#error "The trace sector overlaps the flash log"
+#endif
+
+// Ring header in RTC memory, followed by the entries, one block each:
+struct header {
+	uint16_t	sig;
+	uint8_t		head;		// Next entry to write
+	uint8_t		count;		// Number of valid entries
+};
+
+#define TRACE_SIG	0x7ACE
+
+// Trace of the crashed cycle as stored in flash:
+struct snapshot {
+	uint32_t	pending;	// Cleared once uploaded
+	uint16_t	sig;
+	uint16_t	crc;		// CRC over the trace
+	struct trace	trace;
+};
+
+#define SNAPSHOT_PENDING	0xFFFFFFFF
+
+// Round upwards to next 4 bytes:
+#define ROUNDUP(x)	(((x) + 3) & ~0x03)
+
+// Snapshot buffer, aligned as the flash functions require:
+static uint32_t buf[ROUNDUP(sizeof(struct snapshot)) / 4];
+static struct snapshot *snapshot = (struct snapshot *) buf;
+
+static struct header header;
+static bool is_ready = false;
+
+// Trace of the crashed cycle, if any:
+static struct trace crash;
+static bool has_crash = false;
+
+// Copy the ring of the crashed cycle to RAM
+static void ICACHE_FLASH_ATTR
+crash_load (const struct rst_info *reset)
+{
+	struct header old;
+
+	if (!rtc_mem_read(RTC_MEM_TRACE, &old, sizeof(old)) || old.sig != TRACE_SIG)
+		return;
+
+	if (old.count == 0 || old.count > TRACE_ENTRIES || old.head >= TRACE_ENTRIES)
+		return;
+
+	crash.reason   = reset->reason;
+	crash.exccause = reset->exccause;
+	crash.epc      = reset->epc1;
+	crash.count    = old.count;
+
+	// Oldest entry first:
+	for (uint8_t i = 0; i < old.count; i++) {
+		const uint8_t n = (old.head + TRACE_ENTRIES - old.count + i) % TRACE_ENTRIES;
+
+		if (!rtc_mem_read(RTC_MEM_TRACE + 1 + n, &crash.entry[i], sizeof(crash.entry[i])))
+			return;
+	}
+
+	has_crash = true;
+	log_error("Trace: crash in state %u\n", crash.entry[crash.count - 1].state & ~TRACE_ENTER);
+}
+
+// Keep the trace of the crashed cycle in flash until it is uploaded. A
+// newer crash replaces an older one
+static void ICACHE_FLASH_ATTR
+snapshot_save (void)
+{
+	os_memset(buf, 0, sizeof(buf));
+	snapshot->pending = SNAPSHOT_PENDING;
+	snapshot->sig     = TRACE_SIG;
+	snapshot->trace   = crash;
+	snapshot->crc     = crc16(&snapshot->trace, sizeof(snapshot->trace), 0xFFFF);
+
+	if (spi_flash_erase_sector(TRACE_SECTOR) != SPI_FLASH_RESULT_OK
+	 || spi_flash_write(TRACE_SECTOR * SPI_FLASH_SEC_SIZE, buf, sizeof(buf)) != SPI_FLASH_RESULT_OK)
+		log_error("%s: write failed!\n", __FUNCTION__);
+}
+
+// Load the trace of an earlier crash that wasn't uploaded yet
+static void ICACHE_FLASH_ATTR
+snapshot_load (void)
+{
+	if (spi_flash_read(TRACE_SECTOR * SPI_FLASH_SEC_SIZE, buf, sizeof(buf)) != SPI_FLASH_RESULT_OK)
+		return;
+
+	if (snapshot->pending != SNAPSHOT_PENDING || snapshot->sig != TRACE_SIG
+	 || snapshot->crc != crc16(&snapshot->trace, sizeof(snapshot->trace), 0xFFFF)
+	 || snapshot->trace.count == 0 || snapshot->trace.count > TRACE_ENTRIES)
+		return;
+
+	crash     = snapshot->trace;
+	has_crash = true;
+}
+
+// Keep the trace of the last cycle if it crashed, and start a new one
+void ICACHE_FLASH_ATTR
+trace_init (const struct rst_info *reset)
+{
+	switch (reset->reason)
+	{
+	case REASON_WDT_RST:
+	case REASON_EXCEPTION_RST:
+	case REASON_SOFT_WDT_RST:
+		crash_load(reset);
+		if (has_crash)
+			snapshot_save();
+		break;
+
+	default:
+		break;
+	}
+
+	if (!has_crash)
+		snapshot_load();
+
+	header.sig   = TRACE_SIG;
+	header.head  = 0;
+	header.count = 0;
+	is_ready = rtc_mem_write(RTC_MEM_TRACE, &header, sizeof(header));
+}
+
+// Add an entry to the ring
+void ICACHE_FLASH_ATTR
+trace_add (const uint8_t state, const uint8_t arg)
+{
+	const struct trace_entry entry = {
+		.time  = system_get_time() / 10000,
+		.state = state,
+		.arg   = arg,
+	};
+
+	if (!is_ready)
+		return;
+
+	system_rtc_mem_write(RTC_MEM_TRACE + 1 + header.head, &entry, sizeof(entry));
+
+	header.head = (header.head + 1) % TRACE_ENTRIES;
+	if (header.count < TRACE_ENTRIES)
+		header.count++;
+
+	system_rtc_mem_write(RTC_MEM_TRACE, &header, sizeof(header));
+}
+
+// Get the trace of the crashed cycle, or NULL if the last reset wasn't a
+// crash, or the trace has been uploaded
+const struct trace * ICACHE_FLASH_ATTR
+trace_crash (void)
+{
+	return has_crash ? &crash : NULL;
+}
+
+// Forget the trace of the crashed cycle, once the server has it
+void ICACHE_FLASH_ATTR
+trace_crash_clear (void)
+{
+	static uint32_t cleared = 0;
+
+	if (!has_crash)
+		return;
+
+	if (spi_flash_write(TRACE_SECTOR * SPI_FLASH_SEC_SIZE, &cleared, sizeof(cleared)) != SPI_FLASH_RESULT_OK)
+		log_error("%s: write failed!\n", __FUNCTION__);
+
+	has_crash = false;
+}
@@ -0,0 +1,33 @@
+// Number of entries in the trace ring. The ring lives in RTC memory, so that
+// it survives a watchdog or exception reset:
+#define TRACE_ENTRIES		12
+
+// Flash sector that keeps the trace of a crashed cycle until it is uploaded,
+// just past the flash log:
+#define TRACE_SECTOR		0x140
+
+// Flag in an entry's state for a state being entered, as opposed to posted:
+#define TRACE_ENTER		0x80
+
+// One trace entry:
+struct trace_entry {
+	uint16_t	time;		// Time since boot in 1/100 seconds
+	uint8_t		state;		// State, with TRACE_ENTER if dispatched
+	uint8_t		arg;		// Number of events pending
+};
+
+// The trace of the cycle that crashed, oldest entry first:
+struct trace {
+	uint32_t	reason;		// Reset reason
+	uint32_t	exccause;	// Exception cause
+	uint32_t	epc;		// Exception program counter
+	uint8_t		count;
+	struct trace_entry entry[TRACE_ENTRIES];
+};
+
+struct rst_info;
+
+void trace_init (const struct rst_info *reset);
+void trace_add (const uint8_t state, const uint8_t arg);
+const struct trace *trace_crash (void);
+void trace_crash_clear (void);
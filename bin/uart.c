@@ -1,25 +1,50 @@
 #include <ets_sys.h>
 #include <osapi.h>
 
+#include "missing.h"
+#include "uart.h"
+
 // Function prototypes missing in SDK:
 extern void uart_div_modify (uint8_t uart, uint32_t freq);
+extern void ets_isr_attach (int intr, void *handler, void *arg);
 extern void ets_isr_mask (uint32_t intr);
+extern void ets_isr_unmask (uint32_t intr);
 extern void ets_install_putc1 (void *handler);
 
 // Register definitions taken from SDK:
 #define REG_UART_BASE(n)	(0x60000000 + (n) * 0xF00)
 #define UART_FIFO(n)		(REG_UART_BASE(n) + 0x000)
+#define UART_INT_ST(n)		(REG_UART_BASE(n) + 0x008)
+#define UART_INT_ENA(n)		(REG_UART_BASE(n) + 0x00C)
 #define UART_INT_CLR(n)		(REG_UART_BASE(n) + 0x010)
 #define UART_STATUS(n)		(REG_UART_BASE(n) + 0x01C)
 #define UART_CONF0(n)		(REG_UART_BASE(n) + 0x020)
+#define UART_CONF1(n)		(REG_UART_BASE(n) + 0x024)
 #define UART_TXFIFO_CNT		0x000000FF
 #define UART_TXFIFO_CNT_S	16
 #define UART_BIT_NUM_S		2
 #define UART_TXFIFO_RST		((uint32_t)1 << 18)
+#define UART_TXFIFO_EMPTY_INT	((uint32_t)1 << 1)
+#define UART_TXFIFO_EMPTY_THRHD	0x0000007F
+#define UART_TXFIFO_EMPTY_THRHD_S 8
 
 #define UART0			0
 #define BAUDRATE		115200
 
+// Size of the hardware Tx FIFO, and the fill level below which the UART
+// asks for more:
+#define TX_FIFO_SIZE		128
+#define TX_FIFO_THRESHOLD	32
+
+// Transmit ring buffer. The head is only moved by the writer, the tail only
+// by the interrupt handler, so they need no locking:
+static uint8_t ring[UART_TX_BUFSIZE];
+static volatile uint16_t head = 0;
+static volatile uint16_t tail = 0;
+
+// Number of bytes dropped because the ring buffer was full:
+static uint32_t dropped = 0;
+
 // Number of bytes remaining in Tx FIFO
 static inline uint8_t
 tx_fifo_count (void)
@@ -27,17 +52,43 @@ tx_fifo_count (void)
 	return (READ_PERI_REG(UART_STATUS(UART0)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT;
 }
 
-// Transmit a single raw character
+// Interrupt handler, runs from IRAM: move bytes from the ring buffer to the
+// Tx FIFO, and stop asking for more when the ring buffer is empty
+static void
+on_interrupt (void *arg)
+{
+	if (READ_PERI_REG(UART_INT_ST(UART0)) & UART_TXFIFO_EMPTY_INT) {
+		while (tail != head && tx_fifo_count() < TX_FIFO_SIZE - 1) {
+			WRITE_PERI_REG(UART_FIFO(UART0), ring[tail]);
+			tail = (tail + 1) % UART_TX_BUFSIZE;
+		}
+
+		if (tail == head)
+			CLEAR_PERI_REG_MASK(UART_INT_ENA(UART0), UART_TXFIFO_EMPTY_INT);
+	}
+
+	WRITE_PERI_REG(UART_INT_CLR(UART0), 0xFFFF);
+}
+
+// Queue a single raw character
 static void ICACHE_FLASH_ATTR
 uart_putc_raw (const uint8_t c)
 {
-	while (tx_fifo_count() >= 126)
-		continue;
+	const uint16_t next = (head + 1) % UART_TX_BUFSIZE;
 
-	WRITE_PERI_REG(UART_FIFO(UART0), c);
+	if (next == tail) {
+		dropped++;
+		return;
+	}
+
+	ring[head] = c;
+	head = next;
+
+	// Have the interrupt handler pick it up:
+	SET_PERI_REG_MASK(UART_INT_ENA(UART0), UART_TXFIFO_EMPTY_INT);
 }
 
-// Transmit a single cooked character
+// Queue a single cooked character
 static void ICACHE_FLASH_ATTR
 uart_putc (const uint8_t c)
 {
@@ -47,14 +98,29 @@ uart_putc (const uint8_t c)
 	uart_putc_raw(c);
 }
 
+// Wait until all queued output has left the UART, for instance before deep
+// sleep, which would cut it off
+void ICACHE_FLASH_ATTR
+uart_flush (void)
+{
+	if (dropped > 0) {
+		os_printf("UART: dropped %u bytes\n", dropped);
+		dropped = 0;
+	}
+
+	while (tail != head || tx_fifo_count() > 0)
+		continue;
+}
+
 // Initialize UART0 as Tx-only, 115200 bps, 8N1
 void ICACHE_FLASH_ATTR
 uart_init (void)
 {
-	// Disable UART interrupts (transmit only):
+	// Disable UART interrupts while we set things up:
 	ETS_UART_INTR_DISABLE();
 
-	// Clear pending interrupts:
+	// Clear pending interrupts, and enable none for now:
+	WRITE_PERI_REG(UART_INT_ENA(UART0), 0);
 	WRITE_PERI_REG(UART_INT_CLR(UART0), 0xFFFF);
 
 	// Enable Tx pin:
@@ -67,10 +133,18 @@ uart_init (void)
 	// Configure 8N1 mode:
 	WRITE_PERI_REG(UART_CONF0(UART0), 0x03 << UART_BIT_NUM_S);
 
+	// Ask for more data when the Tx FIFO runs low:
+	WRITE_PERI_REG(UART_CONF1(UART0),
+		(TX_FIFO_THRESHOLD & UART_TXFIFO_EMPTY_THRHD) << UART_TXFIFO_EMPTY_THRHD_S);
+
 	// Reset Tx FIFO:
 	SET_PERI_REG_MASK(UART_CONF0(UART0), UART_TXFIFO_RST);
 	CLEAR_PERI_REG_MASK(UART_CONF0(UART0), UART_TXFIFO_RST);
 
+	// Install interrupt handler:
+	ETS_UART_INTR_ATTACH(on_interrupt, NULL);
+	ETS_UART_INTR_ENABLE();
+
 	// Redirect system output to uart:
 	os_install_putc1(uart_putc);
 }
@@ -1 +1,6 @@
+// Size of the transmit ring buffer. Output that doesn't fit is dropped,
+// rather than waiting for the UART to catch up:
+#define UART_TX_BUFSIZE		1024
+
 void uart_init (void);
+void uart_flush (void);
@@ -1,6 +1,7 @@
 #include <osapi.h>
 #include <user_interface.h>
 
+#include "log.h"
 #include "missing.h"
 #include "secrets.h"
 #include "state.h"
@@ -15,8 +16,8 @@ on_connect_event (System_Event_t *event)
 	switch (event->event)
 	{
 	case EVENT_STAMODE_CONNECTED:
-		os_printf("Wifi: connected\n");
-		os_printf("RSSI: %d\n", wifi_station_get_rssi());
+		log_info("Wifi: connected\n");
+		log_debug("RSSI: %d\n", wifi_station_get_rssi());
 		is_connected = true;
 		break;
 
@@ -24,15 +25,15 @@ on_connect_event (System_Event_t *event)
 		switch (wifi_station_get_connect_status())
 		{
 		case STATION_WRONG_PASSWORD:
-			os_printf("Wifi connect: disconnected, wrong password\n");
+			log_error("Wifi connect: disconnected, wrong password\n");
 			break;
 
 		case STATION_NO_AP_FOUND:
-			os_printf("Wifi connect: disconnected, AP \"" SECRET_SSID "\" not found\n");
+			log_error("Wifi connect: disconnected, AP \"" SECRET_SSID "\" not found\n");
 			break;
 
 		default:
-			os_printf("Wifi connect: disconnected\n");
+			log_error("Wifi connect: disconnected\n");
 			break;
 		}
 		is_connected = false;
@@ -40,21 +41,21 @@ on_connect_event (System_Event_t *event)
 		break;
 
 	case EVENT_STAMODE_AUTHMODE_CHANGE:
-		os_printf("Wifi connect: auth mode change\n");
+		log_debug("Wifi connect: auth mode change\n");
 		break;
 
 	case EVENT_STAMODE_GOT_IP:
-		os_printf("Wifi connect: got IP\n");
+		log_info("Wifi connect: got IP\n");
 		state_change(STATE_WIFI_SETUP_DONE);
 		break;
 
 	case EVENT_STAMODE_DHCP_TIMEOUT:
-		os_printf("Wifi connect: DHCP timeout\n");
+		log_error("Wifi connect: DHCP timeout\n");
 		state_change(STATE_WIFI_SETUP_FAIL);
 		break;
 
 	default:
-		os_printf("Wifi connect: unhandled event 0x%x\n", event->event);
+		log_info("Wifi connect: unhandled event 0x%x\n", event->event);
 		break;
 	}
 }
@@ -66,10 +67,18 @@ set_opmode (const uint8_t opmode)
 	if (wifi_set_opmode_current(opmode))
 		return true;
 
-	os_printf("Wifi: couldn't set opmode 0x%x!\n", opmode);
+	log_error("Wifi: couldn't set opmode 0x%x!\n", opmode);
 	return false;
 }
 
+// Given a passphrase, the station derives the key from it with 4096 rounds
+// of PBKDF2-SHA1 at every wakeup, with the radio already on. Given the key
+// itself as 64 hex digits, it uses that. The key comes from tools/pmk, and
+// fills the password field without a terminator:
+#ifdef SECRET_PMK
+typedef char pmk_size_check[(sizeof(SECRET_PMK) == 65) ? 1 : -1];
+#endif
+
 // Configure wifi SSID and password
 static bool ICACHE_FLASH_ATTR
 configure (void)
@@ -77,13 +86,18 @@ configure (void)
 	// Don't check AP's MAC address:
 	struct station_config config = { .bssid_set = 0 };
 
-	os_memcpy(&config.ssid,     SECRET_SSID,     sizeof(SECRET_SSID));
+	os_memcpy(&config.ssid, SECRET_SSID, sizeof(SECRET_SSID));
+
+#ifdef SECRET_PMK
+	os_memcpy(&config.password, SECRET_PMK, sizeof(SECRET_PMK) - 1);
+#else
 	os_memcpy(&config.password, SECRET_PASSWORD, sizeof(SECRET_PASSWORD));
+#endif
 
 	if (wifi_station_set_config(&config))
 		return true;
 
-	os_printf("Wifi: couldn't set config!\n");
+	log_error("Wifi: couldn't set config!\n");
 	return false;
 }
 
@@ -94,7 +108,7 @@ connect (void)
 	if (wifi_station_connect())
 		return true;
 
-	os_printf("Wifi: couldn't connect!\n");
+	log_error("Wifi: couldn't connect!\n");
 	return false;
 }
 
@@ -123,18 +137,18 @@ static void ICACHE_FLASH_ATTR
 on_disconnect_event (System_Event_t *event)
 {
 	if (event->event != EVENT_STAMODE_DISCONNECTED) {
-		os_printf("Wifi disconnect: unhandled event 0x%x\n", event->event);
+		log_info("Wifi disconnect: unhandled event 0x%x\n", event->event);
 		return;
 	}
 
-	os_printf("Wifi disconnect: disconnected\n");
+	log_info("Wifi disconnect: disconnected\n");
 
 	// Stop RF engine, hopefully:
 	set_opmode(NULL_MODE);
 
 	// Set sleep mode:
 	if (!wifi_set_sleep_type(MODEM_SLEEP_T))
-		os_printf("Wifi: couldn't set modem sleep mode!\n");
+		log_error("Wifi: couldn't set modem sleep mode!\n");
 
 	// Signal state change:
 	state_change(STATE_WIFI_SHUTDOWN_DONE);
@@ -159,6 +173,6 @@ wifi_shutdown (void)
 	if (wifi_station_disconnect())
 		return true;
 
-	os_printf("Wifi: couldn't disconnect!\n");
+	log_error("Wifi: couldn't disconnect!\n");
 	return false;
 }
@@ -1,2 +1,7 @@
+// Time to wait for an IP address after connecting, and for the disconnect
+// event after shutting down, before giving up:
+#define WIFI_SETUP_TIMEOUT_MS		15000
+#define WIFI_SHUTDOWN_TIMEOUT_MS	2000
+
 bool wifi_connect (void);
 bool wifi_shutdown (void);
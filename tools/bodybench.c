@@ -0,0 +1,365 @@
+// Benchmark of the JSON body: the stream emitters that http.c and sensors.c
+// use, against the sprintf formatting that the body was made with before,
+// where every field went through sprintf into a scratch buffer, and the
+// sensor addresses were formatted anew for every upload. Runs the firmware's
+// own modules on a simulated chip (see chip.c) for a number of wakeups, each
+// in a process of its own, as fleet does. At the last wakeup, it checks that
+// both ways give the same body for a full batch of logged records, and
+// renders it a number of times each way. Both include sampling the upload,
+// as http_post_start() does. The host's sprintf isn't the ESP8266's ROM
+// printf, so this shows the relative cost, not the time on the chip:
+//
+//	bodybench [-n wakeups] [-b renders] [-e noise-%]
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <os_type.h>
+#include <user_interface.h>
+
+#include "flash_log.h"
+#include "chip.h"
+#include "ds18b20.h"
+#include "fourier.h"
+#include "http.h"
+#include "missing.h"
+#include "net.h"
+#include "onewire.h"
+#include "packed.h"
+#include "power.h"
+#include "rtc_mem.h"
+#include "schedule.h"
+#include "sensor_table.h"
+#include "sensors.h"
+#include "stream.h"
+#include "trace.h"
+#include "payload.h"
+
+// Largest message, and the sensor read rounds, as in main.c:
+#define MESSAGE_MAX		65536
+#define SENSORS_ROUNDS_MAX	3
+
+// Scratch buffer and formatting, as stream.c had them:
+#define STREAM_SCRATCH_SIZE	160
+
+static char stream_scratch[STREAM_SCRATCH_SIZE];
+
+#define stream_printf(s, ...) \
+	stream_put((s), stream_scratch, sprintf(stream_scratch, __VA_ARGS__))
+
+static struct chip *chip;
+static long renders = 10000;
+
+// Results of the renders, so that they aren't optimized out:
+static volatile size_t sink;
+
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Sample the upload, as http_post_start() does
+static void
+upload_sample (struct upload *upload, const uint32_t backlog, const uint32_t seq)
+{
+	upload->backlog   = backlog;
+	upload->seq       = seq;
+	upload->epoch     = flash_log_epoch();
+	upload->clock     = rtc_mem_clock();
+	upload->has_fit   = fourier_fit(&upload->fit, upload->clock);
+	upload->millivolt = (readvdd33() * 1000) / 1024;
+	upload->rssi      = wifi_station_get_rssi();
+	upload->adc       = system_adc_read();
+	upload->crash     = trace_crash();
+}
+
+// One record's sensors, the way sensors_json() used to
+static void
+old_sensors (struct stream *s, const struct record *r, const size_t nsensors)
+{
+	stream_printf(s, "\"sensors\" : {\n");
+
+	for (size_t sensor = 0; sensor < nsensors; sensor++) {
+		const uint8_t *a = sensors[sensor];
+
+		stream_printf(s,
+			"%s \"%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\" : ",
+			(sensor == 0) ? " " : ",",
+			a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+
+		stream_printf(s,
+			"{ \"value\": \"%d\", \"status\" : \"%s\"",
+			r->reading[sensor] * 625,
+			ds18b20_status_string(r->status[sensor]));
+
+		if (r->count[sensor] > 1)
+			stream_printf(s,
+				", \"min\" : \"%d\", \"max\" : \"%d\", \"spread\" : \"%u\", \"count\" : \"%u\"",
+				r->min[sensor] * 625, r->max[sensor] * 625, r->spread[sensor], r->count[sensor]);
+
+		if (r->carried[sensor] > 0)
+			stream_printf(s, ", \"age\" : \"%u\"", r->carried[sensor]);
+
+		stream_printf(s, " }\n");
+	}
+
+	stream_printf(s, "}");
+}
+
+// The body, the way body_create() used to
+static void
+old_body (struct stream *s, const struct payload *pl)
+{
+	const struct record *cur = &pl->record[pl->nrecords - 1];
+
+	stream_printf(s, "{ ");
+	old_sensors(s, cur, pl->nsensors);
+	stream_printf(s, "\n, \"seq\" : \"%u\"", cur->seq);
+	stream_printf(s, "\n, \"epoch\" : \"%u\"", pl->epoch);
+	stream_printf(s, "\n, \"chipid\" : \"%u\"", pl->chipid);
+	stream_printf(s, "\n, \"millivolt\" : \"%u\"", pl->millivolt);
+	stream_printf(s, "\n, \"rssi\" : \"%d\"", pl->rssi);
+	stream_printf(s, "\n, \"adc\" : \"%u\"", pl->adc);
+
+	if (pl->has_fit)
+		stream_printf(s, "\n, \"fourier\" : { \"depth\" : \"%u\", \"amplitude\" : \"%u\", \"peak_age\" : \"%u\", \"residual\" : \"%u\" }",
+			pl->fit.depth, pl->fit.amplitude, pl->fit.peak_age, pl->fit.residual);
+
+	if (pl->has_crash) {
+		stream_printf(s, "\n, \"crash\" : { \"reason\" : \"%u\", \"exccause\" : \"%u\", \"epc\" : \"%u\", \"trace\" : [",
+			pl->crash.reason, pl->crash.exccause, pl->crash.epc);
+
+		for (size_t i = 0; i < pl->crash.count; i++) {
+			const struct trace_entry *e = &pl->crash.entry[i];
+
+			stream_printf(s, "\n%s { \"ms\" : \"%u\", \"state\" : \"%u\", \"event\" : \"%s\", \"pending\" : \"%u\" }",
+				(i == 0) ? " " : ",", e->time * 10,
+				e->state & ~TRACE_ENTER,
+				(e->state & TRACE_ENTER) ? "enter" : "post", e->arg);
+		}
+		stream_printf(s, "\n] }");
+	}
+
+	if (pl->nrecords > 1) {
+		stream_printf(s, "\n, \"backlog\" : [");
+		for (size_t i = 0; i < pl->nrecords - 1; i++) {
+			stream_printf(s, "\n%s { \"seq\" : \"%u\", ", (i == 0) ? " " : ",", pl->record[i].seq);
+			if (pl->record[i].age != PACKED_UNDATED)
+				stream_printf(s, "\"age\" : \"%u\", ", pl->record[i].age);
+			old_sensors(s, &pl->record[i], pl->nsensors);
+			stream_printf(s, " }");
+		}
+		stream_printf(s, "\n]");
+	}
+
+	stream_printf(s, "\n}\n");
+}
+
+// Check that both ways give the same body, then time them. Return false if
+// they differ
+static bool
+bench (uint32_t backlog, const uint32_t seq)
+{
+	static uint8_t msg[MESSAGE_MAX], bin[MESSAGE_MAX];
+	static char old[MESSAGE_MAX];
+	static struct payload pl;
+	struct upload upload;
+	struct stream s;
+	uint8_t *buf, *body;
+	size_t len, total = 0;
+	double stream_time, printf_time;
+	const char *err;
+
+	// The body as http.c sends it:
+	backlog = http_post_start(backlog, seq);
+	while ((len = http_post_next(&buf)) > 0 && total + len <= sizeof(msg)) {
+		memcpy(msg + total, buf, len);
+		total += len;
+	}
+
+	for (body = msg; body + 4 <= msg + total; body++)
+		if (memcmp(body, "\r\n\r\n", 4) == 0)
+			break;
+
+	body  += 4;
+	total -= body - msg;
+
+	if (total == 0 || *body != '{') {
+		fprintf(stderr, "The firmware doesn't send a JSON body\n");
+		return false;
+	}
+
+	// The data to format it from:
+	upload_sample(&upload, backlog, seq);
+	stream_init(&s, (char *) bin, sizeof(bin), 0);
+	packed_create(&s, &upload);
+
+	if ((err = payload_decode(&pl, bin, s.total)) != NULL) {
+		fprintf(stderr, "%s\n", err);
+		return false;
+	}
+
+	stream_init(&s, old, sizeof(old), 0);
+	old_body(&s, &pl);
+
+	if (s.total != total || memcmp(old, body, total) != 0) {
+		fprintf(stderr, "The sprintf body differs from the firmware's\n");
+		return false;
+	}
+
+	// Render the body to find its length, as http_post_start() does:
+	stream_time = now();
+	for (long i = 0; i < renders; i++)
+		sink = http_post_start(backlog, seq);
+	stream_time = now() - stream_time;
+
+	printf_time = now();
+	for (long i = 0; i < renders; i++) {
+		upload_sample(&upload, backlog, seq);
+		stream_init(&s, NULL, 0, 0);
+		old_body(&s, &pl);
+		sink = s.total;
+	}
+	printf_time = now() - printf_time;
+
+	printf("body of %zu bytes with %u logged records, %ld renders each way\n",
+		total, backlog, renders);
+	printf("stream emitters: %7.2f us per body\n", stream_time * 1e6 / renders);
+	printf("sprintf:         %7.2f us per body, %.1fx\n",
+		printf_time * 1e6 / renders, printf_time / stream_time);
+
+	return true;
+}
+
+// One wakeup, from reset to deep sleep, following main.c. The record is
+// logged but never acknowledged, so that the backlog grows to a full batch.
+// The last wakeup runs the benchmark instead of sleeping
+static void
+wake (const enum rst_reason reason, const bool last)
+{
+	const struct rst_info reset = { .reason = reason };
+	const bool warm = (reason == REASON_DEEP_SLEEP_AWAKE);
+	uint32_t current, backlog;
+	int status;
+
+	chip_select(chip);
+	chip->awake_us = 0;
+
+	trace_init(&reset);
+	if (warm)
+		rtc_mem_load();
+
+	power_init(warm);
+	flash_log_init(reason != REASON_DEFAULT_RST);
+	schedule_init(warm);
+	fourier_init(warm);
+	sensors_plan(rtc_mem_clock());
+
+	for (uint8_t round = 0; ; round++) {
+		sensors_request(round);
+		sensors_readout(round);
+
+		if (sensors_all_valid() || round >= SENSORS_ROUNDS_MAX - 1)
+			break;
+	}
+
+	onewire_depower();
+	sensors_consolidate_samples();
+	schedule_update(sensors_record_data(), rtc_mem_clock());
+	fourier_update(sensors_record_data(), rtc_mem_clock());
+
+	sensors_consolidate_records();
+	current = flash_log_seq(flash_log_pending());
+	flash_log_append(sensors_record_data(), rtc_mem_clock());
+	rtc_mem_save(0);
+
+	if (last) {
+		backlog = flash_log_pending() - 1;
+		if (backlog > FLASH_LOG_BATCH)
+			backlog = FLASH_LOG_BATCH;
+
+		status = bench(backlog, current) ? 0 : 1;
+		fflush(stdout);
+		_exit(status);
+	}
+
+	rtc_mem_clock_save(schedule_interval());
+	chip->clock += schedule_interval();
+}
+
+static void
+usage (const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n wakeups] [-b renders] [-e noise-%%]\n", name);
+	exit(1);
+}
+
+int
+main (int argc, char **argv)
+{
+	enum rst_reason reason = REASON_DEFAULT_RST;
+	long wakeups = 200;
+	int noise = 0, opt, status;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "n:b:e:")) != -1)
+		switch (opt) {
+		case 'n': wakeups = atol(optarg); break;
+		case 'b': renders = atol(optarg); break;
+		case 'e': noise   = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+		}
+
+	if (optind != argc || wakeups < 1 || renders < 1 || noise < 0 || noise > 100)
+		usage(argv[0]);
+
+	chip = mmap(NULL, sizeof(*chip), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (chip == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	chip->chipid = 0x00f10000;
+	chip->seed   = chip->chipid * 2654435761U | 1;
+	chip->vdd    = 3300 * 1024 / 1000;
+	chip->rssi   = -70;
+	chip->adc    = 512;
+	chip->clock  = 1700000000;
+	chip->mean   = 10 * 16;
+	chip->swing  = 5 * 16;
+	chip->phase  = 14 * 3600;
+	chip->noise  = noise;
+
+	// Each wakeup in a process of its own, so that the firmware's RAM
+	// starts afresh as it does after deep sleep:
+	for (long i = 0; i < wakeups; i++) {
+		if ((pid = fork()) < 0) {
+			perror("fork");
+			return 1;
+		}
+
+		if (pid == 0) {
+			wake(reason, i == wakeups - 1);
+			_exit(0);
+		}
+
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			return 1;
+
+		reason = REASON_DEEP_SLEEP_AWAKE;
+	}
+
+	return 0;
+}
@@ -0,0 +1,431 @@
+// Simulated ESP8266 for running firmware modules on the host, as the probe
+// fleet does. It implements the SDK calls those modules make against a
+// struct chip: RTC memory, the flash log's sectors, the chip ID, the supply
+// voltage and the radio's signal strength. Time only moves when the
+// firmware arms a timer or the caller says so, and timers never fire by
+// themselves; the caller runs the next state instead.
+//
+// The OneWire bus has the sensors of the sensor table on it, buried at their
+// depths in a soil with a daily temperature wave. They answer the commands
+// that ds18b20.c sends, with the reset value before a conversion, undefined
+// low bits below full resolution, and now and then a garbled scratchpad.
+//
+// All state outside the struct chip is the firmware's RAM, which the caller
+// is expected to start afresh at every wakeup.
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <osapi.h>
+#include <user_interface.h>
+
+#include "ds18b20.h"
+#include "flash_log.h"
+#include "chip.h"
+#include "fourier.h"
+#include "missing.h"
+#include "sensor_table.h"
+#include "state.h"
+#include "trace.h"
+
+#define CMD_MATCH_ROM	0x55
+#define CMD_CONVERSION	0x44
+#define CMD_GET_RESULT	0xBE
+#define CMD_SET_CONFIG	0x4E
+
+#if TRACE_SECTOR != CHIP_FLASH_SECTOR + CHIP_FLASH_SECTORS - 1
+#error "The trace sector must follow the flash log"
+#endif
+
+// Scratchpad after power-up: 85 degrees, and 12 bits resolution:
+#define RESET_VALUE	0x0550
+#define CONFIG_12BIT	0x7F
+
+static struct chip *chip;
+static bool verbose = false;
+
+// Where the bus is in a transaction, which sensor is selected, and the bytes
+// that go with the current command:
+static enum {
+	BUS_IDLE,
+	BUS_ROM,
+	BUS_COMMAND,
+	BUS_CONFIG,
+	BUS_READ,
+} bus = BUS_IDLE;
+
+static int selected;
+static uint8_t rom[8];
+static uint8_t pos;
+
+// Scratchpads of the sensors:
+static uint8_t scratchpad[NSENSORS][9];
+static bool powered = false;
+
+void
+chip_select (struct chip *c)
+{
+	chip = c;
+}
+
+void
+chip_verbose (const bool on)
+{
+	verbose = on;
+}
+
+// Let time pass while awake
+void
+chip_delay (const uint32_t ms)
+{
+	chip->awake_us += ms * 1000;
+}
+
+// Xorshift, with its state in the chip, so that it carries over wakeups
+uint32_t
+chip_random (void)
+{
+	uint32_t x = chip->seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return chip->seed = x;
+}
+
+// The SDK's hardware random numbers
+unsigned long
+os_random (void)
+{
+	return chip_random();
+}
+
+// Soil temperature at a sensor, in 1/16 degrees C
+static int16_t
+soil (const size_t sensor)
+{
+	const double z = (FOURIER_DEPTH_TOP + sensor * FOURIER_DEPTH_STEP) / (double) CHIP_DAMPING_CM;
+	const double t = chip->clock + chip->awake_us / 1e6 - chip->phase;
+
+	return lround(chip->mean + chip->swing * exp(-z) * cos(2 * M_PI * t / FOURIER_PERIOD_SEC - z));
+}
+
+static uint8_t
+crc8 (const uint8_t *data, size_t len)
+{
+	uint8_t crc = 0;
+
+	while (len--) {
+		uint8_t d = *data++;
+
+		for (int j = 0; j < 8; j++, d >>= 1)
+			crc = ((crc ^ d) & 1) ? (crc >> 1) ^ 0x8C : crc >> 1;
+	}
+
+	return crc;
+}
+
+static void
+scratchpad_init (void)
+{
+	for (size_t i = 0; i < NSENSORS; i++) {
+		uint8_t *s = scratchpad[i];
+
+		s[0] = RESET_VALUE & 0xFF;
+		s[1] = RESET_VALUE >> 8;
+		s[2] = 0x4B;
+		s[3] = 0x46;
+		s[4] = CONFIG_12BIT;
+		s[5] = 0xFF;
+		s[6] = 0x0C;
+		s[7] = 0x10;
+		s[8] = crc8(s, 8);
+	}
+
+	powered = true;
+}
+
+// Convert the temperature, with undefined bits below the resolution
+static void
+convert (uint8_t *s)
+{
+	const uint8_t undefined = 3 - ((s[4] >> 5) & 3);
+	int16_t value = soil(selected);
+
+	value = (value & ~((1 << undefined) - 1)) | (chip_random() & ((1 << undefined) - 1));
+	s[0] = value & 0xFF;
+	s[1] = (uint16_t) value >> 8;
+	s[8] = crc8(s, 8);
+}
+
+bool
+onewire_reset (void)
+{
+	if (!powered)
+		scratchpad_init();
+
+	bus = BUS_IDLE;
+	return true;
+}
+
+void
+onewire_write (const uint8_t c)
+{
+	switch (bus)
+	{
+	case BUS_IDLE:
+		if (c == CMD_MATCH_ROM) {
+			bus = BUS_ROM;
+			pos = 0;
+		}
+		break;
+
+	case BUS_ROM:
+		rom[pos++] = c;
+		if (pos < sizeof(rom))
+			break;
+
+		// Nobody answers to an unknown address:
+		selected = -1;
+		for (size_t i = 0; i < NSENSORS; i++)
+			if (memcmp(rom, sensors[i], sizeof(rom)) == 0)
+				selected = i;
+
+		bus = (selected < 0) ? BUS_IDLE : BUS_COMMAND;
+		break;
+
+	case BUS_COMMAND:
+		pos = 0;
+		bus = BUS_IDLE;
+
+		if (c == CMD_CONVERSION)
+			convert(scratchpad[selected]);
+		else if (c == CMD_SET_CONFIG)
+			bus = BUS_CONFIG;
+		else if (c == CMD_GET_RESULT)
+			bus = BUS_READ;
+		break;
+
+	case BUS_CONFIG:
+		scratchpad[selected][2 + pos++] = c;
+		if (pos == 3) {
+			scratchpad[selected][8] = crc8(scratchpad[selected], 8);
+			bus = BUS_IDLE;
+		}
+		break;
+
+	case BUS_READ:
+		break;
+	}
+}
+
+uint8_t
+onewire_read (void)
+{
+	uint8_t c;
+
+	if (bus != BUS_READ || pos >= sizeof(scratchpad[0]))
+		return 0xFF;
+
+	c = scratchpad[selected][pos++];
+
+	// Flip a bit now and then, which fails the CRC:
+	if (chip->noise > 0 && chip_random() % (100 * sizeof(scratchpad[0])) < chip->noise)
+		c ^= 1 << (chip_random() % 8);
+
+	return c;
+}
+
+// The sensors lose their resolution setting when depowered:
+void
+onewire_depower (void)
+{
+	powered = false;
+}
+
+// The fleet runs the states itself:
+void
+state_change (enum state state)
+{
+	(void) state;
+}
+
+int
+os_printf_plus (const char *format, ...)
+{
+	va_list ap;
+	int n = 0;
+
+	if (verbose) {
+		va_start(ap, format);
+		fprintf(stderr, "%08x: ", chip->chipid);
+		n = vfprintf(stderr, format, ap);
+		va_end(ap);
+	}
+
+	return n;
+}
+
+int
+ets_sprintf (char *str, const char *format, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, format);
+	n = vsprintf(str, format, ap);
+	va_end(ap);
+	return n;
+}
+
+// Timers don't fire, but the time they wait passes:
+void
+ets_timer_arm_new (os_timer_t *timer, uint32_t ms, uint32_t repeat, uint32_t is_ms)
+{
+	(void) timer;
+	(void) repeat;
+	(void) is_ms;
+
+	chip_delay(ms);
+}
+
+void
+ets_timer_disarm (os_timer_t *timer)
+{
+	(void) timer;
+}
+
+void
+ets_timer_setfn (os_timer_t *timer, ETSTimerFunc *func, void *arg)
+{
+	timer->func = func;
+	timer->arg  = arg;
+}
+
+void *
+pvPortMalloc (size_t size, char *file, int line)
+{
+	(void) file;
+	(void) line;
+
+	return malloc(size);
+}
+
+void
+vPortFree (void *ptr, char *file, int line)
+{
+	(void) file;
+	(void) line;
+
+	free(ptr);
+}
+
+uint16_t
+readvdd33 (void)
+{
+	return chip->vdd;
+}
+
+uint16
+system_adc_read (void)
+{
+	return chip->adc;
+}
+
+uint32
+system_get_chip_id (void)
+{
+	return chip->chipid;
+}
+
+uint32
+system_get_time (void)
+{
+	return chip->awake_us;
+}
+
+sint8
+wifi_station_get_rssi (void)
+{
+	return chip->rssi;
+}
+
+bool
+system_rtc_mem_read (uint8 src_addr, void *des_addr, uint16 save_size)
+{
+	if (src_addr * 4U + save_size > sizeof(chip->rtc))
+		return false;
+
+	memcpy(des_addr, (uint8_t *) chip->rtc + src_addr * 4, save_size);
+	return true;
+}
+
+bool
+system_rtc_mem_write (uint8 des_addr, const void *src_addr, uint16 save_size)
+{
+	if (des_addr * 4U + save_size > sizeof(chip->rtc))
+		return false;
+
+	memcpy((uint8_t *) chip->rtc + des_addr * 4, src_addr, save_size);
+	return true;
+}
+
+// Find a flash range in the backed sectors, or NULL
+static uint8_t *
+flash_at (const uint32_t addr, const uint32_t size)
+{
+	const uint32_t start = CHIP_FLASH_SECTOR * CHIP_SECTOR_SIZE;
+
+	if (addr < start || addr + size > start + sizeof(chip->flash))
+		return NULL;
+
+	return chip->flash[0] + (addr - start);
+}
+
+SpiFlashOpResult
+spi_flash_erase_sector (uint16 sec)
+{
+	uint8_t *p;
+
+	if ((p = flash_at(sec * CHIP_SECTOR_SIZE, CHIP_SECTOR_SIZE)) == NULL)
+		return SPI_FLASH_RESULT_ERR;
+
+	memset(p, 0, CHIP_SECTOR_SIZE);
+	return SPI_FLASH_RESULT_OK;
+}
+
+// Writing flash can only clear bits:
+SpiFlashOpResult
+spi_flash_write (uint32 des_addr, uint32 *src_addr, uint32 size)
+{
+	const uint8_t *src = (const uint8_t *) src_addr;
+	uint8_t *p;
+
+	if ((p = flash_at(des_addr, size)) == NULL)
+		return SPI_FLASH_RESULT_ERR;
+
+	for (uint32_t i = 0; i < size; i++)
+		p[i] |= ~src[i];
+
+	return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult
+spi_flash_read (uint32 src_addr, uint32 *des_addr, uint32 size)
+{
+	uint8_t *dst = (uint8_t *) des_addr;
+	const uint8_t *p;
+
+	if ((p = flash_at(src_addr, size)) == NULL)
+		return SPI_FLASH_RESULT_ERR;
+
+	for (uint32_t i = 0; i < size; i++)
+		dst[i] = ~p[i];
+
+	return SPI_FLASH_RESULT_OK;
+}
@@ -0,0 +1,35 @@
+// Size of the RTC memory in 4-byte blocks, user memory included. Of the
+// flash, only the flash log's sectors and the trace sector after them are
+// backed by memory:
+#define CHIP_RTC_BLOCKS		192
+#define CHIP_FLASH_SECTOR	FLASH_LOG_SECTOR
+#define CHIP_FLASH_SECTORS	(FLASH_LOG_SECTORS + 1)
+#define CHIP_SECTOR_SIZE	4096
+
+// Damping depth of the daily wave in the simulated soil, in cm:
+#define CHIP_DAMPING_CM		15
+
+// A simulated ESP8266 with its sensor rod. Everything that survives a deep
+// sleep is in here; the firmware's RAM is not:
+struct chip {
+	uint32_t	chipid;
+	uint16_t	vdd;		// Supply voltage as read, in 1/1024 V
+	int8_t		rssi;
+	uint16_t	adc;
+	uint32_t	seed;		// State of the random generator
+	uint32_t	clock;		// Unix time at wakeup
+	uint32_t	awake_us;	// Time since wakeup
+	int16_t		mean;		// Mean soil temperature, 1/16 degrees C
+	int16_t		swing;		// Daily amplitude at the surface
+	uint32_t	phase;		// Time of day of the peak, in seconds
+	uint8_t		noise;		// Chance in percent of a garbled reading
+	uint32_t	rtc[CHIP_RTC_BLOCKS];
+
+	// Flash contents, inverted, so that zeroed memory reads as erased:
+	uint8_t		flash[CHIP_FLASH_SECTORS][CHIP_SECTOR_SIZE];
+};
+
+void chip_select (struct chip *chip);
+void chip_delay (const uint32_t ms);
+uint32_t chip_random (void);
+void chip_verbose (const bool verbose);
@@ -0,0 +1,32 @@
+// Decode the compact binary payload into the JSON body that the firmware
+// sends when HTTP_BINARY is disabled. Reads the payload from stdin, writes
+// the JSON to stdout.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "fourier.h"
+#include "packed.h"
+#include "trace.h"
+#include "payload.h"
+
+// Largest payload we accept:
+#define PAYLOAD_MAX	65536
+
+int
+main (void)
+{
+	static uint8_t buf[PAYLOAD_MAX];
+	static struct payload pl;
+	size_t len = fread(buf, 1, sizeof(buf), stdin);
+	const char *err;
+
+	if ((err = payload_decode(&pl, buf, len)) != NULL) {
+		fprintf(stderr, "%s\n", err);
+		return 1;
+	}
+
+	payload_json(stdout, &pl);
+	return 0;
+}
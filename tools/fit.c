@@ -0,0 +1,568 @@
+// Fit the Fourier soil model to the histories in the time-series store, for
+// every probe at once. This is the fit that fourier.c does on the probe from
+// running averages, done here by least squares over all stored readings in
+// a time range. Per sensor, the fit of
+//
+//	T(t) = mean + a cos(wt) + b sin(wt)
+//
+// only needs nine sums over the readings, of the temperature, the cosine and
+// the sine, and their products. The sums are taken a window of a series at a
+// time, straight from the decoded column, by a kernel that works on vectors
+// of doubles. The amplitudes and phases at the depths then give the damping
+// depth, the amplitude at the surface and the time of the peak, as on the
+// probe. The probes are spread over a number of threads.
+//
+// With a cache file, the sums over the written blocks of every probe are kept
+// there along with the size of its rod file. The next run only reads the
+// blocks that were added since, subtracting what the windows they replace
+// had contributed, so probes without new data cost next to nothing. For each
+// probe that has a fit, a line goes to stdout:
+//
+//	chipid,depths,samples,depth_mm,amplitude,peak,residual
+//
+// with the amplitude and its RMS residual over the depths in degrees C, and
+// the peak in seconds since the start of the period (midnight UTC, for the
+// daily wave):
+//
+//	fit [-j threads] [-c cache] store [from [to]]
+//
+// The store is opened read-only, so this can run next to the ingest server.
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ds18b20.h"
+#include "fourier.h"
+#include "sensor_table.h"
+#include "store.h"
+
+#if FOURIER_PERIOD_SEC % STORE_PERIOD_SEC
+#error "The period of the wave must be a whole number of store slots"
+#endif
+
+// Slots per period of the wave:
+#define PERIOD_SLOTS	(FOURIER_PERIOD_SEC / STORE_PERIOD_SEC)
+
+// Sums per series, for the normal equations:
+enum {
+	SUM_N,			// Readings
+	SUM_C,			// cos(wt)
+	SUM_S,			// sin(wt)
+	SUM_CC,			// cos(wt)^2
+	SUM_SS,			// sin(wt)^2
+	SUM_CS,			// cos(wt) sin(wt)
+	SUM_T,			// T
+	SUM_TC,			// T cos(wt)
+	SUM_TS,			// T sin(wt)
+	SUMS
+};
+
+#define CACHE_MAGIC	"FIT1"
+
+// Vectors of two doubles, loaded from any double's address. That is what
+// SSE2 and NEON have, and the nine sums stay in registers:
+typedef double vec __attribute__ ((vector_size (2 * sizeof(double)), aligned (sizeof(double))));
+
+#define LANES		(sizeof(vec) / sizeof(double))
+
+#if STORE_WINDOW_SLOTS % 2
+#error "The kernel needs whole vectors per window"
+#endif
+
+// Cache file header, followed by an entry per probe, each followed by the
+// sums of its series:
+struct cache_header {
+	char		magic[4];
+	uint32_t	period;
+	uint32_t	from;
+	uint32_t	to;
+	uint32_t	nprobes;
+};
+
+struct cache_entry {
+	uint32_t	chipid;
+	uint32_t	nseries;
+	uint64_t	size;		// Size of the rod file the sums are for
+};
+
+// A probe to fit, with the sums of its written blocks, from the cache and
+// after the fit:
+struct job {
+	struct cache_entry entry;
+	double		(*sums)[SUMS];
+	bool		refit;		// Read blocks that weren't in the cache
+	bool		ok;		// Has a fit
+	uint32_t	depths;
+	uint64_t	samples;
+	double		depth;		// Damping depth in mm
+	double		amplitude;	// Amplitude at the surface in degrees C
+	double		peak;		// Seconds into the period
+	double		residual;	// RMS amplitude error in degrees C
+};
+
+static const char *dir;
+static uint64_t first, last;
+static struct job *jobs;
+static size_t njobs, next_job;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Cosine and sine of the wave at the middle of each slot, for a period and
+// a window beyond, so that any window starts somewhere in the first period:
+static double wave_cos[PERIOD_SLOTS + STORE_WINDOW_SLOTS];
+static double wave_sin[PERIOD_SLOTS + STORE_WINDOW_SLOTS];
+
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Add the sums over a window. Temperatures are zero and weights are zero
+// where there's no reading:
+static void
+kernel (double *sums, const double *temp, const double *weight, const double *cos, const double *sin)
+{
+	vec n = { 0 }, c = { 0 }, s = { 0 }, cc = { 0 }, ss = { 0 }, cs = { 0 }, t = { 0 }, tc = { 0 }, ts = { 0 };
+
+	for (size_t i = 0; i < STORE_WINDOW_SLOTS; i += LANES) {
+		const vec w  = *(const vec *) (weight + i);
+		const vec x  = *(const vec *) (temp + i);
+		const vec co = *(const vec *) (cos + i);
+		const vec si = *(const vec *) (sin + i);
+		const vec wc = w * co, ws = w * si;
+
+		n  += w;
+		c  += wc;
+		s  += ws;
+		cc += wc * co;
+		ss += ws * si;
+		cs += wc * si;
+		t  += x;
+		tc += x * co;
+		ts += x * si;
+	}
+
+	for (size_t i = 0; i < LANES; i++) {
+		sums[SUM_N]  += n[i];
+		sums[SUM_C]  += c[i];
+		sums[SUM_S]  += s[i];
+		sums[SUM_CC] += cc[i];
+		sums[SUM_SS] += ss[i];
+		sums[SUM_CS] += cs[i];
+		sums[SUM_T]  += t[i];
+		sums[SUM_TC] += tc[i];
+		sums[SUM_TS] += ts[i];
+	}
+}
+
+// Add the sums over a series in a window, as decoded from the blocks before
+// the given offset, and the staged samples if asked, with a sign
+static void
+window_sums (const struct store_rod *rod, const int series, const uint32_t window, const uint64_t before, const bool staged, const double sign, double *sums)
+{
+	const uint64_t base = (uint64_t) window * STORE_WINDOW_SLOTS;
+	const size_t offset = base % PERIOD_SLOTS;
+	const size_t lo = (first > base) ? first - base : 0;
+	const size_t hi = (last < base + STORE_WINDOW_SLOTS) ? last - base : STORE_WINDOW_SLOTS;
+	int16_t value[STORE_WINDOW_SLOTS];
+	uint8_t status[STORE_WINDOW_SLOTS];
+	double temp[STORE_WINDOW_SLOTS], weight[STORE_WINDOW_SLOTS];
+
+	if (lo >= hi)
+		return;
+
+	store_window(rod, series, window, before, staged, value, status);
+
+	// Only successful readings in the time range count:
+	memset(weight, 0, sizeof(weight));
+	memset(temp, 0, sizeof(temp));
+
+	for (size_t slot = lo; slot < hi; slot++) {
+		weight[slot] = (status[slot] == DS18B20_SUCCESS) ? sign : 0;
+		temp[slot]   = weight[slot] * value[slot];
+	}
+
+	kernel(sums, temp, weight, wave_cos + offset, wave_sin + offset);
+}
+
+// Fit the wave at one depth to its sums, by solving the normal equations.
+// Gets the amplitude in 1/16 degrees C and the phase of the peak in radians:
+static bool
+wave_fit (const double *s, double *amp, double *phase)
+{
+	const double n = s[SUM_N], c = s[SUM_C], si = s[SUM_S];
+	const double cc = s[SUM_CC], ss = s[SUM_SS], cs = s[SUM_CS];
+	const double t = s[SUM_T], tc = s[SUM_TC], ts = s[SUM_TS];
+	double det, a, b;
+
+	// Wait for a period's worth of readings:
+	if (n < PERIOD_SLOTS)
+		return false;
+
+	det = n * (cc * ss - cs * cs) - c * (c * ss - cs * si) + si * (c * cs - cc * si);
+	if (det < 1e-9 * n * n * n)
+		return false;
+
+	// Cramer's rule for the cosine and sine coefficients:
+	a = (n * (tc * ss - cs * ts) - t * (c * ss - cs * si) + si * (c * ts - tc * si)) / det;
+	b = (n * (cc * ts - tc * cs) - c * (c * ts - tc * si) + t * (c * cs - cc * si)) / det;
+
+	*amp   = hypot(a, b);
+	*phase = atan2(b, a);
+	return true;
+}
+
+// Fit the model over the depths, as fourier_fit() does
+static void
+model_fit (struct job *job, struct store_rod *rod, double (*total)[SUMS])
+{
+	double z[NSENSORS], logamp[NSENSORS], phase[NSENSORS], amp[NSENSORS];
+	double sz = 0, szz = 0, sl = 0, szl = 0, sp = 0, szp = 0, den, slope, intercept, phase0, err = 0;
+	uint32_t n = 0;
+
+	for (size_t i = 0; i < NSENSORS; i++) {
+		const int series = store_series(rod, sensors[i], false);
+		double p;
+
+		if (series < 0)
+			continue;
+
+		job->samples += total[series][SUM_N];
+
+		if (!wave_fit(total[series], &amp[n], &p) || amp[n] < FOURIER_AMPLITUDE_MIN)
+			continue;
+
+		z[n]      = FOURIER_DEPTH_TOP + i * FOURIER_DEPTH_STEP;
+		logamp[n] = log(amp[n]);
+
+		// Unwrap the phase relative to the depth above:
+		phase[n] = (n == 0) ? p : phase[n - 1] + remainder(p - phase[n - 1], 2 * M_PI);
+		n++;
+	}
+
+	job->depths = n;
+	if (n < 2)
+		return;
+
+	for (uint32_t i = 0; i < n; i++) {
+		sz  += z[i];
+		szz += z[i] * z[i];
+		sl  += logamp[i];
+		szl += z[i] * logamp[i];
+		sp  += phase[i];
+		szp += z[i] * phase[i];
+	}
+
+	den   = n * szz - sz * sz;
+	slope = (n * szl - sz * sl) / den;
+
+	// The amplitude must decrease with depth:
+	if (slope >= 0)
+		return;
+
+	intercept = (sl - slope * sz) / n;
+	phase0    = (sp - (n * szp - sz * sp) / den * sz) / n;
+
+	for (uint32_t i = 0; i < n; i++) {
+		const double diff = amp[i] - exp(intercept + slope * z[i]);
+
+		err += diff * diff;
+	}
+
+	job->ok        = true;
+	job->depth     = -10 / slope;
+	job->amplitude = exp(intercept) / 16;
+	job->peak      = fmod(phase0 / (2 * M_PI) + 1, 1) * FOURIER_PERIOD_SEC;
+	job->residual  = sqrt(err / n) / 16;
+}
+
+// Bring the sums of a probe's blocks up to date, add the staged windows, and
+// fit the model
+static void
+probe_fit (struct job *job)
+{
+	struct cache_entry *e = &job->entry;
+	struct store *store;
+	struct store_rod *rod;
+	uint64_t since, size;
+	uint32_t staged[2], window;
+	size_t nseries, nstaged;
+
+	if ((store = store_open(dir, false)) == NULL)
+		return;
+
+	if ((rod = store_rod(store, e->chipid, false)) == NULL) {
+		store_close(store);
+		return;
+	}
+
+	if ((nseries = store_nseries(rod)) == 0)
+		goto out;
+
+	size = store_size(rod);
+
+	// Start over if the rod file is not the one we have sums for:
+	if (job->sums == NULL || e->size > size || e->nseries > nseries) {
+		free(job->sums);
+		job->sums = NULL;
+		e->size = 0;
+	}
+
+	if ((job->sums = realloc(job->sums, nseries * sizeof(*job->sums))) == NULL)
+		goto out;
+
+	if (e->size == 0)
+		e->nseries = 0;
+
+	memset(job->sums + e->nseries, 0, (nseries - e->nseries) * sizeof(*job->sums));
+	since = e->size;
+
+	// Windows with new blocks replace what their old blocks contributed:
+	if (size > since) {
+		job->refit = true;
+
+		for (window = first / STORE_WINDOW_SLOTS; store_next(rod, window, &window) && (uint64_t) window * STORE_WINDOW_SLOTS < last; window++) {
+			if (store_written(rod, window) > since)
+				for (size_t s = 0; s < nseries; s++) {
+					if (since > 0)
+						window_sums(rod, s, window, since, false, -1, job->sums[s]);
+					window_sums(rod, s, window, UINT64_MAX, false, 1, job->sums[s]);
+				}
+
+			if (window == UINT32_MAX)
+				break;
+		}
+	}
+
+	e->size    = size;
+	e->nseries = nseries;
+
+	// The staged samples change all the time, so they are never cached:
+	{
+		double total[nseries][SUMS];
+
+		memcpy(total, job->sums, sizeof(total));
+		nstaged = store_staged(rod, staged);
+
+		for (size_t i = 0; i < nstaged; i++) {
+			if ((uint64_t) staged[i] * STORE_WINDOW_SLOTS >= last || ((uint64_t) staged[i] + 1) * STORE_WINDOW_SLOTS <= first)
+				continue;
+
+			for (size_t s = 0; s < nseries; s++) {
+				window_sums(rod, s, staged[i], UINT64_MAX, true, 1, total[s]);
+				window_sums(rod, s, staged[i], UINT64_MAX, false, -1, total[s]);
+			}
+		}
+
+		model_fit(job, rod, total);
+	}
+
+out:	store_release(rod);
+	store_close(store);
+}
+
+static void *
+run (void *arg)
+{
+	(void) arg;
+
+	for (;;) {
+		size_t i;
+
+		pthread_mutex_lock(&lock);
+		i = next_job++;
+		pthread_mutex_unlock(&lock);
+
+		if (i >= njobs)
+			return NULL;
+
+		probe_fit(&jobs[i]);
+	}
+}
+
+static int
+job_cmp (const void *a, const void *b)
+{
+	const uint32_t x = ((const struct job *) a)->entry.chipid;
+	const uint32_t y = ((const struct job *) b)->entry.chipid;
+
+	return (x > y) - (x < y);
+}
+
+// Take the sums of the probes from the cache, if it was made for the same
+// time range. Missing or stale entries are simply refitted:
+static void
+cache_load (const char *path, const uint32_t from, const uint32_t to)
+{
+	struct cache_header h;
+	struct cache_entry e;
+	FILE *f;
+
+	if ((f = fopen(path, "rb")) == NULL)
+		return;
+
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, CACHE_MAGIC, 4) != 0
+	 || h.period != FOURIER_PERIOD_SEC || h.from != from || h.to != to) {
+		fclose(f);
+		return;
+	}
+
+	for (uint32_t i = 0; i < h.nprobes && fread(&e, sizeof(e), 1, f) == 1 && e.nseries <= STORE_SERIES_MAX; i++) {
+		const struct job key = { .entry.chipid = e.chipid };
+		struct job *job = bsearch(&key, jobs, njobs, sizeof(*jobs), job_cmp);
+		double (*sums)[SUMS];
+
+		if ((sums = malloc(e.nseries * sizeof(*sums))) == NULL || fread(sums, sizeof(*sums), e.nseries, f) != e.nseries) {
+			free(sums);
+			break;
+		}
+
+		if (job == NULL || job->sums != NULL) {
+			free(sums);
+			continue;
+		}
+
+		job->entry = e;
+		job->sums  = sums;
+	}
+
+	fclose(f);
+}
+
+// Write the cache to a new file, and move it into place
+static bool
+cache_save (const char *path, const uint32_t from, const uint32_t to)
+{
+	struct cache_header h = { .magic = CACHE_MAGIC, .period = FOURIER_PERIOD_SEC, .from = from, .to = to };
+	char tmp[4096];
+	FILE *f;
+
+	for (size_t i = 0; i < njobs; i++)
+		if (jobs[i].sums != NULL)
+			h.nprobes++;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	if ((f = fopen(tmp, "wb")) == NULL)
+		return false;
+
+	fwrite(&h, sizeof(h), 1, f);
+
+	for (size_t i = 0; i < njobs; i++)
+		if (jobs[i].sums != NULL) {
+			fwrite(&jobs[i].entry, sizeof(jobs[i].entry), 1, f);
+			fwrite(jobs[i].sums, sizeof(*jobs[i].sums), jobs[i].entry.nseries, f);
+		}
+
+	if (fclose(f) != 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return false;
+	}
+
+	return true;
+}
+
+static void
+usage (const char *name)
+{
+	fprintf(stderr, "Usage: %s [-j threads] [-c cache] store [from [to]]\n", name);
+	exit(1);
+}
+
+int
+main (int argc, char **argv)
+{
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *cache = NULL;
+	pthread_t *threads;
+	struct store *store;
+	uint32_t from, to, *chipids;
+	size_t nfit = 0, nrefit = 0;
+	double start;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:c:")) != -1)
+		switch (opt) {
+		case 'j': nthreads = atol(optarg); break;
+		case 'c': cache    = optarg; break;
+		default:
+			usage(argv[0]);
+		}
+
+	if (optind >= argc || nthreads < 1)
+		usage(argv[0]);
+
+	dir   = argv[optind];
+	from  = (optind + 1 < argc) ? strtoul(argv[optind + 1], NULL, 0) : 0;
+	to    = (optind + 2 < argc) ? strtoul(argv[optind + 2], NULL, 0) : UINT32_MAX;
+	first = ((uint64_t) from + STORE_PERIOD_SEC - 1) / STORE_PERIOD_SEC;
+	last  = ((uint64_t) to + STORE_PERIOD_SEC - 1) / STORE_PERIOD_SEC;
+	start = now();
+
+	for (size_t i = 0; i < PERIOD_SLOTS + STORE_WINDOW_SLOTS; i++) {
+		const double angle = 2 * M_PI * ((i % PERIOD_SLOTS) + 0.5) / PERIOD_SLOTS;
+
+		wave_cos[i] = cos(angle);
+		wave_sin[i] = sin(angle);
+	}
+
+	if ((store = store_open(dir, false)) == NULL || !store_list(store, &chipids, &njobs)) {
+		perror(dir);
+		return 1;
+	}
+
+	store_close(store);
+
+	if ((jobs = calloc(njobs ? njobs : 1, sizeof(*jobs))) == NULL || (threads = calloc(nthreads, sizeof(*threads))) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (size_t i = 0; i < njobs; i++)
+		jobs[i].entry.chipid = chipids[i];
+
+	free(chipids);
+
+	if (cache != NULL)
+		cache_load(cache, from, to);
+
+	for (long i = 0; i < nthreads; i++)
+		if ((errno = pthread_create(&threads[i], NULL, run, NULL)) != 0) {
+			perror("pthread_create");
+			return 1;
+		}
+
+	for (long i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (size_t i = 0; i < njobs; i++) {
+		const struct job *job = &jobs[i];
+
+		nrefit += job->refit;
+
+		if (!job->ok)
+			continue;
+
+		printf("%u,%u,%llu,%.0f,%.4f,%.0f,%.4f\n", job->entry.chipid, job->depths,
+			(unsigned long long) job->samples, job->depth, job->amplitude, job->peak, job->residual);
+		nfit++;
+	}
+
+	if (cache != NULL && !cache_save(cache, from, to))
+		perror(cache);
+
+	fprintf(stderr, "%zu probes, %zu with new blocks, %zu fitted, in %.3f s\n",
+		njobs, nrefit, nfit, now() - start);
+	return 0;
+}
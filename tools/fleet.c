@@ -0,0 +1,691 @@
+// Load generator for the upload receivers, simulating a fleet of probes.
+// Every probe runs the firmware's own modules on a simulated chip (see
+// chip.c), so the uploads are byte for byte what a probe would send: the
+// sensors are read over the simulated bus, records go through the flash log,
+// and the body comes from http.c. Only main.c's state machine is replaced by
+// a straight walk through the same states, in wake() below.
+//
+// Each wakeup runs in a process of its own, forked for the occasion, so that
+// the firmware's RAM starts afresh as it does after deep sleep; what survives
+// is in the struct chip, in memory shared with the workers. The workers are
+// processes that each wake their share of the probes in turn, when they are
+// due, so the number of workers is the number of probes that can be awake at
+// once. Time runs faster by a given factor, and the probes sleep for as long
+// as the firmware's schedule says.
+//
+// Like the firmware, a probe retries a failed wifi setup a few times, sends
+// its logged records along with the current one, and makes a few uploads in
+// a row while the server acknowledges them. A wifi outage, sensor noise and
+// crashes can be added, which brings on sensor retries, bursts of backlog
+// after the outage, and crash traces in the uploads. Starting all probes at
+// once gives the burst after a power cut.
+//
+// Progress goes to stderr every second. At the end, the totals and the
+// latency percentiles, from connecting to the acknowledgement, go to stdout:
+//
+//	fleet [-n probes] [-j workers] [-x speed] [-t seconds]
+//	      [-w wifi-fail-%] [-e noise-%] [-c crash-%] [-o start,length] [-s] [-v]
+//	      server [port]
+//
+// The outage is given in simulated seconds from the start. With -s, all
+// probes start at once; -v shows the firmware's console output.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <user_interface.h>
+
+#include "flash_log.h"
+#include "chip.h"
+#include "fourier.h"
+#include "http.h"
+#include "net.h"
+#include "onewire.h"
+#include "power.h"
+#include "rtc_mem.h"
+#include "schedule.h"
+#include "sensors.h"
+#include "state.h"
+#include "trace.h"
+#include "wifi.h"
+
+// Chip ID of the first probe, the others count up from there:
+#define CHIPID_BASE	0x00f10000
+
+// Largest number of workers:
+#define WORKERS_MAX	1024
+
+// Time a successful wifi setup takes, in ms, and the wifi setup attempts,
+// as in main.c:
+#define WIFI_SETUP_MS	1500
+#define WIFI_ROUNDS	3
+
+// Exit status of a wakeup that crashed:
+#define EXIT_CRASH	3
+
+// Latency histogram, in microseconds, with eight buckets per power of two:
+#define HIST_SUB	8
+#define HIST_BUCKETS	(30 * HIST_SUB)
+
+// Largest response we look at:
+#define RESPONSE_MAX	1024
+
+// A probe, in shared memory:
+struct probe {
+	uint32_t	next;		// Simulated time of next wakeup
+	uint32_t	reason;		// Reset reason at next wakeup
+	struct chip	chip;
+};
+
+// Counters of a worker, in shared memory:
+struct stats {
+	uint64_t	wakeups;
+	uint64_t	uploads;	// Connections made
+	uint64_t	acked;
+	uint64_t	failed;		// Not acknowledged
+	uint64_t	records;	// Records acknowledged
+	uint64_t	bytes;		// Bytes sent
+	uint64_t	wifi_down;	// Wakeups that gave up on wifi
+	uint64_t	crashes;
+	uint64_t	lag_sum;	// Lateness of wakeups, in ms of real time
+	uint64_t	lag_max;
+	uint64_t	latency[HIST_BUCKETS];
+};
+
+// Options:
+static struct sockaddr_in server;
+static long nprobes = 1000;
+static long nworkers = 64;
+static long speed = 60;
+static long seconds = 60;
+static long wifi_fail = 5;
+static long noise = 1;
+static long crash = 0;
+static long outage_start, outage_len;
+static bool sync_start = false;
+
+static struct probe *probes;
+static struct stats *stats;
+static volatile bool *stop;
+
+// Simulated time at the start, and real time in microseconds:
+static uint32_t sim_start;
+static uint64_t real_start;
+
+// State at which this wakeup crashes, or STATE_NUM:
+static enum state crash_state;
+
+static uint64_t
+now_us (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Real time at a simulated time
+static uint64_t
+real_time (const uint32_t sim)
+{
+	return real_start + (uint64_t) (int32_t) (sim - sim_start) * 1000000 / speed;
+}
+
+static size_t
+bucket (const uint64_t us)
+{
+	int e;
+
+	if (us < HIST_SUB)
+		return us;
+
+	e = 63 - __builtin_clzll(us);
+	if ((e - 2) * HIST_SUB >= HIST_BUCKETS)
+		return HIST_BUCKETS - 1;
+
+	return (e - 2) * HIST_SUB + ((us >> (e - 3)) & (HIST_SUB - 1));
+}
+
+// Upper end of a bucket
+static uint64_t
+bucket_top (const size_t i)
+{
+	if (i < HIST_SUB)
+		return i;
+
+	return ((HIST_SUB + i % HIST_SUB + 1ULL) << (i / HIST_SUB - 1)) - 1;
+}
+
+// Enter a state, and trace it as state.c would. Crash if it's time
+static void
+enter (const enum state state)
+{
+	trace_add(state | TRACE_ENTER, 0);
+
+	if (state == crash_state)
+		_exit(EXIT_CRASH);
+}
+
+#if !NET_UDP
+
+// Parse the acknowledgement from a response, as net.c does
+static bool
+ack_parse (char *response, uint32_t *seq)
+{
+	for (char *p = response; (p = strchr(p, '\n')) != NULL; p++)
+		if (strncasecmp(p + 1, "x-ack:", 6) == 0) {
+			*seq = strtoul(p + 7, NULL, 10);
+			return true;
+		}
+
+	return false;
+}
+
+#endif
+
+// Send the upload and get the acknowledgement. The message is rendered
+// chunk by chunk, as the firmware does, and each chunk is sent on its own
+static bool
+send_upload (struct stats *st, uint32_t *backlog, const uint32_t current, uint32_t *ack)
+{
+	char response[RESPONSE_MAX + 1];
+	const uint64_t start = now_us();
+	size_t len, got = 0;
+	uint8_t *buf;
+	int fd;
+
+#if NET_UDP
+	const struct timeval timeout = { .tv_usec = NET_UDP_TIMEOUT_MS * 1000 };
+	uint8_t datagram[HTTP_CHUNK_SIZE];
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		return false;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	if (connect(fd, (struct sockaddr *) &server, sizeof(server)) < 0) {
+		close(fd);
+		return false;
+	}
+
+	st->uploads++;
+	enter(STATE_NET_CONNECT_DONE);
+	*backlog = http_post_start(*backlog, current);
+
+	// The payload must fit in one chunk:
+	len = http_post_next(&buf);
+	memcpy(datagram, buf, len);
+
+	if (len == 0 || http_post_next(&buf) != 0) {
+		close(fd);
+		return false;
+	}
+
+	// Send again until the acknowledgement echoes the magic and the CRC:
+	for (int attempt = 0; attempt <= NET_UDP_RETRIES && got == 0; attempt++) {
+		ssize_t n;
+
+		if (send(fd, datagram, len, 0) != (ssize_t) len)
+			break;
+
+		st->bytes += len;
+
+		while ((n = recv(fd, response, sizeof(response), 0)) >= 0)
+			if (n == NET_UDP_ACK_SIZE
+			 && memcmp(response, datagram, 2) == 0
+			 && memcmp(response + 2, datagram + len - 2, 2) == 0) {
+				const uint8_t *p = (const uint8_t *) response + 4;
+
+				*ack = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+				got = n;
+				break;
+			}
+	}
+
+	close(fd);
+	if (got == 0)
+		return false;
+#else
+	const struct timeval timeout = { .tv_sec = NET_CONNECT_TIMEOUT_MS / 1000 };
+	const struct timeval ack_timeout = { .tv_sec = NET_ACK_TIMEOUT_MS / 1000 };
+	const int one = 1;
+	ssize_t n;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return false;
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(fd, (struct sockaddr *) &server, sizeof(server)) < 0) {
+		close(fd);
+		return false;
+	}
+
+	st->uploads++;
+	enter(STATE_NET_CONNECT_DONE);
+	*backlog = http_post_start(*backlog, current);
+
+	while ((len = http_post_next(&buf)) > 0) {
+		if (send(fd, buf, len, MSG_NOSIGNAL) != (ssize_t) len) {
+			close(fd);
+			return false;
+		}
+
+		st->bytes += len;
+	}
+
+	// Read until the acknowledgement is in, the server closes, or time is
+	// up. The firmware closes the connection itself after that:
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &ack_timeout, sizeof(ack_timeout));
+
+	while (got < RESPONSE_MAX && (n = recv(fd, response + got, RESPONSE_MAX - got, 0)) > 0) {
+		got += n;
+		response[got] = '\0';
+
+		if (strstr(response, "\r\n\r\n") != NULL)
+			break;
+	}
+
+	close(fd);
+	response[got] = '\0';
+
+	if (!ack_parse(response, ack))
+		return false;
+#endif
+
+	st->latency[bucket(now_us() - start)]++;
+	return true;
+}
+
+// Whether a wifi setup attempt succeeds
+static bool
+wifi_up (const uint32_t clock)
+{
+	if (clock - sim_start >= (uint32_t) outage_start
+	 && clock - sim_start < (uint32_t) (outage_start + outage_len))
+		return false;
+
+	return chip_random() % 100 >= (uint32_t) wifi_fail;
+}
+
+// One wakeup of a probe, from reset to deep sleep, following main.c
+static void
+wake (struct probe *probe, struct stats *st)
+{
+	const struct rst_info reset = { .reason = probe->reason };
+	const bool warm = (probe->reason == REASON_DEEP_SLEEP_AWAKE);
+	uint32_t current, backlog, sleep_sec;
+	uint8_t wakeup = 0, round;
+	bool acked;
+
+	chip_select(&probe->chip);
+	probe->chip.clock    = probe->next;
+	probe->chip.awake_us = 0;
+
+	// Pick the state to crash in, if any:
+	crash_state = (chip_random() % 1000 < (uint32_t) crash * 10)
+		? chip_random() % STATE_NUM
+		: STATE_NUM;
+
+	// As on_init_done():
+	trace_init(&reset);
+	if (warm)
+		wakeup = rtc_mem_load();
+
+	power_init(warm);
+	flash_log_init(probe->reason != REASON_DEFAULT_RST);
+	schedule_init(warm);
+	fourier_init(warm);
+	sensors_plan(rtc_mem_clock());
+
+	// Read the sensors, retrying the rounds that missed some:
+	for (round = 0; ; round++) {
+		enter(STATE_SENSORS_START);
+		sensors_request(round);
+		enter(STATE_SENSORS_READOUT);
+		sensors_readout(round);
+		enter(STATE_SENSORS_DONE);
+
+		if (sensors_all_valid() || round >= power_retries(SENSORS_ROUNDS_MAX - 1))
+			break;
+	}
+
+	onewire_depower();
+	sensors_consolidate_samples();
+	schedule_update(sensors_record_data(), rtc_mem_clock());
+	fourier_update(sensors_record_data(), rtc_mem_clock());
+
+	if (wakeup + 1 < SENSORS_RECORDS_MAX) {
+		enter(STATE_SENSORS_SAVE);
+		rtc_mem_save(wakeup + 1);
+		goto sleep;
+	}
+
+	// Log the record, and upload if there's power:
+	enter(STATE_SENSORS_SEND);
+	sensors_consolidate_records();
+	current = flash_log_seq(flash_log_pending());
+	flash_log_append(sensors_record_data(), rtc_mem_clock());
+	rtc_mem_save(0);
+
+	if (!power_upload_due(flash_log_pending()))
+		goto sleep;
+
+	for (round = 0; ; round++) {
+		enter(STATE_WIFI_SETUP_START);
+
+		if (wifi_up(probe->chip.clock)) {
+			chip_delay(WIFI_SETUP_MS);
+			break;
+		}
+
+		chip_delay(WIFI_SETUP_TIMEOUT_MS);
+		enter(STATE_WIFI_SETUP_FAIL);
+
+		if (round >= power_retries(WIFI_ROUNDS)) {
+			st->wifi_down++;
+			goto shutdown;
+		}
+	}
+
+	enter(STATE_WIFI_SETUP_DONE);
+
+	// Drain the log while the server acknowledges:
+	for (uint8_t uploads = 0; ; ) {
+		uint32_t seq;
+
+		enter(STATE_NET_CONNECT_START);
+
+		backlog = flash_log_pending();
+		if (backlog > 0 && flash_log_seq(backlog - 1) == current)
+			backlog--;
+		if (backlog > FLASH_LOG_BATCH)
+			backlog = FLASH_LOG_BATCH;
+
+		acked = send_upload(st, &backlog, current, &seq) && seq == current;
+
+		if (acked) {
+			enter(STATE_NET_DATA_SENT);
+			flash_log_consume(backlog);
+			if (flash_log_pending() > 0 && flash_log_seq(0) == current)
+				flash_log_consume(1);
+			sensors_sent_update();
+			rtc_mem_sent_save();
+			trace_crash_clear();
+			st->acked++;
+			st->records += backlog + 1;
+		}
+		else {
+			enter(STATE_NET_CONNECT_FAIL);
+			st->failed++;
+		}
+
+		enter(STATE_NET_DISCONNECT_DONE);
+
+		if (!acked || flash_log_pending() == 0 || ++uploads >= FLASH_LOG_UPLOADS)
+			break;
+	}
+
+shutdown:
+	enter(STATE_WIFI_SHUTDOWN_START);
+	enter(STATE_WIFI_SHUTDOWN_DONE);
+
+sleep:
+	sleep_sec = schedule_interval();
+	rtc_mem_clock_save(sleep_sec);
+	probe->next   = probe->chip.clock + probe->chip.awake_us / 1000000 + sleep_sec;
+	probe->reason = REASON_DEEP_SLEEP_AWAKE;
+}
+
+// Wake the probes of a worker as they are due, until told to stop
+static void
+worker_run (const long w)
+{
+	struct stats *st = &stats[w];
+
+	while (!*stop) {
+		struct probe *probe = NULL;
+		uint64_t due, now;
+		int status;
+		pid_t pid;
+
+		// Find the probe that is due first:
+		for (long i = w; i < nprobes; i += nworkers)
+			if (probe == NULL || (int32_t) (probes[i].next - probe->next) < 0)
+				probe = &probes[i];
+
+		if (probe == NULL)
+			return;
+
+		due = real_time(probe->next);
+		if ((now = now_us()) < due) {
+			const uint64_t wait = (due - now < 100000) ? due - now : 100000;
+
+			usleep(wait);
+			continue;
+		}
+
+		st->wakeups++;
+		st->lag_sum += (now - due) / 1000;
+		if ((now - due) / 1000 > st->lag_max)
+			st->lag_max = (now - due) / 1000;
+
+		if ((pid = fork()) < 0) {
+			perror("fork");
+			return;
+		}
+
+		if (pid == 0) {
+			wake(probe, st);
+			_exit(0);
+		}
+
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+			;
+
+		// A crashed probe reboots right away:
+		if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_CRASH) {
+			probe->reason = REASON_WDT_RST;
+			st->crashes++;
+		}
+	}
+}
+
+// Add up the counters of all workers
+static void
+stats_sum (struct stats *sum)
+{
+	memset(sum, 0, sizeof(*sum));
+
+	for (long w = 0; w < nworkers; w++) {
+		const struct stats *st = &stats[w];
+
+		sum->wakeups   += st->wakeups;
+		sum->uploads   += st->uploads;
+		sum->acked     += st->acked;
+		sum->failed    += st->failed;
+		sum->records   += st->records;
+		sum->bytes     += st->bytes;
+		sum->wifi_down += st->wifi_down;
+		sum->crashes   += st->crashes;
+		sum->lag_sum   += st->lag_sum;
+		if (st->lag_max > sum->lag_max)
+			sum->lag_max = st->lag_max;
+
+		for (size_t i = 0; i < HIST_BUCKETS; i++)
+			sum->latency[i] += st->latency[i];
+	}
+}
+
+// Latency at a percentile, in ms
+static double
+percentile (const struct stats *sum, const double pct)
+{
+	const uint64_t rank = sum->acked * pct / 100;
+	uint64_t count = 0;
+
+	for (size_t i = 0; i < HIST_BUCKETS; i++)
+		if ((count += sum->latency[i]) > rank)
+			return bucket_top(i) / 1e3;
+
+	return 0;
+}
+
+static void
+report (const struct stats *sum, const double elapsed)
+{
+	printf("probes     %ld, %ld workers, %.0f s at %ldx\n", nprobes, nworkers, elapsed, speed);
+	printf("wakeups    %llu, %llu crashed, %llu without wifi\n",
+		(unsigned long long) sum->wakeups,
+		(unsigned long long) sum->crashes,
+		(unsigned long long) sum->wifi_down);
+	printf("uploads    %llu, %.1f/s, %.1f KB/s\n",
+		(unsigned long long) sum->uploads, sum->uploads / elapsed, sum->bytes / elapsed / 1024);
+	printf("acked      %llu, %.1f/s, %llu records\n",
+		(unsigned long long) sum->acked, sum->acked / elapsed,
+		(unsigned long long) sum->records);
+	printf("failed     %llu\n", (unsigned long long) sum->failed);
+	printf("latency    p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms\n",
+		percentile(sum, 50), percentile(sum, 90), percentile(sum, 99), percentile(sum, 99.9));
+	printf("lag        %.1f ms average, %llu ms max\n",
+		sum->wakeups ? (double) sum->lag_sum / sum->wakeups : 0,
+		(unsigned long long) sum->lag_max);
+
+	// A late start means the generator, not the server, is the limit:
+	if (sum->lag_max > 1000)
+		printf("Wakeups started late, more workers (-j) would help\n");
+}
+
+// Allocate shared memory
+static void *
+shared (const size_t size)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+static void
+usage (const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n probes] [-j workers] [-x speed] [-t seconds]\n"
+		"\t[-w wifi-fail-%%] [-e noise-%%] [-c crash-%%] [-o start,length] [-s] [-v]\n"
+		"\tserver [port]\n", name);
+	exit(1);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct stats sum, last = { 0 };
+	pid_t pids[WORKERS_MAX];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:j:x:t:w:e:c:o:sv")) != -1)
+		switch (opt) {
+		case 'n': nprobes   = atol(optarg); break;
+		case 'j': nworkers  = atol(optarg); break;
+		case 'x': speed     = atol(optarg); break;
+		case 't': seconds   = atol(optarg); break;
+		case 'w': wifi_fail = atol(optarg); break;
+		case 'e': noise     = atol(optarg); break;
+		case 'c': crash     = atol(optarg); break;
+		case 's': sync_start = true; break;
+		case 'v': chip_verbose(true); break;
+		case 'o':
+			if (sscanf(optarg, "%ld,%ld", &outage_start, &outage_len) != 2)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+
+	if (optind >= argc || nprobes < 1 || nworkers < 1 || nworkers > WORKERS_MAX || speed < 1 || seconds < 1)
+		usage(argv[0]);
+
+	server.sin_family = AF_INET;
+	server.sin_port   = htons((optind + 1 < argc) ? atoi(argv[optind + 1]) : (NET_UDP ? NET_UDP_PORT : REMOTE_PORT));
+
+	if (inet_pton(AF_INET, argv[optind], &server.sin_addr) != 1) {
+		fprintf(stderr, "%s: not an IPv4 address\n", argv[optind]);
+		return 1;
+	}
+
+	if ((probes = shared(nprobes * sizeof(*probes))) == NULL
+	 || (stats = shared(nworkers * sizeof(*stats))) == NULL
+	 || (stop = shared(sizeof(*stop))) == NULL) {
+		perror("mmap");
+		return 1;
+	}
+
+	sim_start  = time(NULL);
+	real_start = now_us();
+	srand(sim_start);
+
+	// Every probe starts with a cold boot, in a soil of its own:
+	for (long i = 0; i < nprobes; i++) {
+		struct chip *chip = &probes[i].chip;
+
+		chip->chipid = CHIPID_BASE + i;
+		chip->seed   = chip->chipid * 2654435761U | 1;
+		chip->vdd    = 3300 * 1024 / 1000;
+		chip->rssi   = -50 - rand() % 40;
+		chip->adc    = rand() % 1024;
+		chip->mean   = (5 + rand() % 10) * 16;
+		chip->swing  = (2 + rand() % 8) * 16;
+		chip->phase  = 14 * 3600 + rand() % 7200;
+		chip->noise  = noise;
+
+		probes[i].reason = REASON_DEFAULT_RST;
+		probes[i].next   = sim_start + (sync_start ? 0 : rand() % SCHEDULE_START_SEC);
+	}
+
+	for (long w = 0; w < nworkers; w++) {
+		if ((pids[w] = fork()) < 0) {
+			perror("fork");
+			return 1;
+		}
+
+		if (pids[w] == 0) {
+			worker_run(w);
+			_exit(0);
+		}
+	}
+
+	// Show progress every second:
+	for (long s = 1; s <= seconds; s++) {
+		sleep(1);
+		stats_sum(&sum);
+		fprintf(stderr, "%4ld s: %6llu uploads/s, %6llu acked/s, %6llu failed/s, p99 %.3f ms\n", s,
+			(unsigned long long) (sum.uploads - last.uploads),
+			(unsigned long long) (sum.acked - last.acked),
+			(unsigned long long) (sum.failed - last.failed),
+			percentile(&sum, 99));
+		last = sum;
+	}
+
+	*stop = true;
+
+	for (long w = 0; w < nworkers; w++)
+		waitpid(pids[w], NULL, 0);
+
+	stats_sum(&sum);
+	report(&sum, (now_us() - real_start) / 1e6);
+	return 0;
+}
@@ -0,0 +1,1319 @@
+// Ingest server for the firmware's HTTP uploads, for a fleet of probes. It
+// speaks what http.c sends: a HTTP/1.0 POST with the JSON body, or with the
+// compact binary body if the content type is application/octet-stream. Every
+// valid upload is written to stdout as JSON, leaving out the records that were
+// written before (see probe.c), and is acknowledged with an X-Ack header that
+// carries the sequence number of the current record. Given a directory, the
+// new readings also go into the time-series store there (see store.c), timed
+// by their age before the upload arrived. An upload that can't be stored is
+// answered with an error instead, and the probe sends it again later.
+//
+// With a store, every new upload is also appended to a write-ahead log in the
+// same directory (see wal.c), and is only acknowledged once the log is on
+// disk. The log is committed in groups, so one fdatasync covers all the
+// uploads of a millisecond or so. Every few seconds the store is synced and
+// the log up to there is dropped; after a crash, what is left of the log is
+// replayed into the store on startup.
+//
+// One worker runs per core, each with its own epoll loop and its own listening
+// socket on the same port, so that the kernel spreads the connections over the
+// workers with SO_REUSEPORT. Connections, their buffers and the decoding state
+// are allocated once per worker at startup. A request is parsed in place in
+// its connection buffer, and a JSON body is written out from there. Output is
+// flushed once per round of events, after which the uploads of that round are
+// acknowledged, so that nothing is acknowledged before it is written.
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "net.h"
+#include "fourier.h"
+#include "packed.h"
+#include "trace.h"
+#include "payload.h"
+#include "probe.h"
+#include "sensor_table.h"
+#include "store.h"
+#include "wal.h"
+
+// Largest request we accept, header and body. A connection's buffer holds the
+// whole request:
+#define REQUEST_MAX	32768
+
+// Connections per worker, events handled per round, and the number of seconds
+// a connection may stay idle:
+#define CONNS_MAX	1024
+#define EVENTS_MAX	256
+#define IDLE_SEC	10
+
+// Seconds between checkpoints, that sync the time-series store and drop the
+// write-ahead log up to there:
+#define SYNC_SEC	5
+
+// Largest number of logged records in a JSON body, and the deepest nesting:
+#define BACKLOG_MAX	256
+#define DEPTH_MAX	16
+
+// Response status lines:
+static const char status_ok[]		= "200 OK";
+static const char status_bad_request[]	= "400 Bad Request";
+static const char status_not_allowed[]	= "405 Method Not Allowed";
+static const char status_no_length[]	= "411 Length Required";
+static const char status_too_large[]	= "413 Payload Too Large";
+static const char status_unavailable[]	= "503 Service Unavailable";
+
+// A piece of text in a request:
+struct span {
+	const char	*p;
+	size_t		len;
+};
+
+// A logged record in a JSON body, from its opening to its closing brace:
+struct element {
+	const char	*start;
+	const char	*end;
+	const char	*sensors;	// Sensors object
+	uint32_t	seq;
+	uint32_t	age;		// Seconds before the upload, if known
+	bool		fresh;
+};
+
+// Fields that a JSON body must have:
+enum {
+	FIELD_SENSORS	= 1 << 0,
+	FIELD_SEQ	= 1 << 1,
+	FIELD_EPOCH	= 1 << 2,
+	FIELD_CHIPID	= 1 << 3,
+	FIELD_MILLIVOLT	= 1 << 4,
+	FIELD_RSSI	= 1 << 5,
+	FIELD_ADC	= 1 << 6,
+	FIELD_ALL	= (1 << 7) - 1,
+};
+
+// A JSON body, parsed in place:
+struct body {
+	unsigned	fields;		// Fields found
+	uint32_t	seq;		// Sequence number of the current record
+	uint32_t	epoch;		// Epoch of the sequence numbers
+	uint32_t	chipid;
+	const char	*sensors;	// Sensors object of the current record
+	const char	*backlog_sep;	// End of the member before the backlog
+	const char	*backlog_open;	// Opening bracket of the backlog
+	const char	*backlog_end;	// Just past its closing bracket
+	size_t		nbacklog;
+	struct element	backlog[BACKLOG_MAX];
+};
+
+// A client connection. It is free if its descriptor is negative:
+struct conn {
+	int		fd;
+	time_t		active;		// Time of last activity
+	size_t		len;		// Bytes in the buffer
+	size_t		head_len;	// Length of the header, zero until complete
+	size_t		body_len;	// Length of the body, from the header
+	bool		binary;		// Whether the body is the binary payload
+	const char	*status;	// Response status, NULL while reading
+	uint32_t	ack;		// Sequence number to acknowledge
+	uint64_t	lsn;		// Log position to wait for before that
+	struct conn	*next;		// In the free list, or the response list
+	char		addr[INET_ADDRSTRLEN];
+	char		buf[REQUEST_MAX];
+};
+
+// A worker, with its own listening socket and event loop:
+struct worker {
+	pthread_t	thread;
+	int		lfd;
+	int		efd;
+	int		wake;		// Event from the log's commit thread
+	int		spare;		// Descriptor kept to turn clients away
+	time_t		now;
+	time_t		shed;		// Time clients were last turned away
+	time_t		swept;		// Time of the last idle sweep
+	bool		written;	// Output written this round
+	struct conn	*free;
+	struct conn	*done;		// Waiting for their response
+	struct conn	conns[CONNS_MAX];
+	struct body	body;
+	struct payload	pl;
+};
+
+static struct worker *workers;
+static long nworkers;
+
+// The table of probes, the time-series store and its log are shared by the
+// workers. The store locks each rod by itself. A request holds the apply lock
+// shared from appending an upload to the log until the upload is in the
+// store, and a checkpoint holds it alone to start a new segment of the log;
+// writers go first, so that a checkpoint doesn't wait for a quiet moment:
+static pthread_mutex_t probes_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t apply_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct store *store = NULL;
+static struct wal *wal = NULL;
+static time_t synced;
+static uint64_t checkpointed;	// Log position at the last checkpoint
+
+// Parser position in a JSON body:
+struct parser {
+	const char	*p;
+	const char	*end;
+};
+
+static void
+skip_ws (struct parser *ps)
+{
+	while (ps->p < ps->end && (*ps->p == ' ' || *ps->p == '\n' || *ps->p == '\r' || *ps->p == '\t'))
+		ps->p++;
+}
+
+// Check for a character after optional whitespace
+static bool
+peek (struct parser *ps, const char c)
+{
+	skip_ws(ps);
+	return ps->p < ps->end && *ps->p == c;
+}
+
+// Consume a character after optional whitespace
+static bool
+expect (struct parser *ps, const char c)
+{
+	if (!peek(ps, c))
+		return false;
+
+	ps->p++;
+	return true;
+}
+
+// Parse a string, and return its contents. Escapes are skipped, not decoded:
+static bool
+parse_string (struct parser *ps, struct span *s)
+{
+	if (!expect(ps, '"'))
+		return false;
+
+	for (s->p = ps->p; ps->p < ps->end; ps->p++) {
+		const unsigned char c = *ps->p;
+
+		if (c == '"') {
+			s->len = ps->p++ - s->p;
+			return true;
+		}
+
+		if (c < 0x20)
+			return false;
+
+		if (c == '\\' && ++ps->p == ps->end)
+			return false;
+	}
+
+	return false;
+}
+
+static bool parse_value (struct parser *ps, const int depth);
+
+// Parse the members of an object or the elements of an array, after the
+// opening brace or bracket
+static bool
+parse_members (struct parser *ps, const char close, const int depth)
+{
+	struct span key;
+
+	if (depth > DEPTH_MAX)
+		return false;
+
+	if (expect(ps, close))
+		return true;
+
+	do {
+		if (close == '}' && (!parse_string(ps, &key) || !expect(ps, ':')))
+			return false;
+
+		if (!parse_value(ps, depth))
+			return false;
+	}
+	while (expect(ps, ','));
+
+	return expect(ps, close);
+}
+
+// Parse any value. Numbers and literals are only checked loosely, the
+// firmware sends every value as a string:
+static bool
+parse_value (struct parser *ps, const int depth)
+{
+	struct span s;
+
+	skip_ws(ps);
+
+	if (ps->p == ps->end)
+		return false;
+
+	switch (*ps->p)
+	{
+	case '"':
+		return parse_string(ps, &s);
+
+	case '{':
+		ps->p++;
+		return parse_members(ps, '}', depth + 1);
+
+	case '[':
+		ps->p++;
+		return parse_members(ps, ']', depth + 1);
+
+	default:
+		for (s.p = ps->p; ps->p < ps->end; ps->p++)
+			if (!isalnum((unsigned char) *ps->p) && *ps->p != '-' && *ps->p != '+' && *ps->p != '.')
+				break;
+
+		return ps->p > s.p;
+	}
+}
+
+static inline bool
+span_is (const struct span *s, const char *str)
+{
+	return s->len == strlen(str) && memcmp(s->p, str, s->len) == 0;
+}
+
+// Convert a string of digits to an unsigned value
+static bool
+span_uint (const struct span *s, uint32_t *val)
+{
+	uint64_t v = 0;
+
+	if (s->len == 0 || s->len > 10)
+		return false;
+
+	for (size_t i = 0; i < s->len; i++) {
+		if (s->p[i] < '0' || s->p[i] > '9')
+			return false;
+
+		v = v * 10 + (s->p[i] - '0');
+	}
+
+	if (v > UINT32_MAX)
+		return false;
+
+	*val = v;
+	return true;
+}
+
+// Convert a string of digits with an optional sign
+static bool
+span_int (const struct span *s)
+{
+	struct span digits = *s;
+	uint32_t val;
+
+	if (digits.len > 0 && digits.p[0] == '-') {
+		digits.p++;
+		digits.len--;
+	}
+
+	return span_uint(&digits, &val);
+}
+
+// Parse a string member holding a number, and flag it as found
+static bool
+parse_number (struct parser *ps, struct body *b, const unsigned field, uint32_t *val)
+{
+	struct span s;
+	uint32_t dummy;
+
+	if (!parse_string(ps, &s))
+		return false;
+
+	if (field == FIELD_RSSI ? !span_int(&s) : !span_uint(&s, val ? val : &dummy))
+		return false;
+
+	b->fields |= field;
+	return true;
+}
+
+// Parse a logged record, which must have a sequence number and sensors
+static bool
+parse_record (struct parser *ps, struct element *e)
+{
+	bool has_seq = false;
+	struct span key, val;
+
+	skip_ws(ps);
+	e->start   = ps->p;
+	e->sensors = NULL;
+	e->age     = PACKED_UNDATED;
+
+	if (!expect(ps, '{'))
+		return false;
+
+	do {
+		if (!parse_string(ps, &key) || !expect(ps, ':'))
+			return false;
+
+		if (span_is(&key, "seq")) {
+			if (!parse_string(ps, &val) || !span_uint(&val, &e->seq))
+				return false;
+
+			has_seq = true;
+		}
+		else if (span_is(&key, "age")) {
+			if (!parse_string(ps, &val) || !span_uint(&val, &e->age))
+				return false;
+		}
+		else if (span_is(&key, "sensors")) {
+			if (!peek(ps, '{'))
+				return false;
+
+			e->sensors = ps->p;
+			if (!parse_value(ps, 2))
+				return false;
+		}
+		else if (!parse_value(ps, 2))
+			return false;
+	}
+	while (expect(ps, ','));
+
+	if (!expect(ps, '}'))
+		return false;
+
+	e->end = ps->p;
+	return has_seq && e->sensors != NULL;
+}
+
+// Parse the array of logged records
+static const char *
+parse_backlog (struct parser *ps, struct body *b)
+{
+	skip_ws(ps);
+	b->backlog_open = ps->p;
+
+	if (!expect(ps, '['))
+		return "backlog is not an array";
+
+	if (!expect(ps, ']')) {
+		do {
+			if (b->nbacklog == BACKLOG_MAX)
+				return "backlog too long";
+
+			if (!parse_record(ps, &b->backlog[b->nbacklog++]))
+				return "invalid backlog record";
+		}
+		while (expect(ps, ','));
+
+		if (!expect(ps, ']'))
+			return "invalid backlog";
+	}
+
+	b->backlog_end = ps->p;
+	return NULL;
+}
+
+// Parse a JSON body in place, return an error message or NULL
+static const char *
+body_parse (struct body *b, const char *buf, const size_t len)
+{
+	struct parser ps = { buf, buf + len };
+	const char *prev = NULL;
+	const char *err;
+	struct span key;
+	bool ok;
+
+	b->fields       = 0;
+	b->nbacklog     = 0;
+	b->backlog_open = NULL;
+
+	if (!expect(&ps, '{'))
+		return "body is not an object";
+
+	do {
+		if (!parse_string(&ps, &key) || !expect(&ps, ':'))
+			return "invalid member";
+
+		if (span_is(&key, "sensors")) {
+			ok = peek(&ps, '{');
+			b->sensors = ps.p;
+			ok = ok && parse_value(&ps, 1);
+			b->fields |= FIELD_SENSORS;
+		}
+		else if (span_is(&key, "seq"))
+			ok = parse_number(&ps, b, FIELD_SEQ, &b->seq);
+		else if (span_is(&key, "epoch"))
+			ok = parse_number(&ps, b, FIELD_EPOCH, &b->epoch);
+		else if (span_is(&key, "chipid"))
+			ok = parse_number(&ps, b, FIELD_CHIPID, &b->chipid);
+		else if (span_is(&key, "millivolt"))
+			ok = parse_number(&ps, b, FIELD_MILLIVOLT, NULL);
+		else if (span_is(&key, "rssi"))
+			ok = parse_number(&ps, b, FIELD_RSSI, NULL);
+		else if (span_is(&key, "adc"))
+			ok = parse_number(&ps, b, FIELD_ADC, NULL);
+		else if (span_is(&key, "backlog") && b->backlog_open == NULL) {
+			if ((err = parse_backlog(&ps, b)) != NULL)
+				return err;
+
+			b->backlog_sep = prev;
+			ok = true;
+		}
+		else
+			ok = parse_value(&ps, 1);
+
+		if (!ok)
+			return "invalid value";
+
+		prev = ps.p;
+	}
+	while (expect(&ps, ','));
+
+	if (!expect(&ps, '}'))
+		return "invalid object";
+
+	skip_ws(&ps);
+	if (ps.p != ps.end)
+		return "trailing data";
+
+	if (b->fields != FIELD_ALL)
+		return "missing fields";
+
+	return NULL;
+}
+
+// Mark the records of a JSON body as seen, return false if none are new. As
+// for the binary payload, the current record is kept if any record is new:
+static bool
+body_dedup (struct body *b)
+{
+	struct probe *probe = probe_find(b->chipid);
+	bool fresh = false;
+
+	if (probe != NULL)
+		probe_epoch(probe, b->epoch);
+
+	for (size_t i = 0; i < b->nbacklog; i++) {
+		b->backlog[i].fresh = (probe == NULL) || !probe_seen(probe, b->backlog[i].seq);
+		fresh |= b->backlog[i].fresh;
+	}
+
+	if (probe == NULL || !probe_seen(probe, b->seq))
+		return true;
+
+	return fresh;
+}
+
+// Write a JSON body without the records that were seen before, piecing it
+// together from the original
+static void
+body_write (FILE *out, const struct body *b, const char *buf, const size_t len)
+{
+	const char *end = buf + len;
+	size_t nfresh = 0;
+
+	for (size_t i = 0; i < b->nbacklog; i++)
+		if (b->backlog[i].fresh)
+			nfresh++;
+
+	if (nfresh == b->nbacklog) {
+		fwrite(buf, 1, len, out);
+		return;
+	}
+
+	// Leave out the backlog altogether:
+	if (nfresh == 0 && b->backlog_sep != NULL) {
+		fwrite(buf, 1, b->backlog_sep - buf, out);
+		fwrite(b->backlog_end, 1, end - b->backlog_end, out);
+		return;
+	}
+
+	fwrite(buf, 1, b->backlog_open + 1 - buf, out);
+
+	for (size_t i = 0, n = 0; i < b->nbacklog; i++) {
+		const struct element *e = &b->backlog[i];
+
+		if (!e->fresh)
+			continue;
+
+		fputs((n++ == 0) ? "\n  " : "\n, ", out);
+		fwrite(e->start, 1, e->end - e->start, out);
+	}
+
+	fputs((nfresh > 0) ? "\n]" : "]", out);
+	fwrite(b->backlog_end, 1, end - b->backlog_end, out);
+}
+
+// Parse a sensor ROM address, as eight colon-separated hex bytes
+static bool
+span_rom (const struct span *s, uint8_t *rom)
+{
+	if (s->len != 23)
+		return false;
+
+	for (size_t i = 0; i < 8; i++) {
+		unsigned val = 0;
+
+		for (size_t j = 0; j < 2; j++) {
+			const char c = s->p[i * 3 + j];
+
+			val <<= 4;
+			if (c >= '0' && c <= '9')
+				val |= c - '0';
+			else if (c >= 'a' && c <= 'f')
+				val |= c - 'a' + 10;
+			else
+				return false;
+		}
+
+		if (i < 7 && s->p[i * 3 + 2] != ':')
+			return false;
+
+		rom[i] = val;
+	}
+
+	return true;
+}
+
+// Store the readings of a sensors object in a JSON body, which was already
+// checked by body_parse(). The values are in degrees C * 10000; the store
+// keeps them at sensor resolution. Returns false if the store failed:
+static bool
+store_sensors (struct store_rod *rod, const char *sensors, const char *end, const uint32_t time)
+{
+	struct parser ps = { sensors, end };
+	struct span key, val;
+
+	expect(&ps, '{');
+
+	if (expect(&ps, '}'))
+		return true;
+
+	do {
+		uint8_t rom[8], status = 0;
+		uint32_t age = 0;
+		int32_t value = 0;
+		int series;
+
+		if (!parse_string(&ps, &key) || !expect(&ps, ':') || !expect(&ps, '{'))
+			return true;
+
+		do {
+			struct span name;
+
+			if (!parse_string(&ps, &name) || !expect(&ps, ':') || !parse_string(&ps, &val))
+				return true;
+
+			if (span_is(&name, "value"))
+				value = strtol(val.p, NULL, 10);
+			else if (span_is(&name, "status"))
+				status = payload_status(val.p, val.len);
+			else if (span_is(&name, "age"))
+				span_uint(&val, &age);
+		}
+		while (expect(&ps, ','));
+
+		if (!expect(&ps, '}'))
+			return true;
+
+		if (!span_rom(&key, rom) || status == 0 || (series = store_series(rod, rom, true)) < 0)
+			continue;
+
+		value = (value >= 0) ? (value + 312) / 625 : (value - 312) / 625;
+		if (!store_append(rod, series, time - age, value, status))
+			return false;
+	}
+	while (expect(&ps, ','));
+
+	return true;
+}
+
+// Store the new records of a JSON body, return false if the store failed.
+// Records without an age were logged before the probe's clock started over,
+// and have no place in time, so they are left out:
+static bool
+store_body (const struct body *b, const char *end, const uint32_t now)
+{
+	struct store_rod *rod;
+	bool ok;
+
+	if ((rod = store_rod(store, b->chipid, true)) == NULL)
+		return false;
+
+	ok = store_sensors(rod, b->sensors, end, now);
+
+	for (size_t i = 0; ok && i < b->nbacklog; i++)
+		if (b->backlog[i].fresh && b->backlog[i].age != PACKED_UNDATED && !store_sensors(rod, b->backlog[i].sensors, end, now - b->backlog[i].age))
+			ok = false;
+
+	store_release(rod);
+	return ok;
+}
+
+// Store the new records of a binary payload, in 1/16 degrees C already,
+// leaving out the ones without an age. Returns false if the store failed
+static bool
+store_payload (const struct payload *pl, const uint32_t now)
+{
+	struct store_rod *rod;
+	bool ok = true;
+
+	if ((rod = store_rod(store, pl->chipid, true)) == NULL)
+		return false;
+
+	for (size_t sensor = 0; ok && sensor < pl->nsensors; sensor++) {
+		const int series = store_series(rod, sensors[sensor], true);
+
+		for (size_t i = 0; ok && i < pl->nrecords; i++) {
+			const struct record *r = &pl->record[i];
+
+			if (series >= 0 && r->status[sensor] != 0 && r->age != PACKED_UNDATED
+			 && !store_append(rod, series, now - r->age - r->carried[sensor], r->reading[sensor], r->status[sensor]))
+				ok = false;
+		}
+	}
+
+	store_release(rod);
+	return ok;
+}
+
+// Forget the new records of an upload that couldn't be stored, so that they
+// are taken when the probe sends them again
+static void
+forget_payload (const struct payload *pl)
+{
+	struct probe *probe = probe_find(pl->chipid);
+
+	for (size_t i = 0; probe != NULL && i < pl->nrecords; i++)
+		probe_forget(probe, pl->record[i].seq);
+}
+
+static void
+forget_body (const struct body *b)
+{
+	struct probe *probe = probe_find(b->chipid);
+
+	if (probe == NULL)
+		return;
+
+	for (size_t i = 0; i < b->nbacklog; i++)
+		if (b->backlog[i].fresh)
+			probe_forget(probe, b->backlog[i].seq);
+
+	probe_forget(probe, b->seq);
+}
+
+// Queue a response, to be sent once the output is flushed
+static void
+respond (struct worker *w, struct conn *c, const char *status)
+{
+	if (status != status_ok)
+		fprintf(stderr, "%s: %s\n", c->addr, status);
+
+	c->status = status;
+	c->lsn    = 0;
+	c->next   = w->done;
+	w->done   = c;
+}
+
+// Handle a complete request
+static void
+request_handle (struct worker *w, struct conn *c)
+{
+	const char *body = c->buf + c->head_len;
+	const uint32_t now = time(NULL);
+	const char *err;
+	bool fresh, stored = true;
+	uint64_t lsn = 0;
+
+	if (c->binary) {
+		if ((err = payload_decode(&w->pl, (const uint8_t *) body, c->body_len)) != NULL) {
+			fprintf(stderr, "%s: %s\n", c->addr, err);
+			respond(w, c, status_bad_request);
+			return;
+		}
+
+		c->ack = w->pl.record[w->pl.nrecords - 1].seq;
+
+		pthread_mutex_lock(&probes_lock);
+		fresh = probe_dedup(&w->pl) > 0;
+		pthread_mutex_unlock(&probes_lock);
+
+		if (fresh && store != NULL) {
+			pthread_rwlock_rdlock(&apply_lock);
+			if (wal != NULL)
+				lsn = wal_append(wal, now, c->binary, body, c->body_len);
+			stored = store_payload(&w->pl, now);
+			pthread_rwlock_unlock(&apply_lock);
+		}
+
+		if (!stored) {
+			pthread_mutex_lock(&probes_lock);
+			forget_payload(&w->pl);
+			pthread_mutex_unlock(&probes_lock);
+		}
+		else if (fresh) {
+			flockfile(stdout);
+			payload_json(stdout, &w->pl);
+			funlockfile(stdout);
+		}
+	}
+	else {
+		if ((err = body_parse(&w->body, body, c->body_len)) != NULL) {
+			fprintf(stderr, "%s: %s\n", c->addr, err);
+			respond(w, c, status_bad_request);
+			return;
+		}
+
+		c->ack = w->body.seq;
+
+		pthread_mutex_lock(&probes_lock);
+		fresh = body_dedup(&w->body);
+		pthread_mutex_unlock(&probes_lock);
+
+		if (fresh && store != NULL) {
+			pthread_rwlock_rdlock(&apply_lock);
+			if (wal != NULL)
+				lsn = wal_append(wal, now, c->binary, body, c->body_len);
+			stored = store_body(&w->body, body + c->body_len, now);
+			pthread_rwlock_unlock(&apply_lock);
+		}
+
+		if (!stored) {
+			pthread_mutex_lock(&probes_lock);
+			forget_body(&w->body);
+			pthread_mutex_unlock(&probes_lock);
+		}
+		else if (fresh) {
+			flockfile(stdout);
+			body_write(stdout, &w->body, body, c->body_len);
+			funlockfile(stdout);
+		}
+	}
+
+	// Don't acknowledge what isn't kept, the probe sends it again:
+	if (!stored) {
+		respond(w, c, status_unavailable);
+		return;
+	}
+
+	if (!fresh)
+		fprintf(stderr, "%s: duplicate %u\n", c->addr, c->ack);
+
+	w->written |= fresh;
+	respond(w, c, status_ok);
+
+	// Acknowledge the upload once it's on disk in the log. A duplicate may
+	// still be on its way to disk with the original:
+	if (wal != NULL)
+		c->lsn = fresh ? lsn : wal_appended(wal);
+}
+
+// Apply an upload from the log to the store on startup. The log is kept if
+// any upload couldn't be stored:
+static bool replayed = true;
+
+static void
+replay (void *arg, const uint32_t time, const bool binary, const uint8_t *body, const size_t len)
+{
+	struct worker *w = arg;
+
+	if (binary) {
+		if (payload_decode(&w->pl, body, len) == NULL && probe_dedup(&w->pl) > 0 && !store_payload(&w->pl, time))
+			replayed = false;
+	}
+	else {
+		const char *json = (const char *) body;
+
+		if (body_parse(&w->body, json, len) == NULL && body_dedup(&w->body) && !store_body(&w->body, json + len, time))
+			replayed = false;
+	}
+}
+
+// Wake up the workers after a commit of the log
+static void
+on_commit (void *arg)
+{
+	(void) arg;
+
+	for (long i = 0; i < nworkers; i++)
+		eventfd_write(workers[i].wake, 1);
+}
+
+// Parse the request header, return an error status or NULL
+static const char *
+header_parse (struct conn *c)
+{
+	const char *end = c->buf + c->head_len;
+	const char *line;
+	bool has_length = false;
+
+	if (c->head_len < 5 || memcmp(c->buf, "POST ", 5) != 0)
+		return status_not_allowed;
+
+	// The header ends with an empty line, so every line ends before it:
+	for (line = c->buf; (line = (const char *) memchr(line, '\n', end - line) + 1) < end; ) {
+		if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			char *p;
+
+			c->body_len = strtoul(line + 15, &p, 10);
+			if (*p != '\r')
+				return status_bad_request;
+
+			has_length = true;
+		}
+		else if (strncasecmp(line, "Content-Type:", 13) == 0) {
+			const char *p = line + 13;
+
+			while (*p == ' ')
+				p++;
+
+			c->binary = strncasecmp(p, "application/octet-stream", 24) == 0;
+		}
+	}
+
+	if (!has_length)
+		return status_no_length;
+
+	if (c->body_len > sizeof(c->buf) - c->head_len)
+		return status_too_large;
+
+	return NULL;
+}
+
+// Check whether the request is complete, and handle it
+static void
+request_check (struct worker *w, struct conn *c)
+{
+	const char *status;
+
+	if (c->head_len == 0) {
+		const char *end = memmem(c->buf, c->len, "\r\n\r\n", 4);
+
+		if (end == NULL) {
+			if (c->len == sizeof(c->buf))
+				respond(w, c, status_too_large);
+			return;
+		}
+
+		c->head_len = end + 4 - c->buf;
+
+		if ((status = header_parse(c)) != NULL) {
+			respond(w, c, status);
+			return;
+		}
+	}
+
+	if (c->len >= c->head_len + c->body_len)
+		request_handle(w, c);
+}
+
+static void
+conn_close (struct worker *w, struct conn *c)
+{
+	close(c->fd);
+	c->fd   = -1;
+	c->next = w->free;
+	w->free = c;
+}
+
+// Read what's available, and handle the request once it's complete
+static void
+conn_read (struct worker *w, struct conn *c)
+{
+	bool eof = false;
+	ssize_t n;
+
+	while (c->len < sizeof(c->buf)) {
+		if ((n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0)) > 0) {
+			c->len += n;
+			continue;
+		}
+
+		if (n == 0)
+			eof = true;
+		else if (errno == EINTR)
+			continue;
+		else if (errno != EAGAIN && errno != EWOULDBLOCK)
+			eof = true;
+
+		break;
+	}
+
+	c->active = w->now;
+	request_check(w, c);
+
+	// The client gave up before sending the whole request:
+	if (eof && c->status == NULL)
+		conn_close(w, c);
+}
+
+// Accept all pending connections
+static void
+conn_accept (struct worker *w)
+{
+	for (;;) {
+		struct sockaddr_in addr;
+		socklen_t addrlen = sizeof(addr);
+		struct epoll_event ev;
+		struct conn *c;
+		int fd;
+
+		if ((fd = accept4(w->lfd, (struct sockaddr *) &addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			// Out of descriptors, the connection stays queued and
+			// the listener stays readable. Accept it on the spare
+			// descriptor and close it, rather than spin:
+			if ((errno == EMFILE || errno == ENFILE) && w->spare >= 0) {
+				if (w->now != w->shed) {
+					perror("accept, turning clients away");
+					w->shed = w->now;
+				}
+
+				close(w->spare);
+				if ((fd = accept4(w->lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+					close(fd);
+				w->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+				if (fd >= 0)
+					continue;
+			}
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+
+			return;
+		}
+
+		// Turn the client away if all connections are in use:
+		if ((c = w->free) == NULL) {
+			close(fd);
+			continue;
+		}
+
+		w->free     = c->next;
+		c->fd       = fd;
+		c->active   = w->now;
+		c->len      = 0;
+		c->head_len = 0;
+		c->body_len = 0;
+		c->binary   = false;
+		c->status   = NULL;
+		inet_ntop(AF_INET, &addr.sin_addr, c->addr, sizeof(c->addr));
+
+		ev.events   = EPOLLIN;
+		ev.data.ptr = c;
+
+		if (epoll_ctl(w->efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("epoll_ctl");
+			conn_close(w, c);
+		}
+	}
+}
+
+// Flush the output of this round, then send the responses whose uploads
+// are in the log on disk. The others wait for a later round
+static void
+respond_all (struct worker *w)
+{
+	const uint64_t durable = (wal != NULL) ? wal_durable(wal) : 0;
+	struct conn **next = &w->done;
+	char msg[128];
+	int len;
+
+	if (w->written)
+		fflush(stdout);
+
+	while (*next != NULL) {
+		struct conn *c = *next;
+
+		if (c->lsn > durable) {
+			next = &c->next;
+			continue;
+		}
+
+		*next = c->next;
+
+		len = (c->status == status_ok)
+			? snprintf(msg, sizeof(msg), "HTTP/1.0 %s\r\nX-Ack: %u\r\nContent-Length: 0\r\n\r\n", c->status, c->ack)
+			: snprintf(msg, sizeof(msg), "HTTP/1.0 %s\r\nContent-Length: 0\r\n\r\n", c->status);
+
+		// The response fits in an empty socket buffer; if it can't be
+		// sent, the client has to try again anyway:
+		if (send(c->fd, msg, len, MSG_NOSIGNAL) != len)
+			fprintf(stderr, "%s: response not sent\n", c->addr);
+
+		conn_close(w, c);
+	}
+
+	w->written = false;
+}
+
+// Sync the store, and drop the segments of the log that it now holds.
+//
+// An upload goes into the log before it goes into the store, and is only
+// acknowledged once its log record is on disk, so an acknowledged upload is
+// always in the log or in a synced store. It may be in the log and not in the
+// store, if the store failed; the probe then sends it again, and replaying it
+// after a crash is harmless, as it's taken only once. The old segments may be
+// dropped once the store holds everything in them. Starting the new segment
+// under the apply lock makes sure that every upload in the old ones has
+// reached the store by then, so the sync that follows covers them all
+static void
+checkpoint (void)
+{
+	uint64_t appended;
+	uint32_t segment;
+
+	pthread_rwlock_wrlock(&apply_lock);
+
+	if ((appended = wal_appended(wal)) == checkpointed) {
+		pthread_rwlock_unlock(&apply_lock);
+		return;
+	}
+
+	segment = wal_rotate(wal);
+	pthread_rwlock_unlock(&apply_lock);
+
+	if (!store_sync(store)) {
+		perror("store_sync");
+		return;
+	}
+
+	wal_remove(wal, segment);
+	checkpointed = appended;
+}
+
+// Close the connections that have been idle too long
+static void
+sweep (struct worker *w)
+{
+	if (w->now == w->swept)
+		return;
+
+	for (size_t i = 0; i < CONNS_MAX; i++) {
+		struct conn *c = &w->conns[i];
+
+		if (c->fd >= 0 && c->status == NULL && w->now - c->active > IDLE_SEC)
+			conn_close(w, c);
+	}
+
+	w->swept = w->now;
+
+	// Checkpoint now and then:
+	if (store != NULL) {
+		pthread_mutex_lock(&checkpoint_lock);
+		if (w->now - synced >= SYNC_SEC) {
+			checkpoint();
+			synced = w->now;
+		}
+		pthread_mutex_unlock(&checkpoint_lock);
+	}
+}
+
+static time_t
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+static void *
+worker_run (void *arg)
+{
+	struct worker *w = arg;
+	struct epoll_event events[EVENTS_MAX];
+
+	for (;;) {
+		int n = epoll_wait(w->efd, events, EVENTS_MAX, 1000);
+
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			break;
+		}
+
+		w->now = now();
+
+		for (int i = 0; i < n; i++) {
+			struct conn *c = events[i].data.ptr;
+
+			if (c == NULL)
+				conn_accept(w);
+			else if ((void *) c == (void *) w)
+				eventfd_read(w->wake, &(eventfd_t) { 0 });
+			else if (c->fd >= 0 && c->status == NULL)
+				conn_read(w, c);
+		}
+
+		respond_all(w);
+		sweep(w);
+	}
+
+	return NULL;
+}
+
+// Open a worker's listening socket and event loop
+static bool
+worker_open (struct worker *w, const uint16_t port)
+{
+	struct sockaddr_in addr = {
+		.sin_family		= AF_INET,
+		.sin_port		= htons(port),
+		.sin_addr.s_addr	= htonl(INADDR_ANY),
+	};
+	struct epoll_event ev = {
+		.events			= EPOLLIN,
+		.data.ptr		= NULL,
+	};
+	const int one = 1;
+
+	if ((w->lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket");
+		return false;
+	}
+
+	setsockopt(w->lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (setsockopt(w->lfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+		perror("SO_REUSEPORT");
+		return false;
+	}
+
+	if (bind(w->lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("bind");
+		return false;
+	}
+
+	if (listen(w->lfd, SOMAXCONN) < 0) {
+		perror("listen");
+		return false;
+	}
+
+	if ((w->efd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1");
+		return false;
+	}
+
+	if (epoll_ctl(w->efd, EPOLL_CTL_ADD, w->lfd, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+
+	// The log's commit thread wakes the worker through an event:
+	if ((w->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		perror("eventfd");
+		return false;
+	}
+
+	ev.data.ptr = w;
+	if (epoll_ctl(w->efd, EPOLL_CTL_ADD, w->wake, &ev) < 0) {
+		perror("epoll_ctl");
+		return false;
+	}
+
+	// Keep a descriptor in reserve for when we run out:
+	if ((w->spare = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+		perror("/dev/null");
+		return false;
+	}
+
+	// Chain all connections into the free list:
+	w->free = NULL;
+	for (size_t i = CONNS_MAX; i-- > 0; ) {
+		w->conns[i].fd   = -1;
+		w->conns[i].next = w->free;
+		w->free = &w->conns[i];
+	}
+
+	w->now = w->swept = now();
+	return true;
+}
+
+int
+main (int argc, char **argv)
+{
+	const uint16_t port = (argc > 1) ? atoi(argv[1]) : REMOTE_PORT;
+	struct rlimit rl;
+
+	nworkers = (argc > 2) ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (nworkers < 1) {
+		fprintf(stderr, "Usage: %s [port [workers [store]]]\n", argv[0]);
+		return 1;
+	}
+
+	if ((workers = calloc(nworkers, sizeof(*workers))) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	// Allow as many open files as we may, the store keeps a share of them
+	// open for the probes:
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (argc > 3 && (store = store_open(argv[3], true)) == NULL) {
+		perror(argv[3]);
+		return 1;
+	}
+
+	// Replay what is left of the log into the store, then drop it:
+	if (store != NULL) {
+		if ((wal = wal_open(argv[3], replay, &workers[0])) == NULL) {
+			perror(argv[3]);
+			return 1;
+		}
+
+		if (!replayed) {
+			fprintf(stderr, "%s: couldn't replay the log into the store\n", argv[3]);
+			return 1;
+		}
+
+		if (!store_sync(store)) {
+			perror("store_sync");
+			return 1;
+		}
+
+		wal_remove(wal, UINT32_MAX);
+	}
+
+	for (long i = 0; i < nworkers; i++)
+		if (!worker_open(&workers[i], port))
+			return 1;
+
+	if (wal != NULL && !wal_start(wal, on_commit, NULL))
+		return 1;
+
+	fprintf(stderr, "Listening on TCP port %u with %ld workers\n", port, nworkers);
+
+	for (long i = 1; i < nworkers; i++)
+		if ((errno = pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) != 0) {
+			perror("pthread_create");
+			return 1;
+		}
+
+	worker_run(&workers[0]);
+	return 1;
+}
@@ -0,0 +1,269 @@
+// Expand the firmware's deferred log back into text. Takes the firmware's ELF
+// file as argument, and reads the console output on stdin. Lines starting
+// with "LOG" are log entries: the address of the format string, the time in
+// milliseconds shifted left by eight bits with the number of arguments in
+// the low byte, then the arguments, all in hex. The format string, and the
+// strings of any "%s" arguments, are looked up in the ELF file. Other lines
+// are passed through unchanged.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+// Longest console line we handle:
+#define LINE_MAX	1024
+
+// Loadable sections of the ELF file, with their contents:
+struct section {
+	uint64_t	addr;
+	uint64_t	size;
+	const uint8_t	*data;
+};
+
+static struct section *sections;
+static size_t nsections;
+static uint8_t *elf;
+
+// Whether the last output ended a line:
+static bool at_start = true;
+
+static inline uint64_t
+get (const uint8_t *p, const int size)
+{
+	uint64_t val = 0;
+
+	for (int i = size - 1; i >= 0; i--)
+		val = val << 8 | p[i];
+
+	return val;
+}
+
+// Load the ELF file, and find its sections. Handles little-endian 32-bit and
+// 64-bit files, the latter for testing on the host
+static bool
+elf_load (const char *path)
+{
+	FILE *f;
+	long len;
+	uint64_t shoff;
+	size_t shentsize;
+	bool wide;
+
+	if ((f = fopen(path, "rb")) == NULL)
+		return false;
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	if (len < 64 || (elf = malloc(len)) == NULL || fread(elf, 1, len, f) != (size_t) len) {
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+
+	if (memcmp(elf, "\177ELF", 4) != 0 || elf[5] != 1)
+		return false;
+
+	wide      = (elf[4] == 2);
+	shoff     = wide ? get(elf + 0x28, 8) : get(elf + 0x20, 4);
+	shentsize = get(elf + (wide ? 0x3A : 0x2E), 2);
+	nsections = get(elf + (wide ? 0x3C : 0x30), 2);
+
+	if (shoff + nsections * shentsize > (uint64_t) len)
+		return false;
+
+	if ((sections = calloc(nsections, sizeof(*sections))) == NULL)
+		return false;
+
+	for (size_t i = 0; i < nsections; i++) {
+		const uint8_t *sh = elf + shoff + i * shentsize;
+		const uint32_t type = get(sh + 4, 4);
+		const uint64_t flags = wide ? get(sh + 8, 8) : get(sh + 8, 4);
+		const uint64_t addr  = wide ? get(sh + 16, 8) : get(sh + 12, 4);
+		const uint64_t off   = wide ? get(sh + 24, 8) : get(sh + 16, 4);
+		const uint64_t size  = wide ? get(sh + 32, 8) : get(sh + 20, 4);
+
+		// Only allocated sections with contents, "NOBITS" has none:
+		if (!(flags & 2) || type == 8 || off + size > (uint64_t) len)
+			continue;
+
+		sections[i].addr = addr;
+		sections[i].size = size;
+		sections[i].data = elf + off;
+	}
+
+	return true;
+}
+
+// Find the string at an address in the ELF file
+static const char *
+elf_string (const uint32_t addr)
+{
+	for (size_t i = 0; i < nsections; i++) {
+		const struct section *s = &sections[i];
+
+		if (s->data == NULL || addr < s->addr || addr >= s->addr + s->size)
+			continue;
+
+		// Make sure the string ends inside the section:
+		if (memchr(s->data + (addr - s->addr), '\0', s->size - (addr - s->addr)) == NULL)
+			return NULL;
+
+		return (const char *) s->data + (addr - s->addr);
+	}
+
+	return NULL;
+}
+
+// Print text, with a timestamp at the start of each line
+static void
+print (const char *text, const uint32_t ms)
+{
+	for (; *text; text++) {
+		if (at_start)
+			printf("[%5u.%03u] ", ms / 1000, ms % 1000);
+
+		putchar(*text);
+		at_start = (*text == '\n');
+	}
+}
+
+// Format the message of a log entry, like printf does on the chip
+static void
+expand (const char *fmt, const uint32_t *arg, const uint8_t nargs, const uint32_t ms)
+{
+	char out[LINE_MAX], spec[32];
+	size_t len = 0;
+	uint8_t n = 0;
+
+	out[0] = '\0';
+
+	while (*fmt && len < sizeof(out) - 1) {
+		const char *start = fmt;
+		size_t speclen;
+		uint32_t val;
+		const char *str;
+
+		if (*fmt != '%' || fmt[1] == '%') {
+			out[len++] = *fmt;
+			fmt += (*fmt == '%') ? 2 : 1;
+			out[len] = '\0';
+			continue;
+		}
+
+		// Flags, width and precision, skipping length modifiers:
+		for (fmt++; strchr("-+ #0123456789.", *fmt) && *fmt; fmt++)
+			continue;
+
+		speclen = fmt - start;
+		while (*fmt == 'l' || *fmt == 'h')
+			fmt++;
+
+		if (*fmt == '\0' || speclen + 2 > sizeof(spec))
+			break;
+
+		memcpy(spec, start, speclen);
+		spec[speclen] = *fmt;
+		spec[speclen + 1] = '\0';
+
+		val = (n < nargs) ? arg[n++] : 0;
+
+		switch (*fmt++) {
+		case 'd':
+		case 'i':
+			len += snprintf(out + len, sizeof(out) - len, spec, (int32_t) val);
+			break;
+
+		case 's':
+			if ((str = elf_string(val)) != NULL)
+				len += snprintf(out + len, sizeof(out) - len, spec, str);
+			else
+				len += snprintf(out + len, sizeof(out) - len, "<0x%08x>", val);
+			break;
+
+		case 'p':
+			len += snprintf(out + len, sizeof(out) - len, "0x%08x", val);
+			break;
+
+		default:
+			spec[speclen] = strchr("uxXoc", spec[speclen]) ? spec[speclen] : 'x';
+			len += snprintf(out + len, sizeof(out) - len, spec, val);
+			break;
+		}
+
+		if (len > sizeof(out) - 1)
+			len = sizeof(out) - 1;
+	}
+
+	print(out, ms);
+}
+
+// Decode a "LOG" line, return false if it isn't one
+static bool
+decode (const char *line)
+{
+	uint32_t word[2 + LOG_ARGS_MAX];
+	size_t nwords = 0;
+	const char *fmt;
+	char *end;
+
+	if (strncmp(line, "LOG ", 4) != 0)
+		return false;
+
+	for (line += 3; *line == ' ' && nwords < sizeof(word) / sizeof(word[0]); line = end) {
+		word[nwords] = strtoul(line, &end, 16);
+		if (end == line)
+			break;
+		nwords++;
+	}
+
+	if (nwords < 2 || nwords != 2 + (word[1] & 0xFF))
+		return false;
+
+	if ((fmt = elf_string(word[0])) == NULL) {
+		char msg[64];
+
+		snprintf(msg, sizeof(msg), "<unknown format string 0x%08x>\n", word[0]);
+		print(msg, word[1] >> 8);
+		return true;
+	}
+
+	expand(fmt, word + 2, word[1] & 0xFF, word[1] >> 8);
+	return true;
+}
+
+int
+main (int argc, char **argv)
+{
+	char line[LINE_MAX];
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s firmware.elf < console.txt\n", argv[0]);
+		return 1;
+	}
+
+	if (!elf_load(argv[1])) {
+		fprintf(stderr, "%s: can't load ELF file\n", argv[1]);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+
+		if (decode(line))
+			continue;
+
+		if (!at_start)
+			putchar('\n');
+
+		puts(line);
+		at_start = true;
+	}
+
+	return 0;
+}
@@ -0,0 +1,331 @@
+// Decoding of the compact binary payload, shared by the host tools.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "crc.h"
+#include "ds18b20.h"
+#include "fourier.h"
+#include "packed.h"
+#include "trace.h"
+#include "payload.h"
+#include "sensor_table.h"
+
+// Same strings as in the firmware's ds18b20_status_string():
+static const char *status_string[] = {
+	[DS18B20_UNPROBED]		= "unprobed",
+	[DS18B20_ERROR_BUS]		= "bus error",
+	[DS18B20_ERROR_SILENCE]		= "no response",
+	[DS18B20_ERROR_CHECKSUM]	= "checksum error",
+	[DS18B20_ERROR_RESET_VAL]	= "reset value",
+	[DS18B20_SUCCESS]		= "success",
+};
+
+static inline uint16_t
+get16 (const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static inline uint32_t
+get32 (const uint8_t *p)
+{
+	return get16(p) | (uint32_t) get16(p + 2) << 16;
+}
+
+// Fetch unsigned varint, return NULL if it runs past the end
+static const uint8_t *
+get_varint (const uint8_t *p, const uint8_t *end, uint32_t *val)
+{
+	*val = 0;
+
+	for (int shift = 0; p < end && shift < 35; shift += 7) {
+		*val |= (uint32_t)(*p & 0x7F) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+
+	return NULL;
+}
+
+// Decode a frame relative to the previous one, inverse of frame_encode()
+static const uint8_t *
+frame_decode (const uint8_t *p, const uint8_t *end, struct record *cur, const struct record *prev, const bool first, const size_t nsensors)
+{
+	int32_t above = 0;
+	uint32_t val;
+
+	// Sequence number:
+	if ((p = get_varint(p, end, &val)) == NULL)
+		return NULL;
+
+	cur->seq = prev->seq + val;
+
+	// Age:
+	if ((p = get_varint(p, end, &val)) == NULL)
+		return NULL;
+
+	if (first || prev->age == PACKED_UNDATED)
+		cur->age = (val == 0) ? PACKED_UNDATED : val - 1;
+	else
+		cur->age = prev->age - val;
+
+	// Statuses:
+	if (p >= end)
+		return NULL;
+
+	if (*p++ == 0)
+		memcpy(cur->status, prev->status, nsensors);
+	else
+		for (size_t i = 0; i < nsensors; i += 2) {
+			if (p >= end)
+				return NULL;
+			cur->status[i] = *p & 0x0F;
+			if (i + 1 < nsensors)
+				cur->status[i + 1] = *p >> 4;
+			p++;
+		}
+
+	// Ages of carried readings:
+	if (p >= end)
+		return NULL;
+
+	if (*p++ == 0)
+		memset(cur->carried, 0, sizeof(cur->carried));
+	else
+		for (size_t i = 0; i < nsensors; i++)
+			if ((p = get_varint(p, end, &cur->carried[i])) == NULL)
+				return NULL;
+
+	// Statistics, relative to the readings, which follow them:
+	if (p >= end)
+		return NULL;
+
+	memset(cur->count, 0, sizeof(cur->count));
+	memset(cur->min, 0, sizeof(cur->min));
+	memset(cur->max, 0, sizeof(cur->max));
+	memset(cur->spread, 0, sizeof(cur->spread));
+
+	if (*p++ != 0)
+		for (size_t i = 0; i < nsensors; i++) {
+			if ((p = get_varint(p, end, &cur->count[i])) == NULL)
+				return NULL;
+
+			if (cur->count[i] < 2)
+				continue;
+
+			if ((p = get_varint(p, end, &val)) == NULL)
+				return NULL;
+			cur->min[i] = ZIGZAG_DECODE(val);
+
+			if ((p = get_varint(p, end, &val)) == NULL)
+				return NULL;
+			cur->max[i] = ZIGZAG_DECODE(val);
+
+			if ((p = get_varint(p, end, &cur->spread[i])) == NULL)
+				return NULL;
+		}
+
+	// Readings:
+	for (size_t sensor = 0; sensor < nsensors; sensor++) {
+		int32_t delta;
+
+		if ((p = get_varint(p, end, &val)) == NULL)
+			return NULL;
+
+		delta = ZIGZAG_DECODE(val) + above;
+		above = delta;
+
+		cur->reading[sensor] = first
+			? delta
+			: prev->reading[sensor] + delta;
+
+		cur->min[sensor] += cur->reading[sensor];
+		cur->max[sensor] += cur->reading[sensor];
+	}
+
+	return p;
+}
+
+static const char *
+status (const uint8_t s)
+{
+	return (s < sizeof(status_string) / sizeof(status_string[0]))
+		? status_string[s]
+		: "unknown";
+}
+
+// Look up a sensor status by its string, return zero if unknown
+uint8_t
+payload_status (const char *str, const size_t len)
+{
+	for (uint8_t s = 1; s < sizeof(status_string) / sizeof(status_string[0]); s++)
+		if (strlen(status_string[s]) == len && memcmp(status_string[s], str, len) == 0)
+			return s;
+
+	return 0;
+}
+
+// Print one record's sensors, same format as sensors_json()
+static void
+print_sensors (FILE *out, const struct record *f, const size_t nsensors)
+{
+	fprintf(out, "\"sensors\" : {\n");
+
+	for (size_t sensor = 0; sensor < nsensors; sensor++) {
+		fprintf(out, "%s \"%s\" : ", (sensor == 0) ? " " : ",", sensor_names[sensor]);
+		fprintf(out, "{ \"value\": \"%d\", \"status\" : \"%s\"",
+			f->reading[sensor] * 625, status(f->status[sensor]));
+		if (f->count[sensor] > 1)
+			fprintf(out, ", \"min\" : \"%d\", \"max\" : \"%d\", \"spread\" : \"%u\", \"count\" : \"%u\"",
+				f->min[sensor] * 625, f->max[sensor] * 625, f->spread[sensor], f->count[sensor]);
+		if (f->carried[sensor] > 0)
+			fprintf(out, ", \"age\" : \"%u\"", f->carried[sensor]);
+		fprintf(out, " }\n");
+	}
+
+	fprintf(out, "}");
+}
+
+// Decode a payload, return NULL on success or an error message
+const char *
+payload_decode (struct payload *pl, const uint8_t *buf, const size_t len)
+{
+	struct record none;
+	const uint8_t *p, *end;
+
+	if (len < PACKED_HEADER_SIZE + 2)
+		return "payload too short";
+
+	if (buf[0] != PACKED_MAGIC[0] || buf[1] != PACKED_MAGIC[1])
+		return "bad magic";
+
+	if (buf[2] != PACKED_VERSION)
+		return "unsupported version";
+
+	if (crc16(buf, len - 2, 0xFFFF) != get16(buf + len - 2))
+		return "CRC mismatch";
+
+	pl->nsensors  = buf[3];
+	pl->nrecords  = buf[4];
+	pl->rssi      = (int8_t) buf[5];
+	pl->millivolt = get16(buf + 6);
+	pl->adc       = get16(buf + 8);
+	pl->chipid    = get32(buf + 10);
+	pl->epoch     = get32(buf + 18);
+	pl->crc       = get16(buf + len - 2);
+
+	if (pl->nsensors != NSENSORS)
+		return "wrong number of sensors";
+
+	// Decode all frames. The frame before the first has the header's
+	// sequence number, and all sensors successful:
+	memset(none.status, DS18B20_SUCCESS, sizeof(none.status));
+	none.seq = get32(buf + 14);
+	p   = buf + PACKED_HEADER_SIZE;
+	end = buf + len - 2;
+
+	for (size_t i = 0; i < pl->nrecords; i++) {
+		struct record *prev = (i == 0) ? &none : &pl->record[i - 1];
+
+		if ((p = frame_decode(p, end, &pl->record[i], prev, i == 0, pl->nsensors)) == NULL)
+			break;
+	}
+
+	if (pl->nrecords < 1 || p == NULL || p >= end)
+		return "bad payload length";
+
+	// Soil model fit:
+	if ((pl->has_fit = *p++) != 0)
+		if ((p = get_varint(p, end, &pl->fit.depth)) == NULL
+		 || (p = get_varint(p, end, &pl->fit.amplitude)) == NULL
+		 || (p = get_varint(p, end, &pl->fit.peak_age)) == NULL
+		 || (p = get_varint(p, end, &pl->fit.residual)) == NULL)
+			return "bad payload length";
+
+	// Trace of a crashed cycle:
+	if (p >= end)
+		return "bad payload length";
+
+	if ((pl->has_crash = *p++) != 0) {
+		uint32_t count, delta;
+		uint16_t time = 0;
+
+		if ((p = get_varint(p, end, &pl->crash.reason)) == NULL
+		 || (p = get_varint(p, end, &pl->crash.exccause)) == NULL
+		 || (p = get_varint(p, end, &pl->crash.epc)) == NULL
+		 || (p = get_varint(p, end, &count)) == NULL
+		 || count > TRACE_ENTRIES)
+			return "bad crash trace";
+
+		pl->crash.count = count;
+		for (uint32_t i = 0; i < count; i++) {
+			if ((p = get_varint(p, end, &delta)) == NULL || end - p < 2)
+				return "bad crash trace";
+
+			time += delta;
+			pl->crash.entry[i].time  = time;
+			pl->crash.entry[i].state = *p++;
+			pl->crash.entry[i].arg   = *p++;
+		}
+	}
+
+	if (p != end)
+		return "bad payload length";
+
+	return NULL;
+}
+
+// Print a decoded payload as the JSON body that the firmware sends
+void
+payload_json (FILE *out, const struct payload *pl)
+{
+	const struct record *cur = &pl->record[pl->nrecords - 1];
+
+	// Current record, which is the last one, and status fields:
+	fprintf(out, "{ ");
+	print_sensors(out, cur, pl->nsensors);
+	fprintf(out, "\n, \"seq\" : \"%u\"", cur->seq);
+	fprintf(out, "\n, \"epoch\" : \"%u\"", pl->epoch);
+	fprintf(out, "\n, \"chipid\" : \"%u\"", pl->chipid);
+	fprintf(out, "\n, \"millivolt\" : \"%u\"", pl->millivolt);
+	fprintf(out, "\n, \"rssi\" : \"%d\"", pl->rssi);
+	fprintf(out, "\n, \"adc\" : \"%u\"", pl->adc);
+
+	// Soil model fit:
+	if (pl->has_fit)
+		fprintf(out, "\n, \"fourier\" : { \"depth\" : \"%u\", \"amplitude\" : \"%u\", \"peak_age\" : \"%u\", \"residual\" : \"%u\" }",
+			pl->fit.depth, pl->fit.amplitude, pl->fit.peak_age, pl->fit.residual);
+
+	// Trace of a crashed cycle:
+	if (pl->has_crash) {
+		fprintf(out, "\n, \"crash\" : { \"reason\" : \"%u\", \"exccause\" : \"%u\", \"epc\" : \"%u\", \"trace\" : [",
+			pl->crash.reason, pl->crash.exccause, pl->crash.epc);
+		for (size_t i = 0; i < pl->crash.count; i++) {
+			const struct trace_entry *e = &pl->crash.entry[i];
+
+			fprintf(out, "\n%s { \"ms\" : \"%u\", \"state\" : \"%u\", \"event\" : \"%s\", \"pending\" : \"%u\" }",
+				(i == 0) ? " " : ",", e->time * 10,
+				e->state & ~TRACE_ENTER,
+				(e->state & TRACE_ENTER) ? "enter" : "post", e->arg);
+		}
+		fprintf(out, "\n] }");
+	}
+
+	// Logged records, oldest first:
+	if (pl->nrecords > 1) {
+		fprintf(out, "\n, \"backlog\" : [");
+		for (size_t i = 0; i < pl->nrecords - 1; i++) {
+			fprintf(out, "\n%s { \"seq\" : \"%u\", ", (i == 0) ? " " : ",", pl->record[i].seq);
+			if (pl->record[i].age != PACKED_UNDATED)
+				fprintf(out, "\"age\" : \"%u\", ", pl->record[i].age);
+			print_sensors(out, &pl->record[i], pl->nsensors);
+			fprintf(out, " }");
+		}
+		fprintf(out, "\n]");
+	}
+
+	fprintf(out, "\n}\n");
+}
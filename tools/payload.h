@@ -0,0 +1,33 @@
+// One decoded record:
+struct record {
+	uint32_t	seq;
+	uint32_t	age;
+	int32_t		reading[PACKED_SENSORS_MAX];
+	uint8_t		status[PACKED_SENSORS_MAX];
+	uint32_t	carried[PACKED_SENSORS_MAX];
+	int32_t		min[PACKED_SENSORS_MAX];
+	int32_t		max[PACKED_SENSORS_MAX];
+	uint32_t	spread[PACKED_SENSORS_MAX];
+	uint32_t	count[PACKED_SENSORS_MAX];
+};
+
+// A decoded payload. The current record is the last one:
+struct payload {
+	uint32_t	chipid;
+	uint32_t	epoch;
+	uint16_t	millivolt;
+	uint16_t	adc;
+	uint16_t	crc;
+	int8_t		rssi;
+	size_t		nsensors;
+	size_t		nrecords;
+	struct record	record[256];
+	bool		has_fit;
+	struct fourier_fit fit;
+	bool		has_crash;
+	struct trace	crash;
+};
+
+const char *payload_decode (struct payload *pl, const uint8_t *buf, const size_t len);
+void payload_json (FILE *out, const struct payload *pl);
+uint8_t payload_status (const char *str, const size_t len);
@@ -0,0 +1,261 @@
+// Derive the WPA pairwise master key of a network, as the station would from
+// the SSID and the passphrase: PBKDF2 with HMAC-SHA1, 4096 rounds, 32 bytes.
+// It prints a line for bin/secrets.h, so that the firmware can hand the key
+// to the SDK as 64 hex digits and skip the derivation on every wakeup:
+//
+//	pmk [-b count] ssid passphrase
+//
+// With -b, it also derives the key a number of times and prints the time
+// each derivation takes, which is the work the firmware no longer does.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PMK_ROUNDS	4096
+#define PMK_SIZE	32
+
+#define SHA1_BLOCK	64
+#define SHA1_SIZE	20
+
+// SHA-1 state after some whole blocks:
+struct sha1 {
+	uint32_t	h[5];
+};
+
+// Number of SHA-1 blocks hashed, for the benchmark:
+static uint64_t nblocks;
+
+static inline uint32_t
+rol (const uint32_t x, const int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static void
+sha1_init (struct sha1 *s)
+{
+	s->h[0] = 0x67452301;
+	s->h[1] = 0xEFCDAB89;
+	s->h[2] = 0x98BADCFE;
+	s->h[3] = 0x10325476;
+	s->h[4] = 0xC3D2E1F0;
+}
+
+// Hash one block
+static void
+sha1_block (struct sha1 *s, const uint8_t *block)
+{
+	uint32_t w[80], a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3], e = s->h[4];
+
+	for (int i = 0; i < 16; i++)
+		w[i] = (uint32_t) block[i * 4] << 24 | block[i * 4 + 1] << 16 | block[i * 4 + 2] << 8 | block[i * 4 + 3];
+
+	for (int i = 16; i < 80; i++)
+		w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	for (int i = 0; i < 80; i++) {
+		uint32_t f, k, t;
+
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		}
+		else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+		else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		}
+		else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+
+		t = rol(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rol(b, 30);
+		b = a;
+		a = t;
+	}
+
+	s->h[0] += a;
+	s->h[1] += b;
+	s->h[2] += c;
+	s->h[3] += d;
+	s->h[4] += e;
+	nblocks++;
+}
+
+// Hash the last bytes of a message, shorter than two blocks, of which the
+// state already holds a number of whole blocks
+static void
+sha1_final (struct sha1 s, const size_t blocks, const uint8_t *data, const size_t len, uint8_t *digest)
+{
+	uint8_t buf[2 * SHA1_BLOCK] = { 0 };
+	const size_t n = (len + 9 <= SHA1_BLOCK) ? SHA1_BLOCK : 2 * SHA1_BLOCK;
+	const uint64_t bits = (uint64_t) (blocks * SHA1_BLOCK + len) * 8;
+
+	memcpy(buf, data, len);
+	buf[len] = 0x80;
+	for (int i = 0; i < 8; i++)
+		buf[n - 1 - i] = bits >> (i * 8);
+
+	for (size_t i = 0; i < n; i += SHA1_BLOCK)
+		sha1_block(&s, buf + i);
+
+	for (int i = 0; i < 5; i++) {
+		digest[i * 4]     = s.h[i] >> 24;
+		digest[i * 4 + 1] = s.h[i] >> 16;
+		digest[i * 4 + 2] = s.h[i] >> 8;
+		digest[i * 4 + 3] = s.h[i];
+	}
+}
+
+// HMAC-SHA1 key, as the states after the inner and the outer padded key:
+struct hmac {
+	struct sha1	inner;
+	struct sha1	outer;
+};
+
+// The passphrase is at most 63 characters, so it always fits in a block:
+static void
+hmac_init (struct hmac *h, const char *key)
+{
+	uint8_t ipad[SHA1_BLOCK], opad[SHA1_BLOCK];
+	const size_t len = strlen(key);
+
+	for (size_t i = 0; i < SHA1_BLOCK; i++) {
+		const uint8_t k = (i < len) ? key[i] : 0;
+
+		ipad[i] = k ^ 0x36;
+		opad[i] = k ^ 0x5C;
+	}
+
+	sha1_init(&h->inner);
+	sha1_block(&h->inner, ipad);
+	sha1_init(&h->outer);
+	sha1_block(&h->outer, opad);
+}
+
+static void
+hmac (const struct hmac *h, const uint8_t *data, const size_t len, uint8_t *mac)
+{
+	uint8_t digest[SHA1_SIZE];
+
+	sha1_final(h->inner, 1, data, len, digest);
+	sha1_final(h->outer, 1, digest, sizeof(digest), mac);
+}
+
+// PBKDF2-HMAC-SHA1, with the SSID as salt
+static void
+pmk_derive (const char *ssid, const char *passphrase, uint8_t *pmk)
+{
+	const size_t len = strlen(ssid);
+	uint8_t salt[32 + 4], u[SHA1_SIZE], t[SHA1_SIZE];
+	struct hmac h;
+
+	hmac_init(&h, passphrase);
+	memcpy(salt, ssid, len);
+
+	for (uint32_t block = 1; block * SHA1_SIZE < PMK_SIZE + SHA1_SIZE; block++) {
+		const size_t n = (PMK_SIZE - (block - 1) * SHA1_SIZE < SHA1_SIZE)
+			? PMK_SIZE - (block - 1) * SHA1_SIZE
+			: SHA1_SIZE;
+
+		salt[len]     = block >> 24;
+		salt[len + 1] = block >> 16;
+		salt[len + 2] = block >> 8;
+		salt[len + 3] = block;
+
+		hmac(&h, salt, len + 4, u);
+		memcpy(t, u, sizeof(t));
+
+		for (int i = 1; i < PMK_ROUNDS; i++) {
+			hmac(&h, u, sizeof(u), u);
+			for (int j = 0; j < SHA1_SIZE; j++)
+				t[j] ^= u[j];
+		}
+
+		memcpy(pmk + (block - 1) * SHA1_SIZE, t, n);
+	}
+}
+
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+usage (const char *name)
+{
+	fprintf(stderr, "Usage: %s [-b count] ssid passphrase\n", name);
+	exit(1);
+}
+
+int
+main (int argc, char **argv)
+{
+	uint8_t pmk[PMK_SIZE];
+	const char *ssid, *passphrase;
+	long count = 0;
+	double start;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:")) != -1)
+		switch (opt) {
+		case 'b': count = atol(optarg); break;
+		default:
+			usage(argv[0]);
+		}
+
+	if (optind + 2 != argc || count < 0)
+		usage(argv[0]);
+
+	ssid       = argv[optind];
+	passphrase = argv[optind + 1];
+
+	// The limits of WPA-PSK:
+	if (strlen(ssid) < 1 || strlen(ssid) > 32) {
+		fprintf(stderr, "SSID must be 1 to 32 bytes\n");
+		return 1;
+	}
+
+	if (strlen(passphrase) < 8 || strlen(passphrase) > 63) {
+		fprintf(stderr, "Passphrase must be 8 to 63 characters\n");
+		return 1;
+	}
+
+	pmk_derive(ssid, passphrase, pmk);
+
+	printf("#define SECRET_PMK\t\"");
+	for (size_t i = 0; i < sizeof(pmk); i++)
+		printf("%02x", pmk[i]);
+	printf("\"\n");
+
+	if (count == 0)
+		return 0;
+
+	nblocks = 0;
+	start = now();
+
+	for (long i = 0; i < count; i++)
+		pmk_derive(ssid, passphrase, pmk);
+
+	start = now() - start;
+	fprintf(stderr, "%ld derivations in %.3f s, %.3f ms each, %llu SHA-1 blocks each\n",
+		count, start, start * 1000 / count, (unsigned long long) (nblocks / count));
+
+	return 0;
+}
@@ -0,0 +1,124 @@
+// Tracking of the sequence numbers seen per probe, shared by the receivers.
+//
+// The firmware sends a record again when an acknowledgement gets lost, so
+// the receivers remember which sequence numbers they have seen for each
+// probe, and drop records they have already written. Only the most recent
+// sequence numbers are remembered, in a sliding window. The probe counts from
+// scratch after its flash log was erased, with a new epoch, which starts the
+// window over. None of this is thread-safe.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fourier.h"
+#include "packed.h"
+#include "trace.h"
+#include "payload.h"
+#include "probe.h"
+
+static struct probe probes[PROBES_MAX];
+
+// Find or add a probe by chip ID, in an open-addressed hash table
+struct probe *
+probe_find (const uint32_t chipid)
+{
+	uint32_t hash = (chipid * 2654435761U) & (PROBES_MAX - 1);
+
+	for (size_t i = 0; i < PROBES_MAX; i++) {
+		struct probe *probe = &probes[(hash + i) & (PROBES_MAX - 1)];
+
+		if (!probe->used) {
+			probe->used   = true;
+			probe->chipid = chipid;
+			return probe;
+		}
+
+		if (probe->chipid == chipid)
+			return probe;
+	}
+
+	return NULL;
+}
+
+// Take the epoch of an upload. If it is a new one, the probe started counting
+// over, so forget what it sent before
+void
+probe_epoch (struct probe *probe, const uint32_t epoch)
+{
+	if (epoch == probe->epoch)
+		return;
+
+	if (probe->top > 0)
+		fprintf(stderr, "probe %08x: new epoch %08x, starting over\n", probe->chipid, epoch);
+
+	memset(probe->seen, 0, sizeof(probe->seen));
+	probe->epoch = epoch;
+	probe->top   = 0;
+}
+
+// Mark a sequence number as seen, return true if it was seen before
+bool
+probe_seen (struct probe *probe, const uint32_t seq)
+{
+	uint64_t *word, bit;
+
+	// Slide the window up, forgetting the sequence numbers that drop out:
+	if (seq > probe->top) {
+		if (seq - probe->top >= WINDOW_BITS)
+			memset(probe->seen, 0, sizeof(probe->seen));
+		else
+			for (uint32_t s = probe->top + 1; s <= seq; s++)
+				probe->seen[(s % WINDOW_BITS) / 64] &= ~(1ULL << (s % 64));
+
+		probe->top = seq;
+	}
+
+	word = &probe->seen[(seq % WINDOW_BITS) / 64];
+	bit  = 1ULL << (seq % 64);
+
+	if (*word & bit)
+		return true;
+
+	*word |= bit;
+	return false;
+}
+
+// Forget that a sequence number was seen, for a record that couldn't be
+// kept, so that it is taken when it comes again
+void
+probe_forget (struct probe *probe, const uint32_t seq)
+{
+	if (seq <= probe->top && probe->top - seq < WINDOW_BITS)
+		probe->seen[(seq % WINDOW_BITS) / 64] &= ~(1ULL << (seq % 64));
+}
+
+// Drop the records that were seen before, return the number left. The
+// current record is kept if any logged record is new, since it carries the
+// status fields:
+size_t
+probe_dedup (struct payload *pl)
+{
+	struct probe *probe;
+	size_t fresh = 0;
+	bool current;
+
+	if ((probe = probe_find(pl->chipid)) == NULL)
+		return pl->nrecords;
+
+	probe_epoch(probe, pl->epoch);
+
+	for (size_t i = 0; i + 1 < pl->nrecords; i++)
+		if (!probe_seen(probe, pl->record[i].seq))
+			pl->record[fresh++] = pl->record[i];
+
+	current = !probe_seen(probe, pl->record[pl->nrecords - 1].seq);
+
+	if (fresh == 0 && !current)
+		return 0;
+
+	pl->record[fresh] = pl->record[pl->nrecords - 1];
+	pl->nrecords = fresh + 1;
+	return pl->nrecords;
+}
@@ -0,0 +1,21 @@
+// Number of probes we can track, a power of two, and the size of the window
+// of sequence numbers remembered per probe, in bits:
+#define PROBES_MAX	16384
+#define WINDOW_BITS	4096
+
+// Sequence numbers seen per probe, in the epoch it sent last. Bit
+// (seq % WINDOW_BITS) is set if seq was seen, for the WINDOW_BITS sequence
+// numbers up to and including top:
+struct probe {
+	bool		used;
+	uint32_t	chipid;
+	uint32_t	epoch;
+	uint32_t	top;
+	uint64_t	seen[WINDOW_BITS / 64];
+};
+
+struct probe *probe_find (const uint32_t chipid);
+void probe_epoch (struct probe *probe, const uint32_t epoch);
+bool probe_seen (struct probe *probe, const uint32_t seq);
+void probe_forget (struct probe *probe, const uint32_t seq);
+size_t probe_dedup (struct payload *pl);
@@ -0,0 +1,96 @@
+// Read samples back from the time-series store that the ingest server
+// writes. Takes the store directory, the chip ID of the probe, and optionally
+// a time range in Unix seconds, and writes the samples of every sensor on
+// the probe to stdout, one per line:
+//
+//	time,sensor,celsius,status
+//
+// Given a number of points as well, it picks the coarsest resolution that
+// has at least that many in the range, out of the samples and their hourly,
+// daily and monthly rollups, and writes a line per rollup instead:
+//
+//	time,sensor,mean,min,max,count,status
+//
+// with the start of the hour, day or month, the mean, minimum and maximum of
+// the successful readings in degrees C, and their number. The rollups are
+// kept up to date by the store, so this takes about as long for a month as
+// for ten years.
+//
+// The store is opened read-only, so this can run next to the ingest server.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "store.h"
+
+// Sensor of the samples being written:
+static const uint8_t *rom;
+
+static void
+print_sample (void *arg, const struct store_sample *sample)
+{
+	(void) arg;
+
+	printf("%u,%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x,%.4f,%u\n", sample->time,
+		rom[0], rom[1], rom[2], rom[3], rom[4], rom[5], rom[6], rom[7],
+		sample->value / 16.0, sample->status);
+}
+
+static void
+print_rollup (void *arg, const struct store_rollup *r)
+{
+	(void) arg;
+
+	printf("%u,%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x,", r->time,
+		rom[0], rom[1], rom[2], rom[3], rom[4], rom[5], rom[6], rom[7]);
+
+	if (r->count > 0)
+		printf("%.4f,%.4f,%.4f,%u,%u\n", (double) r->sum / r->count / 16.0,
+			r->min / 16.0, r->max / 16.0, r->count, r->status);
+	else
+		printf(",,,0,%u\n", r->status);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct store *store;
+	struct store_rod *rod;
+	uint32_t chipid, from, to;
+	size_t points;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s store chipid [from [to [points]]]\n", argv[0]);
+		return 1;
+	}
+
+	chipid = strtoul(argv[2], NULL, 0);
+	from   = (argc > 3) ? strtoul(argv[3], NULL, 0) : 0;
+	to     = (argc > 4) ? strtoul(argv[4], NULL, 0) : UINT32_MAX;
+	points = (argc > 5) ? strtoul(argv[5], NULL, 0) : 0;
+
+	if ((store = store_open(argv[1], false)) == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if ((rod = store_rod(store, chipid, false)) == NULL) {
+		fprintf(stderr, "%s: no probe %u\n", argv[1], chipid);
+		return 1;
+	}
+
+	for (size_t series = 0; series < store_nseries(rod); series++) {
+		rom = store_rom(rod, series);
+
+		if (points > 0)
+			store_rollups(rod, series, store_level(from, to, points), from, to, print_rollup, NULL);
+		else
+			store_scan(rod, series, from, to, print_sample, NULL);
+	}
+
+	store_release(rod);
+	store_close(store);
+	return 0;
+}
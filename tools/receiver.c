@@ -0,0 +1,108 @@
+// Local receiver for the firmware's UDP transport. Listens for datagrams,
+// acknowledges every valid payload, and writes it to stdout as the JSON body
+// the firmware would have sent over HTTP. Records that were written before
+// are dropped, see probe.c.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "net.h"
+#include "fourier.h"
+#include "packed.h"
+#include "trace.h"
+#include "payload.h"
+#include "probe.h"
+
+// Largest datagram we accept:
+#define DATAGRAM_MAX	65536
+
+// Open the listening socket
+static int
+udp_open (const uint16_t port)
+{
+	struct sockaddr_in addr = {
+		.sin_family		= AF_INET,
+		.sin_port		= htons(port),
+		.sin_addr.s_addr	= htonl(INADDR_ANY),
+	};
+	int fd;
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("bind");
+		return -1;
+	}
+
+	return fd;
+}
+
+// Acknowledge a datagram by echoing its magic and CRC, and the sequence
+// number of the current record
+static void
+ack (const int fd, const uint8_t *buf, const size_t len, const uint32_t seq, const struct sockaddr_in *from)
+{
+	uint8_t reply[NET_UDP_ACK_SIZE];
+
+	memcpy(reply, buf, 2);
+	memcpy(reply + 2, buf + len - 2, 2);
+	reply[4] = seq;
+	reply[5] = seq >> 8;
+	reply[6] = seq >> 16;
+	reply[7] = seq >> 24;
+
+	if (sendto(fd, reply, sizeof(reply), 0, (const struct sockaddr *) from, sizeof(*from)) < 0)
+		perror("sendto");
+}
+
+int
+main (int argc, char **argv)
+{
+	static uint8_t buf[DATAGRAM_MAX];
+	static struct payload pl;
+	const uint16_t port = (argc > 1) ? atoi(argv[1]) : NET_UDP_PORT;
+	int fd;
+
+	if ((fd = udp_open(port)) < 0)
+		return 1;
+
+	fprintf(stderr, "Listening on UDP port %u\n", port);
+
+	for (;;) {
+		struct sockaddr_in from;
+		socklen_t fromlen = sizeof(from);
+		const char *err;
+		uint32_t seq;
+		ssize_t len;
+
+		if ((len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromlen)) < 0) {
+			perror("recvfrom");
+			continue;
+		}
+
+		if ((err = payload_decode(&pl, buf, len)) != NULL) {
+			fprintf(stderr, "%s: %s\n", inet_ntoa(from.sin_addr), err);
+			continue;
+		}
+
+		// Write the new records before acknowledging them:
+		seq = pl.record[pl.nrecords - 1].seq;
+		if (probe_dedup(&pl) > 0) {
+			payload_json(stdout, &pl);
+			fflush(stdout);
+		}
+		else
+			fprintf(stderr, "%s: duplicate %u\n", inet_ntoa(from.sin_addr), seq);
+
+		ack(fd, buf, len, seq, &from);
+	}
+}
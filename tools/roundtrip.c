@@ -0,0 +1,412 @@
+// Round-trip check of the compact binary payload, and what it saves. Runs the
+// firmware's own modules on a simulated chip (see chip.c) for a number of
+// wakeups, as fleet does, each in a process of its own. At every wakeup, for
+// every batch size up to a full one, it encodes the upload with
+// packed_create(), decodes it with payload_decode(), and checks that the
+// decoder's JSON is byte for byte the body that http.c sends. (With
+// HTTP_BINARY, it checks that the body is the payload instead.) At the end
+// it prints the average size of the JSON body and of the payload, and the
+// ratio, for the current record alone and with a full batch of logged
+// records:
+//
+//	roundtrip [-n wakeups] [-e noise-%] [-c crash-%]
+//
+// Sensor noise brings on status changes and statistics in the records, and
+// crashes bring on a crash trace in the next wakeup's uploads. A crash also
+// starts the firmware's clock over, so every decoded age is checked against
+// the simulated time at which the record was logged: records from before the
+// last crash must have none. The oldest records are dropped from the log
+// past a full batch, so that the batches move on past a crash.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <os_type.h>
+#include <user_interface.h>
+
+#include "flash_log.h"
+#include "chip.h"
+#include "fourier.h"
+#include "http.h"
+#include "missing.h"
+#include "net.h"
+#include "onewire.h"
+#include "packed.h"
+#include "power.h"
+#include "rtc_mem.h"
+#include "schedule.h"
+#include "sensors.h"
+#include "state.h"
+#include "stream.h"
+#include "trace.h"
+#include "payload.h"
+
+// Largest message, and the sensor read rounds, as in main.c:
+#define MESSAGE_MAX		65536
+#define SENSORS_ROUNDS_MAX	3
+
+// Exit status of a wakeup that crashed, and of one that failed the check:
+#define EXIT_CRASH	3
+#define EXIT_MISMATCH	4
+
+// Totals over the wakeups, for the current record alone and with a full
+// batch of logged records. Kept in shared memory, like the chip:
+struct totals {
+	unsigned long	checked;	// Payloads decoded and compared
+	unsigned long	alone;		// Uploads of the current record alone
+	unsigned long	alone_json;
+	unsigned long	alone_bin;
+	unsigned long	full;		// Uploads with a full batch
+	unsigned long	full_json;
+	unsigned long	full_bin;
+	uint32_t	restart;	// First record since the clock started over
+};
+
+static struct chip *chip;
+static struct totals *totals;
+static int crash;
+
+// Simulated time at which each record was logged, by sequence number. Also
+// in shared memory:
+static uint32_t *logged;
+static long wakeups = 200;
+
+// State to crash in during this wakeup, if any:
+static enum state crash_state;
+
+// Enter a state, as the event loop does
+static void
+enter (const enum state state)
+{
+	trace_add(state | TRACE_ENTER, 0);
+
+	if (state == crash_state)
+		_exit(EXIT_CRASH);
+}
+
+// Simulated time now, as the firmware's clock counts it: whole seconds of
+// sleep and of being awake
+static inline uint32_t
+now (void)
+{
+	return chip->clock + chip->awake_us / 1000000;
+}
+
+// Check the age of the decoded records against the time at which they were
+// logged. Return false on a mismatch
+static bool
+ages_check (const struct payload *pl)
+{
+	for (size_t i = 0; i < pl->nrecords; i++) {
+		const struct record *r = &pl->record[i];
+		uint32_t age;
+
+		if (r->seq >= wakeups)
+			continue;
+
+		age = (r->seq < totals->restart) ? PACKED_UNDATED : now() - logged[r->seq];
+
+		if (r->age == age)
+			continue;
+
+		if (age == PACKED_UNDATED)
+			fprintf(stderr, "record %u: age %u, expected none\n", r->seq, r->age);
+		else if (r->age == PACKED_UNDATED)
+			fprintf(stderr, "record %u: no age, expected %u\n", r->seq, age);
+		else
+			fprintf(stderr, "record %u: age %u, expected %u\n", r->seq, r->age, age);
+
+		return false;
+	}
+
+	return true;
+}
+
+// Get the body of the message that http.c sends, return its length
+static size_t
+body_get (uint8_t *body, uint32_t *backlog, const uint32_t seq)
+{
+	static uint8_t msg[MESSAGE_MAX];
+	uint8_t *buf, *start = msg;
+	size_t len, total = 0;
+
+	*backlog = http_post_start(*backlog, seq);
+
+	while ((len = http_post_next(&buf)) > 0) {
+		if (total + len > sizeof(msg))
+			return 0;
+
+		memcpy(msg + total, buf, len);
+		total += len;
+	}
+
+	// Skip the HTTP header:
+	if (!NET_UDP) {
+		for (start = msg; start + 4 <= msg + total; start++)
+			if (memcmp(start, "\r\n\r\n", 4) == 0)
+				break;
+
+		start += 4;
+	}
+
+	memcpy(body, start, msg + total - start);
+	return msg + total - start;
+}
+
+// Encode and decode the upload with the given number of logged records,
+// and compare it with what http.c sends. Return false on a mismatch
+static bool
+check (const uint32_t backlog, const uint32_t seq)
+{
+	static uint8_t body[MESSAGE_MAX], bin[MESSAGE_MAX];
+	static struct payload pl;
+	struct upload upload;
+	struct stream s;
+	size_t body_len, json_len;
+	const char *err;
+	char *json;
+	FILE *out;
+	bool same;
+
+	// The upload as http_post_start() samples it:
+	upload.backlog   = backlog;
+	upload.seq       = seq;
+	upload.epoch     = flash_log_epoch();
+	upload.clock     = rtc_mem_clock();
+	upload.has_fit   = fourier_fit(&upload.fit, upload.clock);
+	upload.millivolt = (readvdd33() * 1000) / 1024;
+	upload.rssi      = wifi_station_get_rssi();
+	upload.adc       = system_adc_read();
+	upload.crash     = trace_crash();
+
+	body_len = body_get(body, &upload.backlog, seq);
+
+	stream_init(&s, (char *) bin, sizeof(bin), 0);
+	packed_create(&s, &upload);
+
+	if (s.total > sizeof(bin)) {
+		fprintf(stderr, "%u logged records: payload too large\n", upload.backlog);
+		return false;
+	}
+
+	if ((err = payload_decode(&pl, bin, s.total)) != NULL) {
+		fprintf(stderr, "%u logged records: %s\n", upload.backlog, err);
+		return false;
+	}
+
+	if ((out = open_memstream(&json, &json_len)) == NULL) {
+		perror("open_memstream");
+		return false;
+	}
+
+	payload_json(out, &pl);
+	fclose(out);
+
+#if HTTP_BINARY || NET_UDP
+	same = (body_len == s.total && memcmp(body, bin, body_len) == 0);
+#else
+	same = (body_len == json_len && memcmp(body, json, body_len) == 0);
+#endif
+
+	if (!same)
+		fprintf(stderr, "%u logged records: decoded payload differs from the body\n", upload.backlog);
+	else
+		same = ages_check(&pl);
+
+	if (backlog == 0) {
+		totals->alone++;
+		totals->alone_json += json_len;
+		totals->alone_bin  += s.total;
+	}
+
+	if (backlog == FLASH_LOG_BATCH) {
+		totals->full++;
+		totals->full_json += json_len;
+		totals->full_bin  += s.total;
+	}
+
+	totals->checked++;
+	free(json);
+	return same;
+}
+
+// One wakeup, from reset to deep sleep, following main.c. The record is
+// logged but never acknowledged, so that the backlog grows to a full batch
+static void
+wake (const enum rst_reason reason)
+{
+	const struct rst_info reset = { .reason = reason };
+	const bool warm = (reason == REASON_DEEP_SLEEP_AWAKE);
+	uint32_t current, backlog;
+
+	chip_select(chip);
+	chip->awake_us = 0;
+
+	crash_state = (chip_random() % 1000 < (uint32_t) crash * 10)
+		? chip_random() % STATE_WIFI_SETUP_START
+		: STATE_NUM;
+
+	trace_init(&reset);
+	if (warm)
+		rtc_mem_load();
+
+	power_init(warm);
+	flash_log_init(reason != REASON_DEFAULT_RST);
+	schedule_init(warm);
+	fourier_init(warm);
+	sensors_plan(rtc_mem_clock());
+
+	if (!warm)
+		totals->restart = flash_log_seq(flash_log_pending());
+
+	for (uint8_t round = 0; ; round++) {
+		enter(STATE_SENSORS_START);
+		sensors_request(round);
+		enter(STATE_SENSORS_READOUT);
+		sensors_readout(round);
+		enter(STATE_SENSORS_DONE);
+
+		if (sensors_all_valid() || round >= SENSORS_ROUNDS_MAX - 1)
+			break;
+	}
+
+	onewire_depower();
+	sensors_consolidate_samples();
+	schedule_update(sensors_record_data(), rtc_mem_clock());
+	fourier_update(sensors_record_data(), rtc_mem_clock());
+
+	enter(STATE_SENSORS_SEND);
+	sensors_consolidate_records();
+	current = flash_log_seq(flash_log_pending());
+	if (flash_log_append(sensors_record_data(), rtc_mem_clock()) && current < wakeups)
+		logged[current] = now();
+	rtc_mem_save(0);
+
+	backlog = flash_log_pending() - 1;
+	if (backlog > FLASH_LOG_BATCH)
+		backlog = FLASH_LOG_BATCH;
+
+	for (uint32_t n = 0; n <= backlog; n++)
+		if (!check(n, current))
+			_exit(EXIT_MISMATCH);
+
+	// The crash trace went out with this wakeup's uploads, and the oldest
+	// records past a full batch are let go:
+	trace_crash_clear();
+
+	if (flash_log_pending() > FLASH_LOG_BATCH)
+		flash_log_consume(flash_log_pending() - FLASH_LOG_BATCH);
+
+	rtc_mem_clock_save(schedule_interval());
+	chip->clock = now() + schedule_interval();
+}
+
+static void *
+shared (const size_t size)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+static void
+usage (const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n wakeups] [-e noise-%%] [-c crash-%%]\n", name);
+	exit(1);
+}
+
+int
+main (int argc, char **argv)
+{
+	enum rst_reason reason = REASON_DEFAULT_RST;
+	long crashes = 0;
+	int noise = 0, opt, status;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "n:e:c:")) != -1)
+		switch (opt) {
+		case 'n': wakeups = atol(optarg); break;
+		case 'e': noise   = atoi(optarg); break;
+		case 'c': crash   = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+		}
+
+	if (optind != argc || wakeups < 1 || noise < 0 || noise > 100 || crash < 0 || crash > 100)
+		usage(argv[0]);
+
+	if ((chip = shared(sizeof(*chip))) == NULL || (totals = shared(sizeof(*totals))) == NULL
+	 || (logged = shared(wakeups * sizeof(*logged))) == NULL) {
+		perror("mmap");
+		return 1;
+	}
+
+	chip->chipid = 0x00f10000;
+	chip->seed   = chip->chipid * 2654435761U | 1;
+	chip->vdd    = 3300 * 1024 / 1000;
+	chip->rssi   = -70;
+	chip->adc    = 512;
+	chip->clock  = 1700000000;
+	chip->mean   = 10 * 16;
+	chip->swing  = 5 * 16;
+	chip->phase  = 14 * 3600;
+	chip->noise  = noise;
+
+	// Each wakeup in a process of its own, so that the firmware's RAM
+	// starts afresh as it does after deep sleep:
+	for (long i = 0; i < wakeups; i++) {
+		if ((pid = fork()) < 0) {
+			perror("fork");
+			return 1;
+		}
+
+		if (pid == 0) {
+			wake(reason);
+			_exit(0);
+		}
+
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+			fprintf(stderr, "wakeup %ld died\n", i);
+			return 1;
+		}
+
+		switch (WEXITSTATUS(status)) {
+		case 0:
+			reason = REASON_DEEP_SLEEP_AWAKE;
+			break;
+
+		// A crashed probe reboots right away:
+		case EXIT_CRASH:
+			chip->clock = now();
+			reason = REASON_WDT_RST;
+			crashes++;
+			break;
+
+		default:
+			fprintf(stderr, "wakeup %ld failed the round trip\n", i);
+			return 1;
+		}
+	}
+
+	printf("%ld wakeups, %ld crashed, %lu payloads decoded and matched\n",
+		wakeups, crashes, totals->checked);
+
+	if (totals->alone > 0)
+		printf("current record alone:    JSON %5lu bytes, binary %4lu bytes, %.1fx smaller\n",
+			totals->alone_json / totals->alone, totals->alone_bin / totals->alone,
+			(double) totals->alone_json / totals->alone_bin);
+
+	if (totals->full > 0)
+		printf("with %2u logged records:  JSON %5lu bytes, binary %4lu bytes, %.1fx smaller\n",
+			FLASH_LOG_BATCH, totals->full_json / totals->full, totals->full_bin / totals->full,
+			(double) totals->full_json / totals->full_bin);
+
+	return 0;
+}
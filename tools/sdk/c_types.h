@@ -0,0 +1,19 @@
+// Stand-in for the SDK header of the same name, so that firmware modules
+// without hardware dependencies can be compiled into the host tools:
+#ifndef _C_TYPES_H_
+#define _C_TYPES_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t		uint8;
+typedef int8_t		sint8;
+typedef uint16_t	uint16;
+typedef int16_t		sint16;
+typedef uint32_t	uint32;
+typedef int32_t		sint32;
+
+#define ICACHE_FLASH_ATTR
+
+#endif
@@ -0,0 +1,8 @@
+// Stand-in for the SDK header of the same name, for the simulated chip in
+// chip.c:
+#ifndef _ETS_SYS_H
+#define _ETS_SYS_H
+
+#include <os_type.h>
+
+#endif
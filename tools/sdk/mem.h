@@ -0,0 +1,9 @@
+// Stand-in for the SDK header of the same name, for the simulated chip in
+// chip.c:
+#ifndef __MEM_H__
+#define __MEM_H__
+
+#define os_malloc(s)		pvPortMalloc(s, "", __LINE__)
+#define os_free(p)		vPortFree(p, "", __LINE__)
+
+#endif
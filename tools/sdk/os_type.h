@@ -0,0 +1,16 @@
+// Stand-in for the SDK header of the same name, for the simulated chip in
+// chip.c. Timers only keep their callback, they never fire by themselves:
+#ifndef _OS_TYPES_H_
+#define _OS_TYPES_H_
+
+#include <c_types.h>
+
+typedef void ETSTimerFunc (void *arg);
+typedef ETSTimerFunc os_timer_func_t;
+
+typedef struct {
+	ETSTimerFunc	*func;
+	void		*arg;
+} os_timer_t;
+
+#endif
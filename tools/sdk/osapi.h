@@ -0,0 +1,20 @@
+// Stand-in for the SDK header of the same name, for the simulated chip in
+// chip.c:
+#ifndef _OSAPI_H_
+#define _OSAPI_H_
+
+#include <string.h>
+#include <os_type.h>
+
+#define os_printf		os_printf_plus
+#define os_memcmp		memcmp
+#define os_memcpy		memcpy
+#define os_memset		memset
+#define os_strlen		strlen
+#define os_timer_arm(t, ms, rep)	ets_timer_arm_new(t, ms, rep, 1)
+#define os_timer_disarm		ets_timer_disarm
+#define os_timer_setfn		ets_timer_setfn
+
+unsigned long os_random (void);
+
+#endif
@@ -0,0 +1,18 @@
+// Stand-in for the SDK header of the same name, for the simulated chip in
+// chip.c:
+#ifndef SPI_FLASH_H
+#define SPI_FLASH_H
+
+#define SPI_FLASH_SEC_SIZE	4096
+
+typedef enum {
+	SPI_FLASH_RESULT_OK,
+	SPI_FLASH_RESULT_ERR,
+	SPI_FLASH_RESULT_TIMEOUT,
+} SpiFlashOpResult;
+
+SpiFlashOpResult spi_flash_erase_sector (uint16 sec);
+SpiFlashOpResult spi_flash_write (uint32 des_addr, uint32 *src_addr, uint32 size);
+SpiFlashOpResult spi_flash_read (uint32 src_addr, uint32 *des_addr, uint32 size);
+
+#endif
@@ -0,0 +1,36 @@
+// Stand-in for the SDK header of the same name, for the simulated chip in
+// chip.c:
+#ifndef __USER_INTERFACE_H__
+#define __USER_INTERFACE_H__
+
+#include <os_type.h>
+#include <spi_flash.h>
+
+enum rst_reason {
+	REASON_DEFAULT_RST,
+	REASON_WDT_RST,
+	REASON_EXCEPTION_RST,
+	REASON_SOFT_WDT_RST,
+	REASON_SOFT_RESTART,
+	REASON_DEEP_SLEEP_AWAKE,
+	REASON_EXT_SYS_RST,
+};
+
+struct rst_info {
+	uint32	reason;
+	uint32	exccause;
+	uint32	epc1;
+	uint32	epc2;
+	uint32	epc3;
+	uint32	excvaddr;
+	uint32	depc;
+};
+
+uint32 system_get_chip_id (void);
+uint32 system_get_time (void);
+uint16 system_adc_read (void);
+bool system_rtc_mem_read (uint8 src_addr, void *des_addr, uint16 save_size);
+bool system_rtc_mem_write (uint8 des_addr, const void *src_addr, uint16 save_size);
+sint8 wifi_station_get_rssi (void);
+
+#endif
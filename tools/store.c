@@ -0,0 +1,1506 @@
+// Append-only columnar store for probe readings, with one file per probe, or
+// rod, and one series per sensor on the rod.
+//
+// A rod file starts with a header page that lists the sensors by their ROM
+// address, followed by blocks. A block holds one window of STORE_WINDOW_SLOTS
+// slots, with a column per series: three bitmaps that hold the bits of the
+// sensor status for each slot, zero if there's no sample, followed by the
+// values of the slots that have a sample, as zig-zag varint deltas from the
+// previous one. Blocks are only ever appended. Samples for a window that
+// arrive after its block was written go into another block for the same
+// window, and later blocks take precedence when reading. The file is mapped
+// into memory for reading, so that scanning a rod over a long time range
+// reads it from front to back.
+//
+// The newest window is staged uncompressed in a memory-mapped head file next
+// to the rod file, and written out as a block once a later window starts.
+// Samples for older windows, such as the backlog of a probe that was offline,
+// are staged in memory, and written out when a sample for another older
+// window arrives, or when the store is synced.
+//
+// Every time a window is written out, the rollups of its samples by hour,
+// day and month are brought up to date in a sum file next to the rod file.
+// A rollup holds the number, sum, minimum and maximum of the successful
+// readings, and the highest status seen, as consolidation does on the probe.
+// The sum file is a sequence of pages, each with the rollups of one series
+// at one resolution for PAGE_BUCKETS buckets in a row. Hours are rolled up
+// from the slots, days from the hours and months from the days, so that
+// rolling up a window takes the window and the days and months it touches.
+// The rollups only cover written blocks; a range query rolls up the staged
+// windows on the fly.
+//
+// Open rods are kept in a hash table, and in a list from the most to the
+// least recently used. To stay within the limit on open files, opening a rod
+// closes the least recently used one when too many are open, after writing
+// out its staged older window and syncing it to disk, so that a later sync of
+// the store still covers it.
+//
+// The store may be used from several threads. The table and the list have a
+// lock of their own, and so does every rod: store_rod() returns the rod
+// locked, and it stays valid and to the caller alone until store_release().
+// Other threads can use other rods meanwhile. A thread must release its rod
+// before it asks for another one, or syncs or closes the store.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "ds18b20.h"
+#include "schedule.h"
+#include "store.h"
+
+#define ROD_MAGIC	"ROD1"
+#define BLOCK_MAGIC	0x4B4C4F42
+#define HEAD_MAGIC	0x44414548
+#define PAGE_MAGIC	0x4D555352
+
+// Buckets per page of rollups, and hours per window:
+#define PAGE_BUCKETS	1024
+#define WINDOW_HOURS	(STORE_WINDOW_SLOTS * STORE_PERIOD_SEC / 3600)
+
+#if 3600 % STORE_PERIOD_SEC || STORE_WINDOW_SLOTS * STORE_PERIOD_SEC % 3600
+#error "Windows must hold whole hours of whole slots"
+#endif
+
+#if STORE_PERIOD_SEC > SCHEDULE_MIN_SEC
+#error "Slots must not be longer than the shortest wakeup interval"
+#endif
+
+// Size of the header page, and of a status bitmap:
+#define HEADER_SIZE	4096
+#define PLANE_SIZE	(STORE_WINDOW_SLOTS / 8)
+#define STATUS_BITS	3
+
+// Largest block: every slot of every series set, with the longest varints:
+#define BLOCK_MAX	(sizeof(struct block_header) + STORE_SERIES_MAX * (STATUS_BITS * PLANE_SIZE + 3 * STORE_WINDOW_SLOTS) + 4)
+
+// Smallest mapping of a rod file; mappings grow by doubling:
+#define MAP_MIN		(1 << 20)
+
+// Rod file header:
+struct rod_header {
+	char		magic[4];
+	uint32_t	chipid;
+	uint32_t	period;
+	uint32_t	nseries;
+	uint8_t		rom[STORE_SERIES_MAX][8];
+};
+
+// Block header. Column offsets are from the start of the block:
+struct block_header {
+	uint32_t	magic;
+	uint32_t	window;
+	uint32_t	size;		// Including the header, a multiple of 4
+	uint32_t	offset[STORE_SERIES_MAX];	// Zero if no samples
+};
+
+// An uncompressed window, for staging:
+struct window {
+	uint32_t	magic;
+	uint32_t	window;
+	uint32_t	used;
+	int16_t		value[STORE_SERIES_MAX][STORE_WINDOW_SLOTS];
+	uint8_t		status[STORE_SERIES_MAX][STORE_WINDOW_SLOTS];
+};
+
+// Block index entry, sorted by window, then by offset:
+struct entry {
+	uint32_t	window;
+	uint64_t	offset;
+};
+
+// Rollup of the samples in a bucket, as stored:
+struct bucket {
+	int32_t		sum;
+	uint16_t	count;
+	int16_t		min;
+	int16_t		max;
+	uint8_t		status;
+	uint8_t		pad;
+};
+
+// Page of the sum file:
+struct page {
+	uint32_t	magic;
+	uint32_t	level;
+	uint32_t	series;
+	uint32_t	page;		// Number of the first bucket / PAGE_BUCKETS
+	struct bucket	bucket[PAGE_BUCKETS];
+};
+
+// Page index entry, sorted by key, which is made of level, series and page:
+struct page_entry {
+	uint64_t	key;
+	uint64_t	offset;
+};
+
+struct store_rod {
+	struct store	*store;
+	pthread_mutex_t	lock;		// Held from store_rod() to store_release()
+	struct store_rod *prev;		// More recently used rod, or NULL
+	struct store_rod *next;		// Less recently used rod, or NULL
+	uint32_t	chipid;
+	int		fd;
+	bool		writable;
+	struct rod_header header;
+	uint64_t	size;		// Size of the file up to the last block
+	const uint8_t	*map;
+	size_t		map_len;
+	struct window	*head;		// Mapped head file, or NULL
+	struct window	*late;		// Staged older window, or NULL
+	struct entry	*index;
+	size_t		nindex;
+	size_t		index_len;
+	int		sum_fd;		// Sum file, or -1 if there is none
+	uint64_t	sum_size;
+	struct page_entry *pages;
+	size_t		npages;
+	size_t		pages_len;
+	struct page	page;		// Last page read or written
+	uint64_t	page_key;	// Its key, or UINT64_MAX
+	struct bucket	hours[WINDOW_HOURS];	// Last window rolled up by hours
+	uint64_t	hours_key;	// Its window, series and staged, or UINT64_MAX
+};
+
+struct store {
+	char		*dir;
+	bool		writable;
+	pthread_mutex_t	lock;		// Guards the table and the list
+	struct store_rod **rods;	// Hash table of the open rods
+	size_t		rods_len;	// Its size, a power of two
+	size_t		nrods;
+	size_t		open_max;	// Most rods to keep open
+	struct store_rod *first;	// Most recently used rod
+	struct store_rod *last;		// Least recently used rod
+};
+
+static inline uint32_t
+zigzag (const int32_t val)
+{
+	return ((uint32_t) val << 1) ^ (uint32_t) (val >> 31);
+}
+
+static inline int32_t
+unzigzag (const uint32_t val)
+{
+	return (int32_t) (val >> 1) ^ -(int32_t) (val & 1);
+}
+
+static uint8_t *
+put_varint (uint8_t *p, uint32_t val)
+{
+	for (; val >= 0x80; val >>= 7)
+		*p++ = val | 0x80;
+
+	*p++ = val;
+	return p;
+}
+
+// Fetch unsigned varint, return NULL if it runs past the end
+static const uint8_t *
+get_varint (const uint8_t *p, const uint8_t *end, uint32_t *val)
+{
+	*val = 0;
+
+	for (int shift = 0; p < end && shift < 35; shift += 7) {
+		*val |= (uint32_t) (*p & 0x7F) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+
+	return NULL;
+}
+
+// Encode a window into a block, return its size, or zero if it's empty
+static size_t
+block_encode (uint8_t *buf, const struct window *w, const size_t nseries)
+{
+	struct block_header *bh = (struct block_header *) buf;
+	uint8_t *p = buf + sizeof(*bh);
+
+	memset(bh, 0, sizeof(*bh));
+	bh->magic  = BLOCK_MAGIC;
+	bh->window = w->window;
+
+	for (size_t s = 0; s < nseries; s++) {
+		uint8_t *planes = p, *q = p + STATUS_BITS * PLANE_SIZE;
+		int16_t prev = 0;
+		bool any = false;
+
+		memset(planes, 0, STATUS_BITS * PLANE_SIZE);
+
+		for (size_t slot = 0; slot < STORE_WINDOW_SLOTS; slot++) {
+			const uint8_t status = w->status[s][slot];
+
+			if (status == 0)
+				continue;
+
+			for (int b = 0; b < STATUS_BITS; b++)
+				if (status & (1 << b))
+					planes[b * PLANE_SIZE + slot / 8] |= 1 << (slot % 8);
+
+			q = put_varint(q, zigzag(w->value[s][slot] - prev));
+			prev = w->value[s][slot];
+			any  = true;
+		}
+
+		if (!any)
+			continue;
+
+		bh->offset[s] = p - buf;
+		p = q;
+	}
+
+	if (p == buf + sizeof(*bh))
+		return 0;
+
+	while ((p - buf) % 4)
+		*p++ = 0;
+
+	return bh->size = p - buf;
+}
+
+// Decode a series from a block into a window's values and statuses
+static void
+block_decode (const uint8_t *block, const int series, int16_t *value, uint8_t *status)
+{
+	const struct block_header *bh = (const struct block_header *) block;
+	const uint8_t *planes, *p, *end = block + bh->size;
+	int32_t prev = 0;
+	uint32_t delta;
+
+	if (bh->offset[series] == 0)
+		return;
+
+	planes = block + bh->offset[series];
+	p = planes + STATUS_BITS * PLANE_SIZE;
+
+	for (size_t byte = 0; byte < PLANE_SIZE; byte++) {
+		uint8_t bits[STATUS_BITS], any = 0;
+
+		// Skip eight empty slots at a time:
+		for (int b = 0; b < STATUS_BITS; b++)
+			any |= bits[b] = planes[b * PLANE_SIZE + byte];
+
+		if (any == 0)
+			continue;
+
+		for (size_t slot = byte * 8; any != 0; slot++, any >>= 1) {
+			uint8_t st = 0;
+
+			if (!(any & 1))
+				continue;
+
+			for (int b = 0; b < STATUS_BITS; b++)
+				st |= ((bits[b] >> (slot % 8)) & 1) << b;
+
+			if ((p = get_varint(p, end, &delta)) == NULL)
+				return;
+
+			prev += unzigzag(delta);
+			value[slot]  = prev;
+			status[slot] = st;
+		}
+	}
+}
+
+// Copy a staged window's samples for a series over the decoded ones
+static void
+window_overlay (const struct window *w, const int series, int16_t *value, uint8_t *status)
+{
+	for (size_t slot = 0; slot < STORE_WINDOW_SLOTS; slot++)
+		if (w->status[series][slot] != 0) {
+			value[slot]  = w->value[series][slot];
+			status[slot] = w->status[series][slot];
+		}
+}
+
+// Add a block to the index, keeping it sorted
+static bool
+index_add (struct store_rod *rod, const uint32_t window, const uint64_t offset)
+{
+	size_t i;
+
+	if (rod->nindex == rod->index_len) {
+		const size_t len = rod->index_len ? rod->index_len * 2 : 64;
+		struct entry *index = realloc(rod->index, len * sizeof(*index));
+
+		if (index == NULL)
+			return false;
+
+		rod->index     = index;
+		rod->index_len = len;
+	}
+
+	// Blocks mostly arrive in order, so search from the end:
+	for (i = rod->nindex; i > 0 && rod->index[i - 1].window > window; i--)
+		rod->index[i] = rod->index[i - 1];
+
+	rod->index[i].window = window;
+	rod->index[i].offset = offset;
+	rod->nindex++;
+	return true;
+}
+
+// Find the first index entry at or after a window
+static size_t
+index_find (const struct store_rod *rod, const uint32_t window)
+{
+	size_t lo = 0, hi = rod->nindex;
+
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+
+		if (rod->index[mid].window < window)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// Map the rod file up to the given size at least
+static bool
+rod_map (struct store_rod *rod, const uint64_t size)
+{
+	size_t len = rod->map_len ? rod->map_len : MAP_MIN;
+	void *map;
+
+	if (size <= rod->map_len)
+		return true;
+
+	while (len < size)
+		len *= 2;
+
+	if ((map = mmap(NULL, len, PROT_READ, MAP_SHARED, rod->fd, 0)) == MAP_FAILED)
+		return false;
+
+	if (rod->map != NULL)
+		munmap((void *) rod->map, rod->map_len);
+
+	rod->map     = map;
+	rod->map_len = len;
+	return true;
+}
+
+// Index the blocks that were added to the rod file since the last call. A
+// torn block at the end, from a crash while writing, is cut off:
+static bool
+rod_refresh (struct store_rod *rod)
+{
+	struct stat st;
+	uint64_t off = rod->size;
+
+	if (fstat(rod->fd, &st) < 0)
+		return false;
+
+	if ((uint64_t) st.st_size <= rod->size)
+		return true;
+
+	if (!rod_map(rod, st.st_size))
+		return false;
+
+	while (off + sizeof(struct block_header) <= (uint64_t) st.st_size) {
+		const struct block_header *bh = (const struct block_header *) (rod->map + off);
+
+		if (bh->magic != BLOCK_MAGIC || bh->size < sizeof(*bh) || bh->size % 4 || off + bh->size > (uint64_t) st.st_size)
+			break;
+
+		if (!index_add(rod, bh->window, off))
+			return false;
+
+		off += bh->size;
+	}
+
+	if (off < (uint64_t) st.st_size && rod->writable) {
+		fprintf(stderr, "store: %08x: cutting off torn block at %llu\n", rod->chipid, (unsigned long long) off);
+		if (ftruncate(rod->fd, off) < 0)
+			return false;
+	}
+
+	rod->size = off;
+	return true;
+}
+
+// Map the head file, creating it if needed
+static bool
+head_open (struct store *store, struct store_rod *rod)
+{
+	char path[4096];
+	struct stat st;
+	void *map;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%08x.head", store->dir, rod->chipid);
+
+	if ((fd = open(path, rod->writable ? O_RDWR | O_CREAT : O_RDONLY, 0644)) < 0)
+		return !rod->writable && errno == ENOENT;
+
+	if (fstat(fd, &st) < 0 || (rod->writable && st.st_size < (off_t) sizeof(struct window) && ftruncate(fd, sizeof(struct window)) < 0)) {
+		close(fd);
+		return false;
+	}
+
+	if (!rod->writable && st.st_size < (off_t) sizeof(struct window)) {
+		close(fd);
+		return true;
+	}
+
+	map = mmap(NULL, sizeof(struct window), rod->writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	rod->head = map;
+
+	if (rod->writable && rod->head->magic != HEAD_MAGIC) {
+		memset(rod->head, 0, sizeof(struct window));
+		rod->head->magic = HEAD_MAGIC;
+	}
+
+	return true;
+}
+
+// Add a sample to a rollup. Only successful readings count, but the status
+// is the highest seen, as in consolidation:
+static void
+bucket_add (struct bucket *b, const int16_t value, const uint8_t status)
+{
+	if (status > b->status)
+		b->status = status;
+
+	if (status != DS18B20_SUCCESS)
+		return;
+
+	if (b->count == 0 || value < b->min)
+		b->min = value;
+	if (b->count == 0 || value > b->max)
+		b->max = value;
+
+	b->sum += value;
+	b->count++;
+}
+
+static void
+bucket_merge (struct bucket *dst, const struct bucket *src)
+{
+	if (src->status > dst->status)
+		dst->status = src->status;
+
+	if (src->count == 0)
+		return;
+
+	if (dst->count == 0 || src->min < dst->min)
+		dst->min = src->min;
+	if (dst->count == 0 || src->max > dst->max)
+		dst->max = src->max;
+
+	dst->sum   += src->sum;
+	dst->count += src->count;
+}
+
+// Get the bucket that a time falls in
+static uint32_t
+bucket_of (const enum store_level level, const uint64_t time)
+{
+	const time_t t = time;
+	struct tm tm;
+
+	switch (level) {
+	case STORE_SLOT:
+		return time / STORE_PERIOD_SEC;
+
+	case STORE_HOUR:
+		return time / 3600;
+
+	case STORE_DAY:
+		return time / 86400;
+
+	case STORE_MONTH:
+		gmtime_r(&t, &tm);
+		return (tm.tm_year - 70) * 12 + tm.tm_mon;
+	}
+
+	return 0;
+}
+
+// Get the start time of a bucket
+static uint64_t
+bucket_start (const enum store_level level, const uint32_t bucket)
+{
+	struct tm tm = { .tm_mday = 1 };
+
+	switch (level) {
+	case STORE_SLOT:
+		return (uint64_t) bucket * STORE_PERIOD_SEC;
+
+	case STORE_HOUR:
+		return (uint64_t) bucket * 3600;
+
+	case STORE_DAY:
+		return (uint64_t) bucket * 86400;
+
+	case STORE_MONTH:
+		tm.tm_year = 70 + bucket / 12;
+		tm.tm_mon  = bucket % 12;
+		return timegm(&tm);
+	}
+
+	return 0;
+}
+
+static inline uint64_t
+page_key (const enum store_level level, const int series, const uint32_t page)
+{
+	return (uint64_t) level << 40 | (uint64_t) series << 32 | page;
+}
+
+// Find the entry of a page in the index, or where it would go
+static size_t
+page_find (const struct store_rod *rod, const uint64_t key)
+{
+	size_t lo = 0, hi = rod->npages;
+
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+
+		if (rod->pages[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// Add a page to the index, keeping it sorted
+static bool
+page_add (struct store_rod *rod, const uint64_t key, const uint64_t offset)
+{
+	const size_t i = page_find(rod, key);
+
+	if (i < rod->npages && rod->pages[i].key == key) {
+		rod->pages[i].offset = offset;
+		return true;
+	}
+
+	if (rod->npages == rod->pages_len) {
+		const size_t len = rod->pages_len ? rod->pages_len * 2 : 64;
+		struct page_entry *pages = realloc(rod->pages, len * sizeof(*pages));
+
+		if (pages == NULL)
+			return false;
+
+		rod->pages     = pages;
+		rod->pages_len = len;
+	}
+
+	memmove(rod->pages + i + 1, rod->pages + i, (rod->npages - i) * sizeof(*rod->pages));
+	rod->pages[i].key    = key;
+	rod->pages[i].offset = offset;
+	rod->npages++;
+	return true;
+}
+
+// Index the pages that were added to the sum file since the last call. A
+// torn page at the end is cut off:
+static bool
+sum_refresh (struct store_rod *rod)
+{
+	struct stat st;
+
+	if (rod->sum_fd < 0)
+		return true;
+
+	if (fstat(rod->sum_fd, &st) < 0)
+		return false;
+
+	// Pages are updated in place:
+	rod->page_key = UINT64_MAX;
+
+	while (rod->sum_size + sizeof(struct page) <= (uint64_t) st.st_size) {
+		struct page pg;
+
+		if (pread(rod->sum_fd, &pg, offsetof(struct page, bucket), rod->sum_size) != offsetof(struct page, bucket) || pg.magic != PAGE_MAGIC)
+			break;
+
+		if (!page_add(rod, page_key(pg.level, pg.series, pg.page), rod->sum_size))
+			return false;
+
+		rod->sum_size += sizeof(struct page);
+	}
+
+	if (rod->sum_size < (uint64_t) st.st_size && rod->writable) {
+		fprintf(stderr, "store: %08x: cutting off torn rollups at %llu\n", rod->chipid, (unsigned long long) rod->sum_size);
+		if (ftruncate(rod->sum_fd, rod->sum_size) < 0)
+			return false;
+	}
+
+	return true;
+}
+
+// Read a page of rollups. A page that doesn't exist reads as empty:
+static const struct page *
+page_get (struct store_rod *rod, const enum store_level level, const int series, const uint32_t page)
+{
+	const uint64_t key = page_key(level, series, page);
+	const size_t i = page_find(rod, key);
+
+	if (rod->page_key == key)
+		return &rod->page;
+
+	if (i == rod->npages || rod->pages[i].key != key
+	 || pread(rod->sum_fd, &rod->page, sizeof(rod->page), rod->pages[i].offset) != sizeof(rod->page))
+		memset(&rod->page, 0, sizeof(rod->page));
+
+	rod->page_key = key;
+	return &rod->page;
+}
+
+// Write rollups of consecutive buckets, adding pages as needed
+static bool
+sum_put (struct store_rod *rod, const enum store_level level, const int series, uint32_t first, size_t n, const struct bucket *b)
+{
+	while (n > 0) {
+		const uint32_t page = first / PAGE_BUCKETS, slot = first % PAGE_BUCKETS;
+		const size_t len = (n < PAGE_BUCKETS - slot) ? n : PAGE_BUCKETS - slot;
+		const uint64_t key = page_key(level, series, page);
+		const size_t i = page_find(rod, key);
+
+		if (i < rod->npages && rod->pages[i].key == key) {
+			const uint64_t offset = rod->pages[i].offset + offsetof(struct page, bucket) + slot * sizeof(*b);
+
+			if (pwrite(rod->sum_fd, b, len * sizeof(*b), offset) != (ssize_t) (len * sizeof(*b)))
+				return false;
+
+			if (rod->page_key == key)
+				memcpy(rod->page.bucket + slot, b, len * sizeof(*b));
+		}
+		else {
+			struct page *pg = &rod->page;
+
+			memset(pg, 0, sizeof(*pg));
+			pg->magic  = PAGE_MAGIC;
+			pg->level  = level;
+			pg->series = series;
+			pg->page   = page;
+			memcpy(pg->bucket + slot, b, len * sizeof(*b));
+			rod->page_key = key;
+
+			if (pwrite(rod->sum_fd, pg, sizeof(*pg), rod->sum_size) != sizeof(*pg))
+				return false;
+
+			if (!page_add(rod, key, rod->sum_size))
+				return false;
+
+			rod->sum_size += sizeof(*pg);
+		}
+
+		first += len;
+		n     -= len;
+		b     += len;
+	}
+
+	return true;
+}
+
+// Roll up a series in a window by hours, from the written blocks, and the
+// staged samples if asked
+static const struct bucket *
+window_hours (struct store_rod *rod, const int series, const uint32_t window, const bool staged)
+{
+	const uint64_t key = (uint64_t) window << 32 | (uint64_t) series << 1 | staged;
+	int16_t value[STORE_WINDOW_SLOTS];
+	uint8_t status[STORE_WINDOW_SLOTS];
+
+	if (rod->hours_key == key)
+		return rod->hours;
+
+	store_window(rod, series, window, UINT64_MAX, staged, value, status);
+	memset(rod->hours, 0, sizeof(rod->hours));
+
+	for (size_t slot = 0; slot < STORE_WINDOW_SLOTS; slot++)
+		bucket_add(&rod->hours[slot / (3600 / STORE_PERIOD_SEC)], value[slot], status[slot]);
+
+	rod->hours_key = key;
+	return rod->hours;
+}
+
+// Check whether any window in a range is staged
+static bool
+staged_in (const struct store_rod *rod, const uint64_t first, const uint64_t last)
+{
+	uint32_t windows[2];
+	const size_t n = store_staged(rod, windows);
+
+	for (size_t i = 0; i < n; i++)
+		if (windows[i] >= first && windows[i] <= last)
+			return true;
+
+	return false;
+}
+
+static void rollup_get (struct store_rod *rod, const enum store_level level, const int series, const uint32_t bucket, const bool staged, struct bucket *out);
+
+// Roll up a bucket from the buckets of the next finer level in it
+static void
+rollup_merge (struct store_rod *rod, const enum store_level level, const int series, const uint32_t bucket, const bool staged, struct bucket *out)
+{
+	const enum store_level finer = level - 1;
+	const uint32_t last = bucket_of(finer, bucket_start(level, bucket + 1));
+
+	memset(out, 0, sizeof(*out));
+
+	for (uint32_t b = bucket_of(finer, bucket_start(level, bucket)); b < last; b++) {
+		struct bucket part;
+
+		rollup_get(rod, finer, series, b, staged, &part);
+		bucket_merge(out, &part);
+	}
+}
+
+// Get the rollup of a bucket. It is read from the sum file, unless the
+// staged samples are asked for and fall in it, or there is no sum file:
+static void
+rollup_get (struct store_rod *rod, const enum store_level level, const int series, const uint32_t bucket, const bool staged, struct bucket *out)
+{
+	const uint64_t first = bucket_start(level, bucket) / 3600 / WINDOW_HOURS;
+	const uint64_t last  = (bucket_start(level, bucket + 1) / 3600 - 1) / WINDOW_HOURS;
+
+	if (rod->sum_fd >= 0 && !(staged && staged_in(rod, first, last)))
+		*out = page_get(rod, level, series, bucket / PAGE_BUCKETS)->bucket[bucket % PAGE_BUCKETS];
+	else if (level == STORE_HOUR)
+		*out = window_hours(rod, series, bucket / WINDOW_HOURS, staged)[bucket % WINDOW_HOURS];
+	else
+		rollup_merge(rod, level, series, bucket, staged, out);
+}
+
+// Bring the rollups up to date with the blocks of a window: its hours, and
+// the days and months that it touches
+static bool
+sum_window (struct store_rod *rod, const uint32_t window)
+{
+	const uint64_t first = (uint64_t) window * WINDOW_HOURS * 3600;
+	const uint64_t last  = first + WINDOW_HOURS * 3600 - 1;
+
+	if (rod->sum_fd < 0)
+		return true;
+
+	rod->hours_key = UINT64_MAX;
+
+	for (size_t s = 0; s < rod->header.nseries; s++) {
+		if (!sum_put(rod, STORE_HOUR, s, window * WINDOW_HOURS, WINDOW_HOURS, window_hours(rod, s, window, false)))
+			return false;
+
+		for (enum store_level level = STORE_DAY; level <= STORE_MONTH; level++)
+			for (uint32_t b = bucket_of(level, first); b <= bucket_of(level, last); b++) {
+				struct bucket sum;
+
+				rollup_merge(rod, level, s, b, false, &sum);
+
+				if (!sum_put(rod, level, s, b, 1, &sum))
+					return false;
+			}
+	}
+
+	return true;
+}
+
+// Open the sum file, creating it if needed. A new sum file for a rod that
+// already has blocks, from before there were rollups, is filled in:
+static bool
+sum_open (struct store *store, struct store_rod *rod)
+{
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/%08x.sum", store->dir, rod->chipid);
+
+	if ((rod->sum_fd = open(path, rod->writable ? O_RDWR | O_CREAT : O_RDONLY, 0644)) < 0)
+		return !rod->writable && errno == ENOENT;
+
+	if (!sum_refresh(rod))
+		return false;
+
+	if (rod->writable && rod->sum_size == 0)
+		for (size_t i = 0; i < rod->nindex; i++)
+			if ((i == 0 || rod->index[i].window != rod->index[i - 1].window) && !sum_window(rod, rod->index[i].window))
+				return false;
+
+	return true;
+}
+
+static void
+rod_free (struct store_rod *rod)
+{
+	if (rod->map != NULL)
+		munmap((void *) rod->map, rod->map_len);
+
+	if (rod->head != NULL)
+		munmap(rod->head, sizeof(struct window));
+
+	if (rod->fd >= 0)
+		close(rod->fd);
+
+	if (rod->sum_fd >= 0)
+		close(rod->sum_fd);
+
+	free(rod->late);
+	free(rod->index);
+	free(rod->pages);
+	pthread_mutex_destroy(&rod->lock);
+	free(rod);
+}
+
+// Open a rod file, or create it
+static struct store_rod *
+rod_open (struct store *store, const uint32_t chipid, const bool create)
+{
+	struct store_rod *rod;
+	char path[4096];
+	struct stat st;
+
+	if ((rod = calloc(1, sizeof(*rod))) == NULL)
+		return NULL;
+
+	pthread_mutex_init(&rod->lock, NULL);
+	rod->store     = store;
+	rod->chipid    = chipid;
+	rod->writable  = store->writable;
+	rod->sum_fd    = -1;
+	rod->page_key  = UINT64_MAX;
+	rod->hours_key = UINT64_MAX;
+
+	snprintf(path, sizeof(path), "%s/%08x.rod", store->dir, chipid);
+
+	if ((rod->fd = open(path, rod->writable ? O_RDWR | (create ? O_CREAT : 0) : O_RDONLY, 0644)) < 0 || fstat(rod->fd, &st) < 0)
+		goto fail;
+
+	if (st.st_size == 0) {
+		memcpy(rod->header.magic, ROD_MAGIC, 4);
+		rod->header.chipid = chipid;
+		rod->header.period = STORE_PERIOD_SEC;
+
+		if (ftruncate(rod->fd, HEADER_SIZE) < 0 || pwrite(rod->fd, &rod->header, sizeof(rod->header), 0) != sizeof(rod->header))
+			goto fail;
+	}
+	else if (pread(rod->fd, &rod->header, sizeof(rod->header), 0) != sizeof(rod->header)
+	      || memcmp(rod->header.magic, ROD_MAGIC, 4) != 0
+	      || rod->header.chipid != chipid
+	      || rod->header.period != STORE_PERIOD_SEC
+	      || rod->header.nseries > STORE_SERIES_MAX) {
+		fprintf(stderr, "store: %s: bad header\n", path);
+		goto fail;
+	}
+
+	rod->size = HEADER_SIZE;
+
+	if (!rod_refresh(rod) || !head_open(store, rod) || !sum_open(store, rod))
+		goto fail;
+
+	return rod;
+
+fail:	rod_free(rod);
+	return NULL;
+}
+
+// Write a staged window out as a block, and clear it
+static bool
+window_flush (struct store_rod *rod, struct window *w)
+{
+	uint8_t *buf;
+	size_t size;
+
+	if (!w->used)
+		return true;
+
+	// Rods are written from several threads, so every flush encodes into a
+	// buffer of its own:
+	if ((buf = malloc(BLOCK_MAX)) == NULL)
+		return false;
+
+	if ((size = block_encode(buf, w, rod->header.nseries)) > 0) {
+		if (pwrite(rod->fd, buf, size, rod->size) != (ssize_t) size)
+			goto fail;
+
+		if (!index_add(rod, w->window, rod->size))
+			goto fail;
+
+		rod->size += size;
+
+		if (!rod_map(rod, rod->size) || !sum_window(rod, w->window))
+			goto fail;
+	}
+
+	free(buf);
+	memset(w->value, 0, sizeof(w->value));
+	memset(w->status, 0, sizeof(w->status));
+	w->used = 0;
+	return true;
+
+fail:	free(buf);
+	return false;
+}
+
+// Open a store in a directory. A store opened for reading only never
+// changes the files:
+struct store *
+store_open (const char *dir, const bool writable)
+{
+	struct store *store;
+	struct rlimit rl;
+
+	if ((store = calloc(1, sizeof(*store))) == NULL)
+		return NULL;
+
+	store->open_max = STORE_RODS_OPEN;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur / 4 < store->open_max)
+		store->open_max = (rl.rlim_cur / 4 > 1) ? rl.rlim_cur / 4 : 1;
+
+	// Keep the hash table at most half full:
+	for (store->rods_len = 2; store->rods_len < store->open_max * 2; store->rods_len *= 2)
+		continue;
+
+	if ((store->dir = strdup(dir)) == NULL || (store->rods = calloc(store->rods_len, sizeof(*store->rods))) == NULL) {
+		free(store->dir);
+		free(store);
+		return NULL;
+	}
+
+	pthread_mutex_init(&store->lock, NULL);
+	store->writable = writable;
+	return store;
+}
+
+// Slot of a rod in the hash table, or the free slot where it would go
+static size_t
+rod_slot (const struct store *store, const uint32_t chipid)
+{
+	const size_t mask = store->rods_len - 1;
+	size_t i = (chipid * 2654435761U) & mask;
+
+	while (store->rods[i] != NULL && store->rods[i]->chipid != chipid)
+		i = (i + 1) & mask;
+
+	return i;
+}
+
+// Take a rod out of the hash table, moving up the rods after it that would
+// otherwise no longer be found
+static void
+rod_unhash (struct store *store, const struct store_rod *rod)
+{
+	const size_t mask = store->rods_len - 1;
+	size_t i = rod_slot(store, rod->chipid), j = i;
+
+	store->rods[i] = NULL;
+
+	while (store->rods[j = (j + 1) & mask] != NULL) {
+		const size_t k = (store->rods[j]->chipid * 2654435761U) & mask;
+
+		// Leave the rod if its home slot is between the hole and it:
+		if ((j > i) ? (k > i && k <= j) : (k > i || k <= j))
+			continue;
+
+		store->rods[i] = store->rods[j];
+		store->rods[j] = NULL;
+		i = j;
+	}
+
+	store->nrods--;
+}
+
+// Take a rod out of the list
+static void
+rod_unlink (struct store *store, struct store_rod *rod)
+{
+	*(rod->prev ? &rod->prev->next : &store->first) = rod->next;
+	*(rod->next ? &rod->next->prev : &store->last)  = rod->prev;
+	rod->prev = rod->next = NULL;
+}
+
+// Put a rod at the front of the list
+static void
+rod_touch (struct store *store, struct store_rod *rod)
+{
+	if (store->first == rod)
+		return;
+
+	if (rod->prev != NULL || store->last == rod)
+		rod_unlink(store, rod);
+
+	rod->next = store->first;
+	*(store->first ? &store->first->prev : &store->last) = rod;
+	store->first = rod;
+}
+
+// Write out the staged older window of a rod, and flush it to disk
+static bool
+rod_sync (struct store_rod *rod)
+{
+	if (!rod->writable)
+		return true;
+
+	if (rod->late != NULL && !window_flush(rod, rod->late))
+		return false;
+
+	return msync(rod->head, sizeof(struct window), MS_SYNC) == 0
+	    && fsync(rod->fd) == 0
+	    && fsync(rod->sum_fd) == 0;
+}
+
+static int
+chipid_cmp (const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+// List the chip IDs of the probes in the store, in order. The caller frees
+// the list:
+bool
+store_list (struct store *store, uint32_t **chipids, size_t *n)
+{
+	struct dirent *de;
+	size_t len = 0;
+	DIR *dir;
+
+	if ((dir = opendir(store->dir)) == NULL)
+		return false;
+
+	*chipids = NULL;
+	*n = 0;
+
+	while ((de = readdir(dir)) != NULL) {
+		uint32_t chipid;
+		char suffix[8];
+
+		if (strlen(de->d_name) != 12 || sscanf(de->d_name, "%8x.%4s", &chipid, suffix) != 2 || strcmp(suffix, "rod") != 0)
+			continue;
+
+		if (*n == len) {
+			uint32_t *list;
+
+			len = len ? len * 2 : 256;
+			if ((list = realloc(*chipids, len * sizeof(*list))) == NULL) {
+				free(*chipids);
+				closedir(dir);
+				return false;
+			}
+
+			*chipids = list;
+		}
+
+		(*chipids)[(*n)++] = chipid;
+	}
+
+	closedir(dir);
+	qsort(*chipids, *n, sizeof(**chipids), chipid_cmp);
+	return true;
+}
+
+// Write out the staged older windows, and flush everything to disk
+bool
+store_sync (struct store *store)
+{
+	bool ok = true;
+
+	if (!store->writable)
+		return true;
+
+	// Wait for each rod in turn, and leave the others to their threads:
+	pthread_mutex_lock(&store->lock);
+
+	for (struct store_rod *rod = store->first; rod != NULL; rod = rod->next) {
+		pthread_mutex_lock(&rod->lock);
+
+		if (!rod_sync(rod))
+			ok = false;
+
+		pthread_mutex_unlock(&rod->lock);
+	}
+
+	pthread_mutex_unlock(&store->lock);
+	return ok;
+}
+
+void
+store_close (struct store *store)
+{
+	if (!store_sync(store))
+		perror("store_sync");
+
+	while (store->first != NULL) {
+		struct store_rod *rod = store->first;
+
+		rod_unlink(store, rod);
+		rod_free(rod);
+	}
+
+	pthread_mutex_destroy(&store->lock);
+	free(store->rods);
+	free(store->dir);
+	free(store);
+}
+
+// Find a rod by chip ID, loading or creating it as needed, and lock it. The
+// least recently used rod is closed if too many are open
+struct store_rod *
+store_rod (struct store *store, const uint32_t chipid, const bool create)
+{
+	struct store_rod *rod;
+
+	pthread_mutex_lock(&store->lock);
+
+	if ((rod = store->rods[rod_slot(store, chipid)]) == NULL) {
+		if (store->nrods == store->open_max) {
+			struct store_rod *old = store->last;
+
+			// Only a thread that holds the table waits for a rod, so
+			// once the rod is ours, nobody else is waiting for it:
+			pthread_mutex_lock(&old->lock);
+
+			if (!rod_sync(old)) {
+				fprintf(stderr, "store: %08x: couldn't sync: %s\n", old->chipid, strerror(errno));
+				pthread_mutex_unlock(&old->lock);
+				pthread_mutex_unlock(&store->lock);
+				return NULL;
+			}
+
+			rod_unhash(store, old);
+			rod_unlink(store, old);
+			pthread_mutex_unlock(&old->lock);
+			rod_free(old);
+		}
+
+		if ((rod = rod_open(store, chipid, create && store->writable)) == NULL) {
+			pthread_mutex_unlock(&store->lock);
+			return NULL;
+		}
+
+		store->rods[rod_slot(store, chipid)] = rod;
+		store->nrods++;
+	}
+
+	rod_touch(store, rod);
+	pthread_mutex_lock(&rod->lock);
+	pthread_mutex_unlock(&store->lock);
+	return rod;
+}
+
+// Unlock a rod returned by store_rod(). It isn't valid after this
+void
+store_release (struct store_rod *rod)
+{
+	pthread_mutex_unlock(&rod->lock);
+}
+
+// Find a series by sensor ROM address, adding it as needed. Returns -1 if
+// there's no such series:
+int
+store_series (struct store_rod *rod, const uint8_t *rom, const bool create)
+{
+	struct rod_header *h = &rod->header;
+
+	for (uint32_t s = 0; s < h->nseries; s++)
+		if (memcmp(h->rom[s], rom, 8) == 0)
+			return s;
+
+	if (!create || !rod->writable || h->nseries == STORE_SERIES_MAX)
+		return -1;
+
+	memcpy(h->rom[h->nseries++], rom, 8);
+
+	if (pwrite(rod->fd, h, sizeof(*h), 0) != sizeof(*h)) {
+		h->nseries--;
+		return -1;
+	}
+
+	return h->nseries - 1;
+}
+
+size_t
+store_nseries (const struct store_rod *rod)
+{
+	return rod->header.nseries;
+}
+
+const uint8_t *
+store_rom (const struct store_rod *rod, const int series)
+{
+	return rod->header.rom[series];
+}
+
+// Add a sample. A later sample for the same slot replaces an earlier one:
+bool
+store_append (struct store_rod *rod, const int series, const uint32_t time, const int16_t value, const uint8_t status)
+{
+	const uint32_t slot   = time / STORE_PERIOD_SEC;
+	const uint32_t window = slot / STORE_WINDOW_SLOTS;
+	struct window *w = rod->head;
+
+	if (!rod->writable || series < 0 || (uint32_t) series >= rod->header.nseries)
+		return false;
+
+	if (status == 0 || status >= (1 << STATUS_BITS))
+		return false;
+
+	if (w->used && window > w->window && !window_flush(rod, w))
+		return false;
+
+	// An older window is staged apart:
+	if (w->used && window < w->window) {
+		if (rod->late == NULL && (rod->late = calloc(1, sizeof(struct window))) == NULL)
+			return false;
+
+		if (rod->late->used && rod->late->window != window && !window_flush(rod, rod->late))
+			return false;
+
+		w = rod->late;
+	}
+
+	w->used   = 1;
+	w->window = window;
+	rod->hours_key = UINT64_MAX;
+	w->value[series][slot % STORE_WINDOW_SLOTS]  = value;
+	w->status[series][slot % STORE_WINDOW_SLOTS] = status;
+	return true;
+}
+
+// Pick up blocks and rollups written by another process, or by ourselves
+bool
+store_refresh (struct store_rod *rod)
+{
+	return rod->writable ? rod_map(rod, rod->size) : rod_refresh(rod) && sum_refresh(rod);
+}
+
+// Size of the rod file up to its last block. The file only grows, so blocks
+// before an earlier size are as they were then:
+uint64_t
+store_size (const struct store_rod *rod)
+{
+	return rod->size;
+}
+
+// Offset just past the last block of a window, or zero if it has none
+uint64_t
+store_written (const struct store_rod *rod, const uint32_t window)
+{
+	uint64_t end = 0;
+
+	for (size_t i = index_find(rod, window); i < rod->nindex && rod->index[i].window == window; i++) {
+		const struct block_header *bh = (const struct block_header *) (rod->map + rod->index[i].offset);
+
+		if (rod->index[i].offset + bh->size > end)
+			end = rod->index[i].offset + bh->size;
+	}
+
+	return end;
+}
+
+// Get the windows that are staged rather than written as blocks, at most
+// two. Returns their number:
+size_t
+store_staged (const struct store_rod *rod, uint32_t *windows)
+{
+	size_t n = 0;
+
+	if (rod->head != NULL && rod->head->used)
+		windows[n++] = rod->head->window;
+
+	if (rod->late != NULL && rod->late->used)
+		windows[n++] = rod->late->window;
+
+	return n;
+}
+
+// Find the first window at or after the given one that has samples
+bool
+store_next (const struct store_rod *rod, const uint32_t from, uint32_t *window)
+{
+	const size_t i = index_find(rod, from);
+	bool found = false;
+
+	if (i < rod->nindex) {
+		*window = rod->index[i].window;
+		found = true;
+	}
+
+	if (rod->head != NULL && rod->head->used && rod->head->window >= from && (!found || rod->head->window < *window)) {
+		*window = rod->head->window;
+		found = true;
+	}
+
+	if (rod->late != NULL && rod->late->used && rod->late->window >= from && (!found || rod->late->window < *window)) {
+		*window = rod->late->window;
+		found = true;
+	}
+
+	return found;
+}
+
+// Decode a series over a whole window. Slots without a sample get status
+// and value zero. Only the blocks that start before the given offset are read, and
+// with staged set, the staged samples are laid over them:
+void
+store_window (const struct store_rod *rod, const int series, const uint32_t window, const uint64_t before, const bool staged, int16_t *value, uint8_t *status)
+{
+	memset(value, 0, STORE_WINDOW_SLOTS * sizeof(*value));
+	memset(status, 0, STORE_WINDOW_SLOTS);
+
+	if (series < 0 || (uint32_t) series >= rod->header.nseries)
+		return;
+
+	for (size_t i = index_find(rod, window); i < rod->nindex && rod->index[i].window == window; i++)
+		if (rod->index[i].offset < before)
+			block_decode(rod->map + rod->index[i].offset, series, value, status);
+
+	if (!staged)
+		return;
+
+	if (rod->head != NULL && rod->head->used && rod->head->window == window)
+		window_overlay(rod->head, series, value, status);
+
+	if (rod->late != NULL && rod->late->used && rod->late->window == window)
+		window_overlay(rod->late, series, value, status);
+}
+
+// Call back for every sample of a series at or after from, and before to,
+// in order of time. Returns the number of samples:
+size_t
+store_scan (struct store_rod *rod, const int series, const uint32_t from, const uint32_t to, store_scan_cb cb, void *arg)
+{
+	const uint64_t first = ((uint64_t) from + STORE_PERIOD_SEC - 1) / STORE_PERIOD_SEC;
+	const uint64_t last  = ((uint64_t) to + STORE_PERIOD_SEC - 1) / STORE_PERIOD_SEC;
+	int16_t value[STORE_WINDOW_SLOTS];
+	uint8_t status[STORE_WINDOW_SLOTS];
+	uint32_t window = first / STORE_WINDOW_SLOTS;
+	size_t n = 0;
+
+	if (series < 0 || (uint32_t) series >= rod->header.nseries || first >= last)
+		return 0;
+
+	if (!store_refresh(rod))
+		return 0;
+
+	while (store_next(rod, window, &window) && (uint64_t) window * STORE_WINDOW_SLOTS < last) {
+		const uint64_t base = (uint64_t) window * STORE_WINDOW_SLOTS;
+
+		store_window(rod, series, window, UINT64_MAX, true, value, status);
+
+		for (size_t slot = 0; slot < STORE_WINDOW_SLOTS; slot++) {
+			const struct store_sample sample = {
+				.time	= (base + slot) * STORE_PERIOD_SEC,
+				.value	= value[slot],
+				.status	= status[slot],
+			};
+
+			if (status[slot] == 0 || base + slot < first || base + slot >= last)
+				continue;
+
+			cb(arg, &sample);
+			n++;
+		}
+
+		if (window++ == UINT32_MAX)
+			break;
+	}
+
+	return n;
+}
+
+// Pick the coarsest resolution that has at least the given number of
+// buckets in a time range. Short ranges get the samples themselves:
+enum store_level
+store_level (const uint32_t from, const uint32_t to, const size_t points)
+{
+	if (to <= from)
+		return STORE_SLOT;
+
+	for (enum store_level level = STORE_MONTH; level > STORE_SLOT; level--)
+		if ((size_t) (bucket_of(level, to - 1) - bucket_of(level, from)) + 1 >= points)
+			return level;
+
+	return STORE_SLOT;
+}
+
+// Passes the samples of a range on as rollups of one:
+struct scan_rollup {
+	store_rollup_cb	cb;
+	void		*arg;
+};
+
+static void
+sample_rollup (void *arg, const struct store_sample *sample)
+{
+	const struct scan_rollup *sr = arg;
+	struct bucket b = { 0 };
+	struct store_rollup r;
+
+	bucket_add(&b, sample->value, sample->status);
+
+	r.time   = sample->time;
+	r.count  = b.count;
+	r.sum    = b.sum;
+	r.min    = b.min;
+	r.max    = b.max;
+	r.status = b.status;
+	sr->cb(sr->arg, &r);
+}
+
+// Call back for the rollup of every bucket of a series at a resolution
+// that has samples, from the bucket that from falls in to the one before
+// to, in order of time. Returns the number of rollups:
+size_t
+store_rollups (struct store_rod *rod, const int series, const enum store_level level, const uint32_t from, const uint32_t to, store_rollup_cb cb, void *arg)
+{
+	struct scan_rollup sr = { cb, arg };
+	uint32_t last;
+	size_t n = 0;
+
+	if (series < 0 || (uint32_t) series >= rod->header.nseries || to <= from)
+		return 0;
+
+	if (level == STORE_SLOT)
+		return store_scan(rod, series, from, to, sample_rollup, &sr);
+
+	if (!store_refresh(rod))
+		return 0;
+
+	last = bucket_of(level, to - 1);
+
+	for (uint32_t b = bucket_of(level, from); b <= last; b++) {
+		struct store_rollup r;
+		struct bucket bk;
+
+		rollup_get(rod, level, series, b, true, &bk);
+
+		if (bk.status == 0)
+			continue;
+
+		r.time   = bucket_start(level, b);
+		r.count  = bk.count;
+		r.sum    = bk.sum;
+		r.min    = bk.min;
+		r.max    = bk.max;
+		r.status = bk.status;
+		cb(arg, &r);
+		n++;
+	}
+
+	return n;
+}
@@ -0,0 +1,71 @@
+// Sampling period of the store in seconds. Sample times are rounded down to
+// a slot of this length, and a later sample replaces an earlier one in the
+// same slot. The period is the firmware's shortest wakeup interval, so that
+// every wakeup's readings get a slot of their own:
+#define STORE_PERIOD_SEC	300
+
+// Slots per window. Every block holds one window of one probe, four days at
+// the sampling period:
+#define STORE_WINDOW_SLOTS	1152
+
+// Largest number of sensors per probe:
+#define STORE_SERIES_MAX	32
+
+// Every open rod takes two file descriptors. The least recently used rods
+// are closed to keep this many open, or a quarter of the process's limit on
+// descriptors if that is less:
+#define STORE_RODS_OPEN		65536
+
+// A sample as read back. The value is in 1/16 degrees C, the status is the
+// sensor status, which is never zero for a stored sample:
+struct store_sample {
+	uint32_t	time;
+	int16_t		value;
+	uint8_t		status;
+};
+
+// Resolutions of a range query: the samples themselves, or their rollups:
+enum store_level {
+	STORE_SLOT,
+	STORE_HOUR,
+	STORE_DAY,
+	STORE_MONTH,
+};
+
+// A rollup of a series over a bucket of time. Only successful readings go
+// into the count, the sum, the minimum and the maximum, in 1/16 degrees C;
+// the status is the highest one seen:
+struct store_rollup {
+	uint32_t	time;		// Start of the bucket
+	uint32_t	count;
+	int32_t		sum;
+	int16_t		min;
+	int16_t		max;
+	uint8_t		status;
+};
+
+typedef void (*store_scan_cb) (void *arg, const struct store_sample *sample);
+typedef void (*store_rollup_cb) (void *arg, const struct store_rollup *rollup);
+
+struct store;
+struct store_rod;
+
+struct store *store_open (const char *dir, const bool writable);
+bool store_list (struct store *store, uint32_t **chipids, size_t *n);
+bool store_sync (struct store *store);
+void store_close (struct store *store);
+struct store_rod *store_rod (struct store *store, const uint32_t chipid, const bool create);
+void store_release (struct store_rod *rod);
+int store_series (struct store_rod *rod, const uint8_t *rom, const bool create);
+size_t store_nseries (const struct store_rod *rod);
+const uint8_t *store_rom (const struct store_rod *rod, const int series);
+bool store_append (struct store_rod *rod, const int series, const uint32_t time, const int16_t value, const uint8_t status);
+bool store_refresh (struct store_rod *rod);
+uint64_t store_size (const struct store_rod *rod);
+uint64_t store_written (const struct store_rod *rod, const uint32_t window);
+size_t store_staged (const struct store_rod *rod, uint32_t *windows);
+bool store_next (const struct store_rod *rod, const uint32_t from, uint32_t *window);
+void store_window (const struct store_rod *rod, const int series, const uint32_t window, const uint64_t before, const bool staged, int16_t *value, uint8_t *status);
+size_t store_scan (struct store_rod *rod, const int series, const uint32_t from, const uint32_t to, store_scan_cb cb, void *arg);
+enum store_level store_level (const uint32_t from, const uint32_t to, const size_t points);
+size_t store_rollups (struct store_rod *rod, const int series, const enum store_level level, const uint32_t from, const uint32_t to, store_rollup_cb cb, void *arg);
@@ -0,0 +1,425 @@
+// Write-ahead log for the ingest server, with group commit.
+//
+// An upload may only be acknowledged once it is on disk, because the probe
+// drops its records when it sees the acknowledgement. One fsync per upload
+// would cap the server at what the disk can sync. Instead, uploads are
+// appended to a buffer in memory, and a commit thread writes out all uploads
+// that arrived within a short window with a single write and fdatasync, then
+// tells the workers how far the log is on disk. While one batch is on its way
+// to disk, the next collects in a second buffer.
+//
+// The log is a series of numbered segment files. At a checkpoint, the server
+// starts a new segment, syncs the time-series store, and removes the older
+// segments, whose uploads are now in the store. On startup, the segments that
+// are left are replayed. A record torn by a crash is cut off.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "crc.h"
+#include "wal.h"
+
+// Segment file names, and the largest number of segments we replay:
+#define SEGMENT_FMT	"wal.%08u"
+#define SEGMENTS_MAX	4096
+
+// Record header, followed by the body:
+struct record {
+	uint32_t	len;		// Length of the body
+	uint32_t	time;		// Time of arrival
+	uint16_t	crc;		// Of the time and the body
+	uint8_t		binary;		// Whether the body is the binary payload
+	uint8_t		pad;
+};
+
+struct wal {
+	char		*dir;
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	arrived;	// Data arrived, or a rotation is due
+	pthread_cond_t	committed;	// A commit finished
+	wal_commit_cb	commit;
+	void		*arg;
+	int		fd;
+	uint32_t	segment;	// Current segment
+	bool		rotate;		// Whether to start a new segment
+	uint8_t		*buf[2];
+	int		fill;		// Buffer being filled
+	size_t		len;		// Bytes in that buffer
+	struct timespec	first;		// Arrival of its first record
+	uint64_t	appended;	// Bytes appended since startup
+	uint64_t	durable;	// Bytes on disk since startup
+};
+
+// Sync the directory, so that created and removed segments are durable
+static void
+dir_sync (const struct wal *wal)
+{
+	int fd;
+
+	if ((fd = open(wal->dir, O_RDONLY | O_DIRECTORY)) < 0)
+		return;
+
+	fsync(fd);
+	close(fd);
+}
+
+// Start a new segment
+static bool
+segment_open (struct wal *wal, const uint32_t segment)
+{
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/" SEGMENT_FMT, wal->dir, segment);
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+		perror(path);
+		return false;
+	}
+
+	dir_sync(wal);
+
+	if (wal->fd >= 0)
+		close(wal->fd);
+
+	wal->fd      = fd;
+	wal->segment = segment;
+	return true;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+// List the segments in the directory, in order
+static size_t
+segment_list (const struct wal *wal, uint32_t *segments)
+{
+	struct dirent *de;
+	size_t n = 0;
+	DIR *dir;
+
+	if ((dir = opendir(wal->dir)) == NULL)
+		return 0;
+
+	while ((de = readdir(dir)) != NULL && n < SEGMENTS_MAX) {
+		char tail;
+
+		if (sscanf(de->d_name, SEGMENT_FMT "%c", &segments[n], &tail) == 1)
+			n++;
+	}
+
+	closedir(dir);
+	qsort(segments, n, sizeof(*segments), compare);
+	return n;
+}
+
+// Replay a segment, return false if it ends in a torn record
+static bool
+segment_replay (const struct wal *wal, const uint32_t segment, wal_replay_cb replay, void *arg)
+{
+	char path[4096];
+	struct stat st;
+	uint8_t *data;
+	size_t off = 0;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/" SEGMENT_FMT, wal->dir, segment);
+
+	if ((fd = open(path, O_RDWR)) < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		return true;
+	}
+
+	if ((data = malloc(st.st_size + 1)) == NULL || read(fd, data, st.st_size) != st.st_size) {
+		perror(path);
+		free(data);
+		close(fd);
+		return true;
+	}
+
+	while (off + sizeof(struct record) <= (size_t) st.st_size) {
+		struct record rec;
+		const uint8_t *body = data + off + sizeof(rec);
+
+		memcpy(&rec, data + off, sizeof(rec));
+
+		if (off + sizeof(rec) + rec.len > (size_t) st.st_size)
+			break;
+
+		if (rec.crc != crc16(body, rec.len, crc16(&rec.time, sizeof(rec.time), 0xFFFF)))
+			break;
+
+		replay(arg, rec.time, rec.binary, body, rec.len);
+		off += sizeof(rec) + rec.len;
+	}
+
+	if (off < (size_t) st.st_size) {
+		fprintf(stderr, "%s: cutting off torn record at %zu\n", path, off);
+		if (ftruncate(fd, off) < 0)
+			perror(path);
+	}
+
+	free(data);
+	close(fd);
+	return off == (size_t) st.st_size;
+}
+
+// Open the log in a directory, replay the segments in it, and start a new
+// segment after them. The replayed segments stay until they are removed:
+struct wal *
+wal_open (const char *dir, wal_replay_cb replay, void *arg)
+{
+	static uint32_t segments[SEGMENTS_MAX];
+	pthread_condattr_t attr;
+	struct wal *wal;
+	size_t n;
+
+	if ((wal = calloc(1, sizeof(*wal))) == NULL)
+		return NULL;
+
+	wal->fd = -1;
+
+	if ((wal->dir = strdup(dir)) == NULL
+	 || (wal->buf[0] = malloc(WAL_PENDING_MAX)) == NULL
+	 || (wal->buf[1] = malloc(WAL_PENDING_MAX)) == NULL)
+		return NULL;
+
+	pthread_mutex_init(&wal->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wal->arrived, &attr);
+	pthread_cond_init(&wal->committed, NULL);
+
+	n = segment_list(wal, segments);
+
+	for (size_t i = 0; i < n; i++) {
+		fprintf(stderr, "Replaying " SEGMENT_FMT "\n", segments[i]);
+		segment_replay(wal, segments[i], replay, arg);
+	}
+
+	if (!segment_open(wal, (n > 0) ? segments[n - 1] + 1 : 1))
+		return NULL;
+
+	return wal;
+}
+
+// Write all of a buffer, or die: without the log, nothing may be
+// acknowledged any more
+static void
+write_all (const struct wal *wal, const uint8_t *buf, size_t len)
+{
+	while (len > 0) {
+		const ssize_t n = write(wal->fd, buf, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0) {
+			perror("wal: write");
+			exit(1);
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	if (fdatasync(wal->fd) < 0) {
+		perror("wal: fdatasync");
+		exit(1);
+	}
+}
+
+// Commit thread
+static void *
+wal_run (void *arg)
+{
+	struct wal *wal = arg;
+
+	pthread_mutex_lock(&wal->lock);
+
+	for (;;) {
+		struct timespec deadline = wal->first;
+		uint64_t lsn;
+		uint8_t *buf;
+		size_t len;
+
+		if (wal->len == 0 && !wal->rotate) {
+			pthread_cond_wait(&wal->arrived, &wal->lock);
+			continue;
+		}
+
+		// Give concurrent uploads the rest of the window to join:
+		deadline.tv_nsec += WAL_WINDOW_US * 1000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		while (wal->len > 0 && wal->len < WAL_BATCH_MAX && !wal->rotate)
+			if (pthread_cond_timedwait(&wal->arrived, &wal->lock, &deadline) == ETIMEDOUT)
+				break;
+
+		// Swap buffers, and write out the batch:
+		buf = wal->buf[wal->fill];
+		len = wal->len;
+		lsn = wal->appended;
+		wal->fill ^= 1;
+		wal->len = 0;
+
+		pthread_mutex_unlock(&wal->lock);
+		if (len > 0)
+			write_all(wal, buf, len);
+		pthread_mutex_lock(&wal->lock);
+
+		wal->durable = lsn;
+
+		// Everything up to here is in the old segment:
+		if (wal->rotate) {
+			if (!segment_open(wal, wal->segment + 1))
+				exit(1);
+
+			wal->rotate = false;
+		}
+
+		pthread_cond_broadcast(&wal->committed);
+
+		if (wal->commit != NULL && len > 0) {
+			pthread_mutex_unlock(&wal->lock);
+			wal->commit(wal->arg);
+			pthread_mutex_lock(&wal->lock);
+		}
+	}
+
+	return NULL;
+}
+
+// Start the commit thread. The callback runs after each commit
+bool
+wal_start (struct wal *wal, wal_commit_cb commit, void *arg)
+{
+	wal->commit = commit;
+	wal->arg    = arg;
+
+	if ((errno = pthread_create(&wal->thread, NULL, wal_run, wal)) != 0) {
+		perror("wal: pthread_create");
+		return false;
+	}
+
+	return true;
+}
+
+// Append an upload, return the position the log must reach on disk before
+// the upload may be acknowledged
+uint64_t
+wal_append (struct wal *wal, const uint32_t time, const bool binary, const void *body, const size_t len)
+{
+	struct record rec = {
+		.len	= len,
+		.time	= time,
+		.crc	= crc16(body, len, crc16(&time, sizeof(time), 0xFFFF)),
+		.binary	= binary,
+	};
+	const size_t size = sizeof(rec) + len;
+	uint64_t lsn;
+
+	pthread_mutex_lock(&wal->lock);
+
+	// Wait for the commit thread to catch up:
+	while (wal->len > 0 && wal->len + size > WAL_PENDING_MAX)
+		pthread_cond_wait(&wal->committed, &wal->lock);
+
+	if (wal->len == 0)
+		clock_gettime(CLOCK_MONOTONIC, &wal->first);
+
+	memcpy(wal->buf[wal->fill] + wal->len, &rec, sizeof(rec));
+	memcpy(wal->buf[wal->fill] + wal->len + sizeof(rec), body, len);
+	wal->len      += size;
+	wal->appended += size;
+	lsn = wal->appended;
+
+	pthread_cond_signal(&wal->arrived);
+	pthread_mutex_unlock(&wal->lock);
+	return lsn;
+}
+
+// Position of the last appended upload
+uint64_t
+wal_appended (struct wal *wal)
+{
+	uint64_t lsn;
+
+	pthread_mutex_lock(&wal->lock);
+	lsn = wal->appended;
+	pthread_mutex_unlock(&wal->lock);
+	return lsn;
+}
+
+// Position up to which the log is on disk
+uint64_t
+wal_durable (struct wal *wal)
+{
+	uint64_t lsn;
+
+	pthread_mutex_lock(&wal->lock);
+	lsn = wal->durable;
+	pthread_mutex_unlock(&wal->lock);
+	return lsn;
+}
+
+// Start a new segment once everything appended so far is on disk, return
+// the number of the last segment before it
+uint32_t
+wal_rotate (struct wal *wal)
+{
+	uint32_t segment;
+
+	pthread_mutex_lock(&wal->lock);
+	segment = wal->segment;
+	wal->rotate = true;
+	pthread_cond_signal(&wal->arrived);
+
+	while (wal->segment == segment)
+		pthread_cond_wait(&wal->committed, &wal->lock);
+
+	pthread_mutex_unlock(&wal->lock);
+	return segment;
+}
+
+// Remove the segments up to and including the given one, but never the
+// current one
+void
+wal_remove (struct wal *wal, const uint32_t segment)
+{
+	static uint32_t segments[SEGMENTS_MAX];
+	const size_t n = segment_list(wal, segments);
+	uint32_t current;
+	char path[4096];
+
+	pthread_mutex_lock(&wal->lock);
+	current = wal->segment;
+	pthread_mutex_unlock(&wal->lock);
+
+	for (size_t i = 0; i < n && segments[i] <= segment && segments[i] != current; i++) {
+		snprintf(path, sizeof(path), "%s/" SEGMENT_FMT, wal->dir, segments[i]);
+		if (unlink(path) < 0)
+			perror(path);
+	}
+
+	dir_sync(wal);
+}
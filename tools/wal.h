@@ -0,0 +1,22 @@
+// Group commit: a commit waits up to this long after the first upload of a
+// batch arrives, for others to join it, unless the batch is this big. With no
+// wait, a batch is what arrived while the previous commit was syncing, which
+// is enough on a disk that syncs quickly:
+#define WAL_WINDOW_US	0
+#define WAL_BATCH_MAX	(1 << 20)
+
+// Largest amount of data waiting for a commit. Beyond this, appending waits:
+#define WAL_PENDING_MAX	(8 << 20)
+
+typedef void (*wal_replay_cb) (void *arg, const uint32_t time, const bool binary, const uint8_t *body, const size_t len);
+typedef void (*wal_commit_cb) (void *arg);
+
+struct wal;
+
+struct wal *wal_open (const char *dir, wal_replay_cb replay, void *arg);
+bool wal_start (struct wal *wal, wal_commit_cb commit, void *arg);
+uint64_t wal_append (struct wal *wal, const uint32_t time, const bool binary, const void *body, const size_t len);
+uint64_t wal_appended (struct wal *wal);
+uint64_t wal_durable (struct wal *wal);
+uint32_t wal_rotate (struct wal *wal);
+void wal_remove (struct wal *wal, const uint32_t segment);
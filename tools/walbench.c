@@ -0,0 +1,200 @@
+// Benchmark of the ingest server's write-ahead log. A number of threads, like
+// the server's workers, each append uploads of a given size and wait until
+// they are on disk, as they would before acknowledging them. This runs twice:
+// once with a write and fdatasync per upload, and once through the group
+// commit in wal.c. For each, it prints the acknowledged uploads per second
+// and the average and largest wait:
+//
+//	walbench dir [threads [seconds [size]]]
+//
+// The directory should be on the disk the store will be on. The benchmark
+// leaves a log file and a log segment in it.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wal.h"
+
+// Largest number of threads:
+#define THREADS_MAX	256
+
+struct bench {
+	pthread_t	thread;
+	uint64_t	uploads;
+	double		wait_sum;
+	double		wait_max;
+};
+
+static struct bench bench[THREADS_MAX];
+static volatile bool stop;
+static size_t size;
+static int fd;
+static struct wal *wal;
+
+// Signals the waiting threads after each commit:
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t committed = PTHREAD_COND_INITIALIZER;
+
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+account (struct bench *b, const double start)
+{
+	const double wait = now() - start;
+
+	b->uploads++;
+	b->wait_sum += wait;
+	if (wait > b->wait_max)
+		b->wait_max = wait;
+}
+
+// One write and one fdatasync per upload
+static void *
+run_sync (void *arg)
+{
+	struct bench *b = arg;
+	uint8_t body[size];
+
+	memset(body, 'x', size);
+
+	while (!stop) {
+		const double start = now();
+
+		if (write(fd, body, size) != (ssize_t) size || fdatasync(fd) < 0) {
+			perror("write");
+			exit(1);
+		}
+
+		account(b, start);
+	}
+
+	return NULL;
+}
+
+static void
+on_commit (void *arg)
+{
+	(void) arg;
+
+	pthread_mutex_lock(&lock);
+	pthread_cond_broadcast(&committed);
+	pthread_mutex_unlock(&lock);
+}
+
+// Group commit through the log
+static void *
+run_wal (void *arg)
+{
+	struct bench *b = arg;
+	uint8_t body[size];
+
+	memset(body, 'x', size);
+
+	while (!stop) {
+		const double start = now();
+		const uint64_t lsn = wal_append(wal, time(NULL), true, body, size);
+
+		pthread_mutex_lock(&lock);
+		while (wal_durable(wal) < lsn)
+			pthread_cond_wait(&committed, &lock);
+		pthread_mutex_unlock(&lock);
+
+		account(b, start);
+	}
+
+	return NULL;
+}
+
+static void
+replay (void *arg, const uint32_t time, const bool binary, const uint8_t *body, const size_t len)
+{
+	(void) arg;
+	(void) time;
+	(void) binary;
+	(void) body;
+	(void) len;
+}
+
+static void
+run (const char *name, void *(*fn) (void *), const long threads, const long seconds)
+{
+	uint64_t uploads = 0;
+	double wait_sum = 0, wait_max = 0;
+
+	memset(bench, 0, sizeof(bench));
+	stop = false;
+
+	for (long i = 0; i < threads; i++)
+		if ((errno = pthread_create(&bench[i].thread, NULL, fn, &bench[i])) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+
+	sleep(seconds);
+	stop = true;
+
+	for (long i = 0; i < threads; i++) {
+		pthread_join(bench[i].thread, NULL);
+		uploads  += bench[i].uploads;
+		wait_sum += bench[i].wait_sum;
+		if (bench[i].wait_max > wait_max)
+			wait_max = bench[i].wait_max;
+	}
+
+	printf("%-14s %10.0f uploads/s, wait %.3f ms average, %.3f ms max\n", name,
+		(double) uploads / seconds,
+		uploads ? wait_sum / uploads * 1e3 : 0, wait_max * 1e3);
+}
+
+int
+main (int argc, char **argv)
+{
+	const long threads = (argc > 2) ? atol(argv[2]) : 4;
+	const long seconds = (argc > 3) ? atol(argv[3]) : 5;
+	char path[4096];
+
+	size = (argc > 4) ? (size_t) atol(argv[4]) : 600;
+
+	if (argc < 2 || threads < 1 || threads > THREADS_MAX || seconds < 1 || size < 1) {
+		fprintf(stderr, "Usage: %s dir [threads [seconds [size]]]\n", argv[0]);
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/walbench.log", argv[1]);
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) < 0) {
+		perror(path);
+		return 1;
+	}
+
+	run("fdatasync", run_sync, threads, seconds);
+	close(fd);
+
+	if ((wal = wal_open(argv[1], replay, NULL)) == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	wal_remove(wal, UINT32_MAX);
+
+	if (!wal_start(wal, on_commit, NULL))
+		return 1;
+
+	run("group commit", run_wal, threads, seconds);
+	return 0;
+}